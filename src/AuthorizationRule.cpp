@@ -673,7 +673,7 @@ RuleImpl::evaluateSessionOwner(const AuthItemRef &inRight, const Rule &inRule, c
 	
 	Credential sessionCredential;
 	uid_t uid = auth.session().originatorUid();
-	Server::active().longTermActivity();
+	Server::active().longTermWait();
 	struct passwd *pw = getpwuid(uid);
 	if (pw != NULL) {
 		// avoid hinting a locked account
@@ -788,7 +788,7 @@ RuleImpl::evaluateUserCredentialForRight(const AuthorizationToken &auth, const A
 	if (mGroupName.length())
 	{
 		const char *groupname = mGroupName.c_str();
-		Server::active().longTermActivity();
+		Server::active().longTermWait();
 
 		if (!groupname)
 			return errAuthorizationDenied;
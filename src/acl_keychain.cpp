@@ -85,7 +85,7 @@ bool KeychainPromptAclSubject::validate(const AclValidationContext &context,
 		
 		// determine signed/validity status of client, without reference to any particular Code Requirement
 		SecCodeRef clientCode = process.currentGuest();
-		Server::active().longTermActivity();
+		Server::active().longTermWait();
 		OSStatus validation = clientCode ? SecCodeCheckValidity(clientCode, kSecCSDefaultFlags, NULL) : errSecCSStaticCodeNotFound;
 		switch (validation) {
 		case noErr:							// client is signed and valid
@@ -94,8 +94,39 @@ void SecurityServerAcl::validate(AclAuthorization auth, const AccessCredentials
 
 void SecurityServerAcl::validate(AclAuthorization auth, const Context &context, Database *db)
 {
+	ValidationBatch *batch = ValidationBatch::current();
+	if (batch && batch->passed(this, auth))
+		return;
 	validate(auth,
 		context.get<AccessCredentials>(CSSM_ATTRIBUTE_ACCESS_CREDENTIALS), db);
+	if (batch)
+		batch->pass(this, auth);
+}
+
+
+//
+// Validation batches nest per thread
+//
+struct CurrentBatch {
+	CurrentBatch() : batch(NULL) { }
+	SecurityServerAcl::ValidationBatch *batch;
+};
+static ThreadNexus<CurrentBatch> currentBatch;
+
+SecurityServerAcl::ValidationBatch::ValidationBatch()
+	: mPrevious(currentBatch().batch)
+{
+	currentBatch().batch = this;
+}
+
+SecurityServerAcl::ValidationBatch::~ValidationBatch()
+{
+	currentBatch().batch = mPrevious;
+}
+
+SecurityServerAcl::ValidationBatch *SecurityServerAcl::ValidationBatch::current()
+{
+	return currentBatch().batch;
 }
 
 
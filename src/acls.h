@@ -46,6 +46,7 @@
 #include <security_cdsa_utilities/acl_preauth.h>
 #include <security_cdsa_utilities/acl_prompted.h>
 #include <security_cdsa_utilities/acl_threshold.h>
+#include <set>
 
 using namespace SecurityServer;
 
@@ -83,6 +84,33 @@ public:
 
 	// aclSequence is taken to serialize ACL validations to pick up mutual changes
 	Mutex aclSequence;
+
+public:
+	//
+	// While a ValidationBatch is in scope on a thread, context-based validations
+	// on that thread are evaluated at most once per (ACL, authorization) pair;
+	// repeats pass without re-evaluation. This is for batched crypto IPCs, to check
+	// each key's ACL once per request rather than once per operation (those come
+	// with their ucsp.defs routines). The caller must keep the ACL-bearing objects
+	// alive for the life of the batch.
+	//
+	class ValidationBatch {
+	public:
+		ValidationBatch();
+		~ValidationBatch();
+		
+		bool passed(const SecurityServerAcl *acl, AclAuthorization auth) const
+		{ return mPassed.find(Entry(acl, auth)) != mPassed.end(); }
+		void pass(const SecurityServerAcl *acl, AclAuthorization auth)
+		{ mPassed.insert(Entry(acl, auth)); }
+		
+		static ValidationBatch *current();
+		
+	private:
+		typedef std::pair<const SecurityServerAcl *, AclAuthorization> Entry;
+		ValidationBatch *mPrevious;		// enclosing batch (if any)
+		std::set<Entry> mPassed;
+	};
 };
 
 
@@ -84,7 +84,7 @@ SecurityAgentConnection::SecurityAgentConnection(const AuthHostType type, Sessio
     mAuditToken(Server::connection().auditToken())
 {
 	// this may take a while
-	Server::active().longTermActivity();
+	Server::active().longTermWait();
     secdebug("SecurityAgentConnection", "new SecurityAgentConnection(%p)", this);
 }
 
@@ -829,26 +829,26 @@ Reason QueryDBBlobSecret::query(DbHandle *dbHandleArray, uint8 dbHandleArrayCoun
 Reason QueryDBBlobSecret::accept(CssmManagedData &passphrase, 
 								 DbHandle *dbHandlesToAuthenticate, uint8 dbHandleCount, DbHandle *dbHandleAuthenticated)
 {
-	DbHandle *currHdl = dbHandlesToAuthenticate;
-	short index;
-	Boolean authenticated = false;
-	for (index=0; index < dbHandleCount && !authenticated; index++)
-	{
-		try 
-		{
-			RefPointer<KeychainDatabase> dbToUnlock = Server::keychain(*currHdl);
-			dbToUnlock->unlockDb(passphrase);
-			authenticated = true;
-			*dbHandleAuthenticated = *currHdl; // return the DbHandle that 'passphrase' authenticated with.
-		} 
-		catch (const CommonError &err) 
-		{
-			currHdl++; // we failed to authenticate with this one, onto the next one.  
+	// collect the databases (skipping bad handles) and try them all in one go
+	std::vector<RefPointer<KeychainDatabase> > dbs;
+	std::vector<DbHandle> handles;
+	for (short index = 0; index < dbHandleCount; index++) {
+		try {
+			dbs.push_back(Server::keychain(dbHandlesToAuthenticate[index]));
+			handles.push_back(dbHandlesToAuthenticate[index]);
+		} catch (const CommonError &err) {
+			// not a keychain handle; skip it
 		}
 	}
-	if ( !authenticated )
+	std::vector<CSSM_RETURN> results;
+	int unlocked = dbs.empty() ? -1 : KeychainDatabase::unlockAny(passphrase, dbs, &results);
+	IFDEBUG(for (size_t n = 0; n < results.size(); n++)
+		secdebug("kcsync", "keychain handle %#lx: passphrase %s (%d)", (unsigned long)handles[n],
+			results[n] == CSSM_OK ? "fits" : "does not fit", int(results[n])));
+	if (unlocked < 0)
 		return SecurityAgent::invalidPassphrase;
 	
+	*dbHandleAuthenticated = handles[unlocked]; // return the DbHandle that 'passphrase' authenticated with.
 	return SecurityAgent::noReason;
 }
 
@@ -104,7 +104,7 @@ ClientIdentification::GuestState *ClientIdentification::current() const
 	CFRef<CFDictionaryRef> attributes = (guestRef == kSecNoGuest)
 		? NULL
 		: makeCFDictionary(1, kSecGuestAttributeCanonical, CFTempNumber(guestRef).get());
-	Server::active().longTermActivity();
+	Server::active().longTermWait();
 	CFRef<SecCodeRef> code;
 	switch (OSStatus rc = SecCodeCopyGuestWithAttributes(processCode(),
 		attributes, kSecCSDefaultFlags, &code.aref())) {
@@ -239,7 +239,7 @@ bool CodeSignatures::verify(Process &process,
 		// If the ACL contains a code signature (requirement), we won't match against unsigned code at all.
 		// The legacy hash is ignored (it's for use by pre-Leopard systems).
 		secdebug("codesign", "CS requirement present; ignoring legacy hashes");
-		Server::active().longTermActivity();
+		Server::active().longTermWait();
 		switch (OSStatus rc = SecCodeCheckValidity(code, kSecCSDefaultFlags, requirement)) {
 		case noErr:
 			secdebug("codesign", "CS verify passed");
@@ -300,7 +300,7 @@ OSStatus CodeSignatures::matchSignedClientToLegacyACL(Process &process,
 	// Check whether we seem to be matching a legacy .Mac ACL against a member of the .Mac group
 	//
 	if (SecurityServerAcl::looksLikeLegacyDotMac(context)) {
-		Server::active().longTermActivity();
+		Server::active().longTermWait();
 		CFRef<SecRequirementRef> dotmac;
 		MacOSError::check(SecRequirementCreateGroup(CFSTR("dot-mac"), NULL, kSecCSDefaultFlags, &dotmac.aref()));
 		if (SecCodeCheckValidity(code, kSecCSDefaultFlags, dotmac) == noErr) {
@@ -350,7 +350,7 @@ OSStatus CodeSignatures::matchSignedClientToLegacyACL(Process &process,
 		CFRef<SecRequirementRef> apple;
 		MacOSError::check(SecRequirementCreateWithData(CFTempData(reqData, sizeof(reqData)),
 			kSecCSDefaultFlags, &apple.aref()));
-		Server::active().longTermActivity();
+		Server::active().longTermWait();
 		switch (OSStatus rc = SecCodeCheckValidity(code, kSecCSDefaultFlags, apple)) {
 		case noErr:
 			{
@@ -43,7 +43,7 @@ CredentialImpl::CredentialImpl(const uid_t uid, const string &username, const st
 
 CredentialImpl::CredentialImpl(const string &username, const string &password, bool shared) : mShared(shared), mRight(false), mName(username), mCreationTime(CFAbsoluteTimeGetCurrent()), mValid(false)
 {
-    Server::active().longTermActivity();
+    Server::active().longTermWait();
     const char *user = username.c_str();
     struct passwd *pw = getpwnam(user);
 
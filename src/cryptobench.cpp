@@ -0,0 +1,964 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// cryptobench - microbenchmarks for the database crypto core
+//
+#include "cryptobench.h"
+#include "server.h"
+#include "handles.h"
+#include "securearena.h"
+#include "verifycache.h"
+#include "machtime.h"
+#include <securityd_client/ssblob.h>
+#include <security_cdsa_client/cryptoclient.h>
+#include <security_cdsa_client/genkey.h>
+#include <security_cdsa_client/signclient.h>
+#include <security_utilities/devrandom.h>
+#include <security_utilities/handleobject.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace CssmClient;
+using LowLevelMemoryUtilities::fieldOffsetOf;
+
+
+//
+// Count allocations through the malloc logging hook (the one the malloc stack
+// logging tools use). This counts every thread's allocations, so run the benchmark
+// on an otherwise quiet securityd - which -B does, since it never enters service.
+//
+typedef void (malloc_logger_t)(uint32_t type, uintptr_t arg1, uintptr_t arg2,
+	uintptr_t arg3, uintptr_t result, uint32_t num_hot_frames_to_skip);
+extern "C" malloc_logger_t *malloc_logger;
+
+static const uint32_t mallocLogAllocate = 2;	// MALLOC_LOG_TYPE_ALLOCATE
+static volatile int64_t allocations;
+
+static void countAllocations(uint32_t type, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uint32_t)
+{
+	if (type & mallocLogAllocate)
+		__sync_fetch_and_add(&allocations, 1);
+}
+
+
+double CryptoBenchmark::targetSeconds = 0.5;
+
+static const char passphrase[] = "benchmark passphrase";
+static const size_t aclSizes[] = { 0, 256, 4096 };
+static const unsigned aclSizeCount = sizeof(aclSizes) / sizeof(aclSizes[0]);
+
+
+CryptoBenchmark::CryptoBenchmark(FILE *out)
+	: mOut(out)
+{
+	mCore.setup(NULL, StringData(passphrase));	// random salt
+	mCore.generateNewSecrets();
+}
+
+
+//
+// Run an operation until it has taken targetSeconds (and at least a few times),
+// and write a result line:
+//	case <tab> variant <tab> operations <tab> ops/s <tab> ns/op <tab> allocations/op
+//
+void CryptoBenchmark::measure(const char *name, const std::string &variant, Case &op)
+{
+	static const unsigned minimumCalls = 10;
+	op();		// warm up (and fail early)
+	
+	unsigned calls = 0;
+	malloc_logger = countAllocations;
+	int64_t startAllocations = allocations;
+	uint64_t start = mach_absolute_time();
+	double elapsed;
+	do {
+		op();
+		calls++;
+		elapsed = MachTime::nanoseconds(mach_absolute_time() - start);
+	} while (calls < minimumCalls || elapsed < targetSeconds * 1E9);
+	int64_t allocated = allocations - startAllocations;
+	malloc_logger = NULL;
+	
+	double ops = double(calls) * op.batch();
+	fprintf(mOut, "%s\t%s\t%.0f\t%.1f\t%.0f\t%.1f\n", name, variant.c_str(),
+		ops, ops * 1E9 / elapsed, elapsed / ops, allocated / ops);
+	fflush(mOut);
+}
+
+
+//
+// Generation of a database's operational secrets
+//
+void CryptoBenchmark::secrets()
+{
+	struct Generate : public Case {
+		void operator () () { DatabaseCryptoCore core; core.generateNewSecrets(); }
+	} generate;
+	measure("generateNewSecrets", "-", generate);
+}
+
+
+//
+// Master key derivation (PBKDF2), alone and as a batch of salts
+//
+void CryptoBenchmark::derivation()
+{
+	struct Derive : public Case {
+		Derive(unsigned n) : count(n), salts(n * DatabaseCryptoCore::saltSize), masters(n)
+		{ Server::active().random(&salts[0], salts.size()); }
+		
+		void operator () ()
+		{ DatabaseCryptoCore::deriveDbMasterKeys(StringData(passphrase), &salts[0], count, &masters[0]); }
+		unsigned batch() const { return count; }
+		
+		unsigned count;
+		std::vector<uint8> salts;
+		std::vector<CssmClient::Key> masters;
+	};
+	static const unsigned batches[] = { 1, 8 };
+	for (unsigned n = 0; n < sizeof(batches) / sizeof(batches[0]); n++) {
+		Derive derive(batches[n]);
+		char variant[40];
+		snprintf(variant, sizeof(variant), "batch=%u", batches[n]);
+		measure("deriveDbMasterKey", variant, derive);
+	}
+}
+
+
+//
+// Passphrase validation (including its derivation), right and wrong
+//
+void CryptoBenchmark::validation()
+{
+	struct Validate : public Case {
+		Validate(DatabaseCryptoCore &c, const char *pp) : core(c), passphrase(pp) { }
+		void operator () () { core.validatePassphrase(StringData(passphrase)); }
+		
+		DatabaseCryptoCore &core;
+		const char *passphrase;
+	};
+	Validate right(mCore, passphrase);
+	measure("validatePassphrase", "match", right);
+	Validate wrong(mCore, "not the benchmark passphrase");
+	measure("validatePassphrase", "mismatch", wrong);
+}
+
+
+//
+// A passphrase tried on 50 synthetic keychain blobs, as keychain sync does it:
+// one blob at a time, and all of them in one go (tryPassphrase, which spreads
+// the work over the WorkPool). Half the blobs are sealed and half legacy, and
+// every fifth was made with another passphrase. That tryPassphrase tells exactly
+// those apart is checked first; the result goes out as a comment line, and a
+// failure fails the run.
+//
+void CryptoBenchmark::passphraseTrials()
+{
+	static const unsigned blobCount = 50;
+	static const char otherPassphrase[] = "not the benchmark passphrase";
+	std::vector<DbBlob *> blobs(blobCount);
+	DbBlob form;
+	memset(&form, 0, sizeof(form));
+	uint8 acl[64];
+	memset(acl, 0x5a, sizeof(acl));
+	CssmData publicAcl(acl, sizeof(acl)), privateAcl(acl, sizeof(acl));
+	bool legacy = Server::legacyBlobs();
+	try {
+		for (unsigned n = 0; n < blobCount; n++) {
+			Server::active().legacyBlobs(n % 2);
+			DatabaseCryptoCore core;
+			core.setup(NULL, StringData(n % 5 == 4 ? otherPassphrase : passphrase));
+			core.generateNewSecrets();
+			blobs[n] = core.encodeCore(form, publicAcl, privateAcl);
+		}
+		Server::active().legacyBlobs(legacy);
+		
+		struct Trials : public Case {
+			Trials(const std::vector<DbBlob *> &b, unsigned g)
+				: blobs(b.begin(), b.end()), group(g), masters(b.size()), results(b.size()) { }
+			void operator () ()
+			{
+				for (unsigned n = 0; n < blobs.size(); n += group)
+					DatabaseCryptoCore::tryPassphrase(StringData(passphrase),
+						&blobs[n], group, &masters[n], &results[n]);
+			}
+			unsigned batch() const { return blobs.size(); }
+			
+			std::vector<const DbBlob *> blobs;
+			unsigned group;
+			std::vector<CssmClient::Key> masters;
+			std::vector<CSSM_RETURN> results;
+		};
+		
+		Trials all(blobs, blobCount);
+		all();
+		bool ok = true;
+		for (unsigned n = 0; n < blobCount; n++)
+			if ((all.results[n] == CSSM_OK) != (n % 5 != 4))
+				ok = false;
+		fprintf(mOut, "# tryPassphrase: %u blobs %s\n", blobCount,
+			ok ? "ok" : "FAILED (passphrase fit the wrong blobs)");
+		fflush(mOut);
+		if (!ok)
+			CssmError::throwMe(CSSM_ERRCODE_INTERNAL_ERROR);
+		
+		Trials single(blobs, 1);
+		measure("tryPassphrase", "blobs=50,serial", single);
+		measure("tryPassphrase", "blobs=50,parallel", all);
+	} catch (...) {
+		Server::active().legacyBlobs(legacy);
+		for (unsigned n = 0; n < blobCount; n++)
+			Allocator::standard().free(blobs[n]);
+		throw;
+	}
+	for (unsigned n = 0; n < blobCount; n++)
+		Allocator::standard().free(blobs[n]);
+}
+
+
+//
+// Both blob formats must read back what they wrote, and must turn away a blob
+// that was altered (in its header, public ACL, encrypted section or signature)
+// or that is read with other secrets. That's checked first, for database and key
+// blobs; the results go out as comment lines, and a failure fails the run.
+//
+static bool dbBlobAccepted(const std::vector<uint8> &bytes, const CssmClient::Key &master,
+	const CssmData &expectedAcl)
+{
+	std::vector<uint8> copy(bytes);
+	const DbBlob *blob = (const DbBlob *)&copy[0];
+	void *privateAcl = NULL;
+	try {
+		DatabaseCryptoCore core;
+		core.setup(blob, master);
+		core.decodeCore(blob, &privateAcl);
+	} catch (const CommonError &) {
+		return false;
+	}
+	bool same = !memcmp(privateAcl, expectedAcl.data(), expectedAcl.length());
+	SecureArena::shared().free(privateAcl);
+	return same;
+}
+
+//
+// The decoded key may be a reference key, so we can't compare key bits; instead,
+// it must decrypt what the original encrypted (both are AES keys)
+//
+static bool sameKey(const CssmClient::Key &original, const CssmClient::Key &decoded)
+{
+	uint8 block[16];
+	for (unsigned n = 0; n < sizeof(block); n++)
+		block[n] = 0xc0 + n;
+	CssmData clear(block, sizeof(block)), cipher, plain, remData;
+	Encrypt encrypt(Server::csp(), CSSM_ALGID_AES);
+	encrypt.mode(CSSM_ALGMODE_ECB);
+	encrypt.padding(CSSM_PADDING_NONE);
+	encrypt.key(original);
+	cipher.length(encrypt.encrypt(clear, cipher, remData));
+	Decrypt decrypt(Server::csp(), CSSM_ALGID_AES);
+	decrypt.mode(CSSM_ALGMODE_ECB);
+	decrypt.padding(CSSM_PADDING_NONE);
+	decrypt.key(decoded);
+	plain.length(decrypt.decrypt(cipher, plain, remData));
+	bool same = plain.length() == sizeof(block) && !memcmp(plain.data(), block, sizeof(block));
+	Server::csp()->allocator().free(cipher.data());
+	Server::csp()->allocator().free(plain.data());
+	return same;
+}
+
+static bool keyBlobAccepted(const std::vector<uint8> &bytes, const DatabaseCryptoCore &core,
+	const CssmClient::Key &expectedKey, const CssmData &expectedAcl)
+{
+	std::vector<uint8> copy(bytes);
+	CssmKey key;
+	void *publicAcl, *privateAcl = NULL;
+	size_t privateAclLength;
+	try {
+		core.decodeKeyCore((KeyBlob *)&copy[0], key, publicAcl, privateAcl, &privateAclLength);
+	} catch (const CommonError &) {
+		return false;
+	}
+	CssmClient::Key decoded(Server::csp(), key);
+	bool same = privateAclLength == expectedAcl.length()
+		&& !memcmp(privateAcl, expectedAcl.data(), expectedAcl.length())
+		&& sameKey(expectedKey, decoded);
+	SecureArena::shared().free(privateAcl);
+	return same;
+}
+
+static std::vector<uint8> flipped(const std::vector<uint8> &bytes, size_t offset)
+{
+	std::vector<uint8> copy(bytes);
+	copy[offset] ^= 0x01;
+	return copy;
+}
+
+void CryptoBenchmark::blobIntegrity(const CssmClient::Key &key, const CssmClient::Key &refKey)
+{
+	uint8 acl[64];
+	for (unsigned n = 0; n < sizeof(acl); n++)
+		acl[n] = n;
+	CssmData publicAcl(acl, 32), privateAcl(acl + 32, 32);
+	DbBlob form;
+	memset(&form, 0, sizeof(form));
+	
+	DatabaseCryptoCore stranger;			// other passphrase, other secrets
+	stranger.setup(NULL, StringData("not the benchmark passphrase"));
+	stranger.generateNewSecrets();
+	
+	bool legacy = Server::legacyBlobs();
+	bool allOK = true;
+	try {
+		for (unsigned format = 0; format < 2; format++) {
+			bool sealed = (format == 1);
+			Server::active().legacyBlobs(!sealed);
+			std::string failures;
+			
+			DbBlob *dbBlob = mCore.encodeCore(form, publicAcl, privateAcl);
+			std::vector<uint8> db((uint8 *)dbBlob, (uint8 *)dbBlob + dbBlob->totalLength);
+			size_t dbPublicAcl = (uint8 *)dbBlob->publicAclBlob() - (uint8 *)dbBlob;
+			Allocator::standard().free(dbBlob);
+			dbBlob = (DbBlob *)&db[0];
+			if ((dbBlob->version() == DatabaseCryptoCore::version_AES_GCM) != sealed)
+				failures += " db-version";
+			if (!dbBlobAccepted(db, mCore.masterKey(), privateAcl))
+				failures += " db-roundtrip";
+			if (dbBlobAccepted(db, stranger.masterKey(), privateAcl))
+				failures += " db-wrong-master";
+			if (dbBlobAccepted(flipped(db, fieldOffsetOf(&DbBlob::sequence)), mCore.masterKey(), privateAcl))
+				failures += " db-header";
+			if (dbBlobAccepted(flipped(db, dbPublicAcl), mCore.masterKey(), privateAcl))
+				failures += " db-public-acl";
+			if (dbBlobAccepted(flipped(db, db.size() - 1), mCore.masterKey(), privateAcl))
+				failures += " db-crypto";
+			if (dbBlobAccepted(flipped(db, fieldOffsetOf(&DbBlob::blobSignature)), mCore.masterKey(), privateAcl))
+				failures += " db-signature";
+			
+			KeyBlob *keyBlob = mCore.encodeKeyCore(*key, publicAcl, privateAcl, false);
+			std::vector<uint8> kb((uint8 *)keyBlob, (uint8 *)keyBlob + keyBlob->totalLength);
+			size_t kbUsage = (uint8 *)&keyBlob->header.KeyUsage - (uint8 *)keyBlob;
+			size_t kbPublicAcl = (uint8 *)keyBlob->publicAclBlob() - (uint8 *)keyBlob;
+			size_t kbSignature = (uint8 *)keyBlob->blobSignature - (uint8 *)keyBlob;
+			Allocator::standard().free(keyBlob);
+			keyBlob = (KeyBlob *)&kb[0];
+			if ((keyBlob->version() == DatabaseCryptoCore::version_AES_GCM) != sealed)
+				failures += " key-version";
+			if (!keyBlobAccepted(kb, mCore, key, privateAcl))
+				failures += " key-roundtrip";
+			if (keyBlobAccepted(kb, stranger, key, privateAcl))
+				failures += " key-wrong-secrets";
+			if (keyBlobAccepted(flipped(kb, kbUsage), mCore, key, privateAcl))
+				failures += " key-header";
+			if (keyBlobAccepted(flipped(kb, kbPublicAcl), mCore, key, privateAcl))
+				failures += " key-public-acl";
+			if (keyBlobAccepted(flipped(kb, kb.size() - 1), mCore, key, privateAcl))
+				failures += " key-crypto";
+			if (keyBlobAccepted(flipped(kb, kbSignature), mCore, key, privateAcl))
+				failures += " key-signature";
+			
+			// reference keys are NULL-wrapped into the sealed form
+			keyBlob = mCore.encodeKeyCore(*refKey, publicAcl, privateAcl, false);
+			std::vector<uint8> rkb((uint8 *)keyBlob, (uint8 *)keyBlob + keyBlob->totalLength);
+			Allocator::standard().free(keyBlob);
+			if ((((KeyBlob *)&rkb[0])->version() == DatabaseCryptoCore::version_AES_GCM) != sealed)
+				failures += " refkey-version";
+			if (!keyBlobAccepted(rkb, mCore, refKey, privateAcl))
+				failures += " refkey-roundtrip";
+			
+			fprintf(mOut, "# blob integrity: format=%s %s%s\n", sealed ? "sealed" : "legacy",
+				failures.empty() ? "ok" : "FAILED:", failures.c_str());
+			if (!failures.empty())
+				allOK = false;
+		}
+	} catch (...) {
+		Server::active().legacyBlobs(legacy);
+		throw;
+	}
+	Server::active().legacyBlobs(legacy);
+	fflush(mOut);
+	if (!allOK)
+		CssmError::throwMe(CSSM_ERRCODE_INTERNAL_ERROR);
+}
+
+
+//
+// Database blob coding
+//
+void CryptoBenchmark::dbBlobs(bool sealed, size_t aclSize)
+{
+	std::vector<uint8> acl(aclSize + 1, 0x5a);
+	CssmData publicAcl(&acl[0], aclSize), privateAcl(&acl[0], aclSize);
+	DbBlob form;
+	memset(&form, 0, sizeof(form));
+	
+	struct Encode : public Case {
+		Encode(const DatabaseCryptoCore &c, const DbBlob &f, const CssmData &pub, const CssmData &priv)
+			: core(c), form(f), publicAcl(pub), privateAcl(priv) { }
+		void operator () ()
+		{ Allocator::standard().free(core.encodeCore(form, publicAcl, privateAcl)); }
+		
+		const DatabaseCryptoCore &core;
+		const DbBlob &form;
+		const CssmData &publicAcl, &privateAcl;
+	};
+	
+	struct Decode : public Case {
+		Decode(const DbBlob *b, CssmClient::Key master) : blob(b)
+		{ core.setup(blob, master); }
+		void operator () ()
+		{
+			void *privateAcl;
+			core.decodeCore(blob, &privateAcl);
+			SecureArena::shared().free(privateAcl);
+		}
+		
+		const DbBlob *blob;
+		DatabaseCryptoCore core;
+	};
+	
+	char variant[60];
+	snprintf(variant, sizeof(variant), "format=%s,acl=%lu",
+		sealed ? "sealed" : "legacy", (unsigned long)aclSize);
+	Encode encode(mCore, form, publicAcl, privateAcl);
+	measure("encodeCore", variant, encode);
+	
+	DbBlob *blob = mCore.encodeCore(form, publicAcl, privateAcl);
+	try {
+		Decode decode(blob, mCore.masterKey());
+		measure("decodeCore", variant, decode);
+	} catch (...) {
+		Allocator::standard().free(blob);
+		throw;
+	}
+	Allocator::standard().free(blob);
+}
+
+
+//
+// Key blob coding.
+// decodeKeyCore converts the blob header in place, so each decode works on
+// a fresh copy of the blob; the copy is a memcpy of a few hundred bytes.
+//
+void CryptoBenchmark::keyBlobs(bool sealed, const char *keyType, const CssmKey &key, size_t aclSize)
+{
+	std::vector<uint8> acl(aclSize + 1, 0xa5);
+	CssmData publicAcl(&acl[0], aclSize), privateAcl(&acl[0], aclSize);
+	
+	struct Encode : public Case {
+		Encode(const DatabaseCryptoCore &c, const CssmKey &k, const CssmData &pub, const CssmData &priv)
+			: core(c), key(k), publicAcl(pub), privateAcl(priv) { }
+		void operator () ()
+		{ Allocator::standard().free(core.encodeKeyCore(key, publicAcl, privateAcl, false)); }
+		
+		const DatabaseCryptoCore &core;
+		const CssmKey &key;
+		const CssmData &publicAcl, &privateAcl;
+	};
+	
+	struct Decode : public Case {
+		Decode(const DatabaseCryptoCore &c, const KeyBlob *blob)
+			: core(c), original((const uint8 *)blob, (const uint8 *)blob + blob->totalLength),
+			  copy(original.size()) { }
+		void operator () ()
+		{
+			memcpy(&copy[0], &original[0], original.size());
+			CssmKey key;
+			void *publicAcl, *privateAcl;
+			core.decodeKeyCore((KeyBlob *)&copy[0], key, publicAcl, privateAcl);
+			CssmClient::Key release(Server::csp(), key);
+			SecureArena::shared().free(privateAcl);
+		}
+		
+		const DatabaseCryptoCore &core;
+		std::vector<uint8> original, copy;
+	};
+	
+	char variant[80];
+	snprintf(variant, sizeof(variant), "format=%s,key=%s,acl=%lu",
+		sealed ? "sealed" : "legacy", keyType, (unsigned long)aclSize);
+	Encode encode(mCore, key, publicAcl, privateAcl);
+	measure("encodeKeyCore", variant, encode);
+	
+	KeyBlob *blob = mCore.encodeKeyCore(key, publicAcl, privateAcl, false);
+	try {
+		Decode decode(mCore, blob);
+		Allocator::standard().free(blob);
+		blob = NULL;
+		measure("decodeKeyCore", variant, decode);
+	} catch (...) {
+		if (blob)
+			Allocator::standard().free(blob);
+		throw;
+	}
+}
+
+
+//
+// Allocate-and-free latency of the SecureArena, against the standard allocator
+//
+void CryptoBenchmark::allocators(size_t size)
+{
+	struct Allocate : public Case {
+		Allocate(Allocator &a, size_t s) : alloc(a), size(s) { }
+		void operator () ()
+		{
+			for (unsigned n = 0; n < batch(); n++)
+				alloc.free(alloc.malloc(size));
+		}
+		unsigned batch() const { return 100; }
+		
+		Allocator &alloc;
+		size_t size;
+	};
+	char variant[40];
+	snprintf(variant, sizeof(variant), "%lu bytes", (unsigned long)size);
+	Allocate standard(Allocator::standard(), size);
+	measure("malloc+free", std::string("standard ") + variant, standard);
+	Allocate arena(SecureArena::shared(), size);
+	measure("malloc+free", std::string("arena ") + variant, arena);
+}
+
+
+//
+// Cost of random(), buffered against straight /dev/random
+//
+void CryptoBenchmark::randomness(size_t size)
+{
+	struct Random : public Case {
+		Random(size_t s) : buffer(s) { }
+		void operator () ()
+		{
+			for (unsigned n = 0; n < batch(); n++)
+				Server::active().random(&buffer[0], buffer.size());
+		}
+		unsigned batch() const { return 100; }
+		std::vector<uint8> buffer;
+	};
+	struct DevRandom : public Random {
+		DevRandom(size_t s) : Random(s) { }
+		void operator () ()
+		{
+			for (unsigned n = 0; n < batch(); n++)
+				DevRandomGenerator().random(&buffer[0], buffer.size());
+		}
+	};
+	char variant[40];
+	snprintf(variant, sizeof(variant), "%lu bytes", (unsigned long)size);
+	DevRandom devRandom(size);
+	measure("random", std::string("/dev/random ") + variant, devRandom);
+	Random buffered(size);
+	measure("random", std::string("buffered ") + variant, buffered);
+}
+
+
+//
+// The buffered generator must never hand a forked child the bytes its parent
+// is about to use, and must reseed when told to. Results go out as comment
+// lines; a failure fails the run.
+//
+void CryptoBenchmark::randomSafety()
+{
+	uint8 parent[32], child[32];
+	Server::active().random(parent, 16);	// leave output buffered across the fork
+	
+	int fds[2];
+	if (pipe(fds))
+		UnixError::throwMe();
+	pid_t pid = fork();
+	if (pid < 0)
+		UnixError::throwMe();
+	if (pid == 0) {
+		Server::active().random(child, sizeof(child));
+		_exit(write(fds[1], child, sizeof(child)) == sizeof(child) ? 0 : 1);
+	}
+	close(fds[1]);
+	Server::active().random(parent, sizeof(parent));
+	ssize_t got = read(fds[0], child, sizeof(child));
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	bool forkOK = got == sizeof(child) && memcmp(parent, child, sizeof(child));
+	fprintf(mOut, "# random: fork %s\n", forkOK ? "ok" : "FAILED (child repeated parent output)");
+	
+	uint64_t seedings = FastRandomGenerator::seedings();
+	FastRandomGenerator::reseed();
+	Server::active().random(parent, sizeof(parent));
+	bool reseedOK = FastRandomGenerator::seedings() == seedings + 1;
+	fprintf(mOut, "# random: reseed %s\n", reseedOK ? "ok" : "FAILED (stream not reseeded)");
+	fflush(mOut);
+	
+	if (!forkOK || !reseedOK)
+		CssmError::throwMe(CSSM_ERRCODE_INTERNAL_ERROR);
+}
+
+
+//
+// RSA signature verification through the VerifyCache, as LocalDatabase does it.
+// The workload is a stream of verifications over a hot set of 16 (data, signature)
+// pairs - think pinned certificate chains - and 1024 that rarely come back; a
+// fraction of the stream (the repeat ratio) comes from the hot set. The cache
+// holds 64 entries. The hit rate of each run follows as a comment line.
+//
+void CryptoBenchmark::verification(const CssmClient::Key &publicKey, const CssmClient::Key &privateKey)
+{
+	static const unsigned hotSet = 16, coldSet = 1024;
+	static const size_t cacheSize = 64;
+	
+	struct Verification : public Case {
+		Verification(const CssmClient::Key &key, double ratio, VerifyCache *c)
+			: publicKey(key), repeats(ratio), cache(c), seed(1) { }
+		
+		void operator () ()
+		{
+			// a cheap LCG picks the next pair (the same sequence for every variant)
+			seed = seed * 1103515245 + 12345;
+			unsigned pick = (seed >> 8) % 1000;
+			unsigned n = (pick < repeats * 1000) ? pick % hotSet : hotSet + (seed >> 18) % coldSet;
+			
+			VerifyCache::Tag tag;
+			if (cache) {
+				VerifyCache::tag(publicKey->keyData(), CSSM_ALGID_SHA1WithRSA, CSSM_ALGID_NONE,
+					data[n], signatures[n], tag);
+				if (cache->verified(tag))
+					return;
+			}
+			Verify verifier(Server::csp(), CSSM_ALGID_SHA1WithRSA);
+			verifier.key(publicKey);
+			verifier.verify(data[n], signatures[n]);
+			if (cache)
+				cache->remember(tag, publicKey->keyData());
+		}
+		
+		const CssmClient::Key &publicKey;
+		double repeats;
+		VerifyCache *cache;
+		uint32 seed;
+		std::vector<CssmData> data, signatures;
+	};
+	
+	// sign the working set (signatures are allocated by the CSP)
+	std::vector<uint32> messages(hotSet + coldSet);
+	std::vector<CssmData> signatures(messages.size());
+	static const double ratios[] = { 0.0, 0.5, 0.8, 0.95 };
+	try {
+		Sign signer(Server::csp(), CSSM_ALGID_SHA1WithRSA);
+		signer.key(privateKey);
+		for (unsigned n = 0; n < messages.size(); n++) {
+			messages[n] = n;
+			signer.sign(CssmData::wrap(messages[n]), signatures[n]);
+		}
+		
+		for (unsigned r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++) {
+			char variant[40];
+			for (unsigned cached = 0; cached < 2; cached++) {
+				VerifyCache cache;
+				cache.capacity(cacheSize);
+				Verification verification(publicKey, ratios[r], cached ? &cache : NULL);
+				for (unsigned n = 0; n < messages.size(); n++) {
+					verification.data.push_back(CssmData::wrap(messages[n]));
+					verification.signatures.push_back(signatures[n]);
+				}
+				snprintf(variant, sizeof(variant), "%s %.0f%% repeats",
+					cached ? "cached" : "uncached", ratios[r] * 100);
+				measure("verifySignature", variant, verification);
+				if (cached) {
+					VerifyCache::Statistics stats = cache.statistics();
+					fprintf(mOut, "# verify cache: %s: %.1f%% hit rate\n", variant,
+						100.0 * stats.hits / (stats.hits + stats.misses));
+				}
+			}
+		}
+	} catch (...) {
+		for (unsigned n = 0; n < signatures.size(); n++)
+			Server::csp()->allocator().free(signatures[n].data());
+		throw;
+	}
+	for (unsigned n = 0; n < signatures.size(); n++)
+		Server::csp()->allocator().free(signatures[n].data());
+}
+
+
+//
+// Lookups from many threads at once, as every request does them on its way in.
+// Registry::find(key) looks up one key (and takes a reference to what it finds,
+// as the server does), throwing if it isn't there. Each of 1 to 64 threads runs
+// through the keys from its own starting point. An operation is one lookup.
+//
+template <class Registry>
+class ParallelLookups : public CryptoBenchmark::Case {
+public:
+	static const unsigned lookupsPerThread = 20000;
+	
+	ParallelLookups(const Registry &registry, const std::vector<uint32_t> &keys, unsigned threads)
+		: mRegistry(registry), mKeys(keys), mThreads(threads), mStarted(0), mFailed(false) { }
+	
+	void operator () ()
+	{
+		std::vector<pthread_t> threads(mThreads);
+		for (unsigned n = 0; n < mThreads; n++)
+			if (int err = pthread_create(&threads[n], NULL, lookups, this))
+				UnixError::throwMe(err);
+		for (unsigned n = 0; n < mThreads; n++)
+			pthread_join(threads[n], NULL);
+		if (mFailed)
+			CssmError::throwMe(CSSM_ERRCODE_INTERNAL_ERROR);
+	}
+	unsigned batch() const { return mThreads * lookupsPerThread; }
+
+private:
+	static void *lookups(void *arg)
+	{
+		ParallelLookups &me = *static_cast<ParallelLookups *>(arg);
+		size_t count = me.mKeys.size();
+		size_t next = __sync_fetch_and_add(&me.mStarted, 1) * 61 % count;	// (spread out)
+		try {
+			for (unsigned n = 0; n < lookupsPerThread; n++) {
+				me.mRegistry.find(me.mKeys[next]);
+				if (++next == count)
+					next = 0;
+			}
+		} catch (...) {
+			me.mFailed = true;
+		}
+		return NULL;
+	}
+	
+	const Registry &mRegistry;
+	const std::vector<uint32_t> &mKeys;
+	unsigned mThreads;
+	volatile unsigned mStarted;
+	volatile bool mFailed;
+};
+
+static const unsigned lookupThreadCounts[] = { 1, 2, 4, 8, 16, 32, 64 };
+static const unsigned lookupThreadCountCount = sizeof(lookupThreadCounts) / sizeof(lookupThreadCounts[0]);
+
+
+//
+// Handle lookup, as every request that names an object does it: U32HandleObject's
+// global map (which securityd used before) against our slot table, for a set of
+// 1024 live objects.
+//
+struct MapObject : public U32HandleObject, public RefCount { };
+struct SlotObject : public ClientHandleObject, public RefCount { };
+
+template <class Table, class Object>
+struct HandleRegistry {
+	void find(uint32_t handle) const
+	{
+		RefPointer<Object> object = Table::template findRef<Object>(handle,
+			CSSMERR_CSSM_INVALID_ADDIN_HANDLE);
+	}
+};
+
+void CryptoBenchmark::handleLookups()
+{
+	static const unsigned objectCount = 1024;
+	std::vector<RefPointer<MapObject> > mapObjects;
+	std::vector<RefPointer<SlotObject> > slotObjects;
+	std::vector<uint32_t> mapHandles, slotHandles;
+	for (unsigned n = 0; n < objectCount; n++) {
+		mapObjects.push_back(new MapObject);
+		mapHandles.push_back(mapObjects.back()->handle());
+		slotObjects.push_back(new SlotObject);
+		slotHandles.push_back(slotObjects.back()->handle());
+	}
+	
+	HandleRegistry<U32HandleObject, MapObject> mapRegistry;
+	HandleRegistry<ClientHandleObject, SlotObject> slotRegistry;
+	for (unsigned n = 0; n < lookupThreadCountCount; n++) {
+		char variant[40];
+		ParallelLookups<HandleRegistry<U32HandleObject, MapObject> >
+			map(mapRegistry, mapHandles, lookupThreadCounts[n]);
+		snprintf(variant, sizeof(variant), "map,threads=%u", lookupThreadCounts[n]);
+		measure("handleLookup", variant, map);
+		ParallelLookups<HandleRegistry<ClientHandleObject, SlotObject> >
+			slots(slotRegistry, slotHandles, lookupThreadCounts[n]);
+		snprintf(variant, sizeof(variant), "slots,threads=%u", lookupThreadCounts[n]);
+		measure("handleLookup", variant, slots);
+	}
+}
+
+
+//
+// Connection lookup, as Server::connection does it for every request: a single
+// map under one lock (the global Server lock, as securityd did it before) against
+// the lock-striped PortMap, for 256 connections (reply port names, which
+// are regular in their upper bits).
+//
+struct PortObject : public RefCount { };
+
+class LockedPortRegistry : public Mutex, public std::map<mach_port_t, RefPointer<PortObject> > {
+public:
+	void find(uint32_t port) const
+	{
+		StLock<Mutex> _(const_cast<LockedPortRegistry &>(*this));
+		const_iterator it = std::map<mach_port_t, RefPointer<PortObject> >::find(port);
+		if (it == end())
+			CssmError::throwMe(CSSM_ERRCODE_INVALID_CONTEXT_HANDLE);
+		RefPointer<PortObject> object = it->second;
+	}
+};
+
+struct StripedPortRegistry : public PortMap<PortObject> {
+	void find(uint32_t port) const
+	{
+		RefPointer<PortObject> object = get(port, CSSM_ERRCODE_INVALID_CONTEXT_HANDLE);
+	}
+};
+
+void CryptoBenchmark::connectionLookups()
+{
+	static const unsigned connectionCount = 256;
+	LockedPortRegistry locked;
+	StripedPortRegistry striped;
+	std::vector<uint32_t> ports;
+	for (unsigned n = 0; n < connectionCount; n++) {
+		mach_port_t port = ((n + 0x1000) << 8) | 0x03;
+		RefPointer<PortObject> object = new PortObject;
+		locked[port] = object;
+		striped.insert(port, object);
+		ports.push_back(port);
+	}
+	
+	for (unsigned n = 0; n < lookupThreadCountCount; n++) {
+		char variant[40];
+		ParallelLookups<LockedPortRegistry> global(locked, ports, lookupThreadCounts[n]);
+		snprintf(variant, sizeof(variant), "global-lock,threads=%u", lookupThreadCounts[n]);
+		measure("connectionLookup", variant, global);
+		ParallelLookups<StripedPortRegistry> stripes(striped, ports, lookupThreadCounts[n]);
+		snprintf(variant, sizeof(variant), "striped,threads=%u", lookupThreadCounts[n]);
+		measure("connectionLookup", variant, stripes);
+	}
+}
+
+
+//
+// SecureArena occupancy after the run, as comment lines
+//
+void CryptoBenchmark::occupancy()
+{
+	SecureArena::Statistics stats;
+	SecureArena::shared().statistics(stats);
+	fprintf(mOut, "# arena: %llu chunk(s) (%llu not wired), %llu large block(s) in %llu bytes\n",
+		stats.chunks, stats.unlockedChunks, stats.largeInUse, stats.largeBytes);
+	for (unsigned n = 0; n < SecureArena::classCount; n++) {
+		const SecureArena::Statistics::Class &c = stats.classes[n];
+		if (c.slots)
+			fprintf(mOut, "# arena: %lu-byte slots: %llu in use of %llu (peak %llu)\n",
+				(unsigned long)c.slotSize, c.inUse, c.slots, c.peak);
+	}
+}
+
+
+//
+// Run all cases.
+// The blob format is a server setting; we flip it for each case and put it back.
+//
+void CryptoBenchmark::run()
+{
+	fprintf(mOut, "# case\tvariant\toperations\tops/s\tns/op\tallocations/op\n");
+	secrets();
+	derivation();
+	validation();
+	passphraseTrials();
+	
+	KeySpec spec(CSSM_KEYUSE_ANY, CSSM_KEYATTR_RETURN_DATA | CSSM_KEYATTR_EXTRACTABLE);
+	CssmClient::Key des = GenerateKey(Server::csp(), CSSM_ALGID_3DES_3KEY_EDE, 192)(spec);
+	CssmClient::Key aes = GenerateKey(Server::csp(), CSSM_ALGID_AES, 256)(spec);
+	CssmClient::Key aesRef = GenerateKey(Server::csp(), CSSM_ALGID_AES, 256)
+		(KeySpec(CSSM_KEYUSE_ANY, CSSM_KEYATTR_RETURN_REF | CSSM_KEYATTR_EXTRACTABLE));
+	CssmKey rsaPublic, rsaPrivate;
+	GenerateKey(Server::csp(), CSSM_ALGID_RSA, 2048)(rsaPublic, spec, rsaPrivate, spec);
+	CssmClient::Key rsaPub(Server::csp(), rsaPublic), rsaPriv(Server::csp(), rsaPrivate);
+	struct { const char *name; const CssmKey &key; } keys[] = {
+		{ "3DES-192", *des },
+		{ "AES-256", *aes },
+		{ "AES-256-reference", *aesRef },
+		{ "RSA-2048-private", *rsaPriv },
+	};
+	
+	blobIntegrity(aes, aesRef);
+	
+	bool legacy = Server::legacyBlobs();
+	try {
+		for (unsigned format = 0; format < 2; format++) {
+			bool sealed = (format == 1);
+			Server::active().legacyBlobs(!sealed);
+			for (unsigned n = 0; n < aclSizeCount; n++)
+				dbBlobs(sealed, aclSizes[n]);
+			for (unsigned k = 0; k < sizeof(keys) / sizeof(keys[0]); k++)
+				for (unsigned n = 0; n < aclSizeCount; n++)
+					keyBlobs(sealed, keys[k].name, keys[k].key, aclSizes[n]);
+		}
+	} catch (...) {
+		Server::active().legacyBlobs(legacy);
+		throw;
+	}
+	Server::active().legacyBlobs(legacy);
+	
+	static const size_t allocationSizes[] = { 64, 512, 4096, 65536 };
+	for (unsigned n = 0; n < sizeof(allocationSizes) / sizeof(allocationSizes[0]); n++)
+		allocators(allocationSizes[n]);
+	occupancy();
+	
+	static const size_t randomSizes[] = { 8, 16, 32, 4096 };
+	for (unsigned n = 0; n < sizeof(randomSizes) / sizeof(randomSizes[0]); n++)
+		randomness(randomSizes[n]);
+	randomSafety();
+	
+	verification(rsaPub, rsaPriv);
+	handleLookups();
+	connectionLookups();
+}
+
+
+//
+// Run the benchmark, writing results to a file (or stdout for "-").
+// Returns an exit code for main().
+//
+int CryptoBenchmark::run(const char *resultFile)
+{
+	bool toStdout = !strcmp(resultFile, "-");
+	FILE *out = toStdout ? stdout : fopen(resultFile, "w");
+	if (!out) {
+		perror(resultFile);
+		return 1;
+	}
+	int status = 0;
+	try {
+		CryptoBenchmark(out).run();
+	} catch (const CommonError &err) {
+		fprintf(stderr, "crypto benchmark failed: %s\n", err.what());
+		malloc_logger = NULL;
+		status = 1;
+	}
+	if (!toStdout)
+		fclose(out);
+	return status;
+}
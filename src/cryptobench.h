@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// cryptobench - microbenchmarks for the database crypto core
+//
+#ifndef _H_CRYPTOBENCH
+#define _H_CRYPTOBENCH
+
+#include "dbcrypto.h"
+#include <stdio.h>
+#include <string>
+
+
+//
+// CryptoBenchmark times the DatabaseCryptoCore operations (secret generation,
+// master key derivation, passphrase validation, passphrase trials against many
+// keychains, database and key blob coding) in process, across blob formats, key
+// types and ACL sizes, along with the SecureArena against the standard allocator,
+// the buffered random generator against /dev/random, signature verification
+// with and without the VerifyCache, handle lookup in the slot table against the
+// old global handle map, and connection lookup in the lock-striped PortMap against
+// a map under one global lock, and writes one tab-separated line of results
+// per case so runs can be compared by machine. Before timing the blob formats, it
+// checks that each reads back what it writes and rejects altered blobs.
+// It needs a Server with a loaded CSP; securityd runs it for -B and exits.
+//
+class CryptoBenchmark {
+public:
+	CryptoBenchmark(FILE *out);
+	
+	void run();									// all cases
+	static int run(const char *resultFile);		// "-" for stdout; returns exit code
+	
+	// one timed operation
+	class Case {
+	public:
+		virtual ~Case() { }
+		virtual void operator () () = 0;
+		virtual unsigned batch() const { return 1; }	// operations per call
+	};
+	
+	void measure(const char *name, const std::string &variant, Case &op);
+	
+	static double targetSeconds;				// minimum run time per case
+
+private:
+	void secrets();
+	void derivation();
+	void validation();
+	void passphraseTrials();
+	void blobIntegrity(const CssmClient::Key &key, const CssmClient::Key &refKey);
+	void dbBlobs(bool sealed, size_t aclSize);
+	void keyBlobs(bool sealed, const char *keyType, const CssmKey &key, size_t aclSize);
+	void allocators(size_t size);
+	void randomness(size_t size);
+	void randomSafety();
+	void verification(const CssmClient::Key &publicKey, const CssmClient::Key &privateKey);
+	void handleLookups();
+	void connectionLookups();
+	void occupancy();
+
+private:
+	FILE *mOut;
+	DatabaseCryptoCore mCore;					// with secrets and master key
+};
+
+
+#endif //_H_CRYPTOBENCH
@@ -122,6 +122,48 @@ void Database::releaseRecord(Record &record)
 	kill(record);
 }
 
+
+//
+// Streams belong to their key (and die with it)
+//
+Database::Stream::Stream(Key &key, Operation op)
+	: mOperation(op)
+{
+	referent(key);
+}
+
+Key &Database::Stream::key() const
+{
+	return referent<Key>();
+}
+
+Database &Database::Stream::database() const
+{
+	return key().database();
+}
+
+Process &Database::Stream::process() const
+{
+	return key().process();
+}
+
+void Database::startStream(const Context &, Key &, Stream::Operation,
+	CSSM_ALGORITHMS, RefPointer<Stream> &)
+{
+	CssmError::throwMe(CSSM_ERRCODE_FUNCTION_NOT_IMPLEMENTED);
+}
+
+//
+// A Stream is a Reference of its key, not of the database, so it's killed through
+// the key. That locks the key and then the stream (as a dying key does), so don't
+// call this while holding the stream's lock. The key may have died (and killed the
+// stream with it) since the caller found the stream; then we're done already.
+//
+void Database::releaseStream(Stream &stream)
+{
+	stream.key().killIfReference(stream);
+}
+
 void Database::dbName(const char *name)
 {
 	CssmError::throwMe(CSSM_ERRCODE_FUNCTION_NOT_IMPLEMENTED);
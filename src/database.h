@@ -128,6 +128,42 @@ public:
 	virtual void encrypt(const Context &context, Key &key, const CssmData &clear, CssmData &cipher) = 0;
 	virtual void decrypt(const Context &context, Key &key, const CssmData &cipher, CssmData &clear) = 0;
 	
+	//
+	// Staged (init/update/final) cryptography, for data too big to send in one piece.
+	// A Stream is bound to one key and the context and ACL decision it started with;
+	// it holds only the CSP's running state between chunks. It dies with its key,
+	// when it's finished, or when any of its steps fails.
+	// Databases that can't stream (the default) say so when asked to start one.
+	// (No IPC reaches streams yet; the startStream/updateStream/finishStream/
+	// abortStream requests come with their ucsp.defs routines and ClientSession calls.)
+	//
+	class Stream : public PerProcess {
+	public:
+		enum Operation {
+			encrypt, decrypt,
+			generateSignature, verifySignature,
+			generateMac, verifyMac
+		};
+		
+		Stream(Key &key, Operation op);
+		Key &key() const;
+		Database &database() const;
+		Process &process() const;
+		Operation operation() const { return mOperation; }
+		
+		// (signature and MAC operations produce no output until final)
+		virtual void update(const CssmData &input, CssmData &output) = 0;
+		// (input is the signature or MAC to check, for verify operations)
+		virtual void final(const CssmData &input, CssmData &output) = 0;
+	
+	private:
+		Operation mOperation;
+	};
+	
+	virtual void startStream(const Context &context, Key &key, Stream::Operation op,
+		CSSM_ALGORITHMS signOnlyAlgorithm, RefPointer<Stream> &stream);
+	virtual void releaseStream(Stream &stream);
+	
 	virtual void generateKey(const Context &context,
 		const AccessCredentials *cred, const AclEntryPrototype *owner,
 		uint32 usage, uint32 attrs, RefPointer<Key> &newKey) = 0;
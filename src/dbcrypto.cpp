@@ -28,12 +28,19 @@
 #include "dbcrypto.h"
 #include <securityd_client/ssblob.h>
 #include "server.h"		// just for Server::csp()
+#include "pbkdf2.h"
+#include "securearena.h"
 #include <security_cdsa_client/genkey.h>
 #include <security_cdsa_client/cryptoclient.h>
 #include <security_cdsa_client/keyclient.h>
 #include <security_cdsa_client/macclient.h>
 #include <security_cdsa_client/wrapkey.h>
 #include <security_cdsa_utilities/cssmendian.h>
+#include <security_utilities/logging.h>
+#include <CommonCrypto/CommonHMAC.h>
+#include <CommonCrypto/CommonCryptorSPI.h>
+#include <exception>
+#include <pthread.h>
 
 using namespace CssmClient;
 using LowLevelMemoryUtilities::fieldOffsetOf;
@@ -53,6 +60,334 @@ DatabaseCryptoCore::~DatabaseCryptoCore()
 }
 
 
+//
+// AES-256-GCM for version_AES_GCM blobs, through CommonCrypto (which uses the
+// AES instructions where the processor has them). The CSP has no AEAD modes.
+// The 96-bit nonce is the blob's IV field plus the last four bytes of its
+// signature field; the 128-bit tag goes into the first sixteen.
+//
+static const size_t gcmKeySize = 32;		// AES-256
+static const size_t gcmNonceSize = 12;
+static const size_t gcmTagSize = 16;
+static const size_t gcmIvSize = 8;			// nonce bytes in the blob's iv field
+static const size_t keyCheckSize = 16;		// master key check value at the start of the crypto blob
+
+
+//
+// Compare secrets in time that doesn't depend on where they differ
+//
+static bool constantTimeEqual(const void *a, const void *b, size_t length)
+{
+	const uint8 *pa = (const uint8 *)a, *pb = (const uint8 *)b;
+	uint8 diff = 0;
+	for (size_t n = 0; n < length; n++)
+		diff |= pa[n] ^ pb[n];
+	return diff == 0;
+}
+
+class BlobSeal {
+public:
+	BlobSeal(CCOperation op, const uint8 *key, const uint8 *iv, const uint8 *signature);
+	~BlobSeal()		{ CCCryptorRelease(mCryptor); }
+	
+	void authenticate(const CssmData &data);		// additional (unencrypted) data
+	void process(const CssmData &in, void *out);	// encrypt or decrypt
+	void seal(uint8 *signature);					// (encrypt) store the tag
+	void open(const uint8 *signature);				// (decrypt) verify the tag, or throw
+	
+	// make up a fresh nonce
+	static void newNonce(uint8 *iv, uint8 *signature);
+
+private:
+	static void check(CCCryptorStatus rc)
+	{ if (rc != kCCSuccess) CssmError::throwMe(CSSMERR_CSP_INTERNAL_ERROR); }
+	
+	CCOperation mOperation;
+	CCCryptorRef mCryptor;
+};
+
+BlobSeal::BlobSeal(CCOperation op, const uint8 *key, const uint8 *iv, const uint8 *signature)
+	: mOperation(op)
+{
+	check(CCCryptorCreateWithMode(op, kCCModeGCM, kCCAlgorithmAES, ccNoPadding,
+		NULL, key, gcmKeySize, NULL, 0, 0, 0, &mCryptor));
+	uint8 nonce[gcmNonceSize];
+	memcpy(nonce, iv, gcmIvSize);
+	memcpy(nonce + gcmIvSize, signature + gcmTagSize, gcmNonceSize - gcmIvSize);
+	try {
+		check(CCCryptorGCMAddIV(mCryptor, nonce, sizeof(nonce)));
+	} catch (...) {
+		CCCryptorRelease(mCryptor);
+		throw;
+	}
+}
+
+void BlobSeal::authenticate(const CssmData &data)
+{
+	check(CCCryptorGCMaddAAD(mCryptor, data.data(), data.length()));
+}
+
+void BlobSeal::process(const CssmData &in, void *out)
+{
+	if (mOperation == kCCEncrypt)
+		check(CCCryptorGCMEncrypt(mCryptor, in.data(), in.length(), out));
+	else
+		check(CCCryptorGCMDecrypt(mCryptor, in.data(), in.length(), out));
+}
+
+void BlobSeal::seal(uint8 *signature)
+{
+	size_t tagLength = gcmTagSize;
+	check(CCCryptorGCMFinal(mCryptor, signature, &tagLength));
+}
+
+void BlobSeal::open(const uint8 *signature)
+{
+	uint8 tag[gcmTagSize];
+	size_t tagLength = sizeof(tag);
+	check(CCCryptorGCMFinal(mCryptor, tag, &tagLength));
+	if (!constantTimeEqual(tag, signature, gcmTagSize))
+		CssmError::throwMe(CSSMERR_CSP_VERIFY_FAILED);
+}
+
+void BlobSeal::newNonce(uint8 *iv, uint8 *signature)
+{
+	uint8 nonce[gcmNonceSize];
+	Server::active().random(nonce);
+	memcpy(iv, nonce, gcmIvSize);
+	memcpy(signature + gcmTagSize, nonce + gcmIvSize, gcmNonceSize - gcmIvSize);
+}
+
+
+//
+// A scratch buffer for plaintext secrets, in the secure arena (which wipes it).
+//
+class SecretBuffer {
+public:
+	SecretBuffer(size_t length)
+		: mData((uint8 *)SecureArena::shared().malloc(length)), mLength(length) { }
+	~SecretBuffer()	{ SecureArena::shared().free(mData); }
+	
+	uint8 *data() const			{ return mData; }
+	size_t length() const		{ return mLength; }
+	operator CssmData () const	{ return CssmData(mData, mLength); }
+
+private:
+	uint8 *mData;
+	size_t mLength;
+};
+
+
+//
+// The AES keys for sealed blobs are derived from the secrets a database already
+// has, with HMAC/SHA-256 and a label. This leaves the secrets themselves (and
+// the PrivateBlob that transports them) exactly as they were, so the same
+// secrets serve both blob formats.
+//
+static void blobKey(const CssmData *secrets, unsigned count, const char *label, uint8 *key)
+{
+	CCHmacContext hmac;
+	uint8 material[64];		// concatenated secrets (they're short)
+	size_t length = 0;
+	for (unsigned n = 0; n < count; n++) {
+		assert(length + secrets[n].length() <= sizeof(material));
+		memcpy(material + length, secrets[n].data(), secrets[n].length());
+		length += secrets[n].length();
+	}
+	CCHmacInit(&hmac, kCCHmacAlgSHA256, material, length);
+	CCHmacUpdate(&hmac, label, strlen(label));
+	CCHmacFinal(&hmac, key);
+	memset(material, 0, sizeof(material));
+	memset(&hmac, 0, sizeof(hmac));
+}
+
+
+//
+// The key-check value of a master key, which sealed DbBlobs carry (in the clear)
+// so that a passphrase can be checked with nothing but its derivation.
+// It tells no more than the GCM tag would, at the same cost to an attacker.
+//
+static void keyCheckValue(const CssmData &master, uint8 *kcv)
+{
+	uint8 mac[gcmKeySize];
+	blobKey(&master, 1, "securityd master key check", mac);
+	memcpy(kcv, mac, keyCheckSize);
+}
+
+
+//
+// A set of CSP contexts, keyed to the secrets the core had when the set was made.
+// Mode, padding and keys are set up once; only the IV changes per operation.
+// (The contexts keep pointing at our IV buffer, so it must outlive them.)
+// The set also carries the AES keys for sealed blobs, where we have the secrets
+// (in raw form) to derive them from.
+//
+class DatabaseCryptoCore::ContextSet {
+public:
+	ContextSet(const DatabaseCryptoCore &core, unsigned gen);
+	~ContextSet();
+	
+	const unsigned generation;		// of the ContextCache that made us
+	
+	Encrypt encryptor;				// DbBlob encryption (master key)
+	Decrypt decryptor;				// DbBlob decryption (master key)
+	WrapKey wrap;					// KeyBlob encryption (encryption key)
+	UnwrapKey unwrap;				// KeyBlob decryption (encryption key)
+	GenerateMac signer;				// blob signing (signing key)
+	VerifyMac verifier;				// blob verification (signing key)
+	
+	void initVector(Crypt &context, const uint8 *iv)
+	{ memcpy(mIv, iv, sizeof(mIv)); context.initVector(mIvData); }
+	
+	bool haveDbKey;					// dbKey is valid
+	uint8 dbKey[gcmKeySize];		// DbBlob sealing (from master key)
+	bool haveKeyKey;				// keyKey is valid
+	uint8 keyKey[gcmKeySize];		// KeyBlob sealing (from encryption and signing keys)
+	uint8 keyCheck[keyCheckSize];	// key-check value of the master key (if haveDbKey)
+
+private:
+	uint8 mIv[8];
+	CssmData mIvData;
+};
+
+DatabaseCryptoCore::ContextSet::ContextSet(const DatabaseCryptoCore &core, unsigned gen)
+	: generation(gen),
+	  encryptor(Server::csp(), CSSM_ALGID_3DES_3KEY_EDE),
+	  decryptor(Server::csp(), CSSM_ALGID_3DES_3KEY_EDE),
+	  wrap(Server::csp(), CSSM_ALGID_3DES_3KEY_EDE),
+	  unwrap(Server::csp(), CSSM_ALGID_3DES_3KEY_EDE),
+	  signer(Server::csp(), CSSM_ALGID_SHA1HMAC_LEGACY),
+	  verifier(Server::csp(), CSSM_ALGID_SHA1HMAC),
+	  mIvData(mIv, sizeof(mIv))
+{
+	memset(mIv, 0, sizeof(mIv));
+	Crypt *ciphers[] = { &encryptor, &decryptor, &wrap, &unwrap };
+	for (unsigned n = 0; n < sizeof(ciphers) / sizeof(ciphers[0]); n++) {
+		ciphers[n]->mode(CSSM_ALGMODE_CBCPadIV8);
+		ciphers[n]->padding(CSSM_PADDING_PKCS1);
+		ciphers[n]->initVector(mIvData);
+	}
+	wrap.add(CSSM_ATTRIBUTE_WRAPPED_KEY_FORMAT,
+		uint32(CSSM_KEYBLOB_WRAPPED_FORMAT_APPLE_CUSTOM));
+	unwrap.add(CSSM_ATTRIBUTE_WRAPPED_KEY_FORMAT,
+		uint32(CSSM_KEYBLOB_WRAPPED_FORMAT_APPLE_CUSTOM));
+	
+	if (core.mHaveMaster) {
+		encryptor.key(core.mMasterKey);
+		decryptor.key(core.mMasterKey);
+	}
+	if (core.mEncryptionKey) {
+		wrap.key(core.mEncryptionKey);
+		unwrap.key(core.mEncryptionKey);
+	}
+	if (core.mSigningKey) {
+		signer.key(core.mSigningKey);
+		verifier.key(core.mSigningKey);
+	}
+	
+	haveDbKey = core.mHaveMaster && core.mMasterKey->blobType() == CSSM_KEYBLOB_RAW;
+	if (haveDbKey) {
+		CssmData master = *core.mMasterKey;
+		blobKey(&master, 1, "securityd DbBlob AES-256-GCM", dbKey);
+		keyCheckValue(master, keyCheck);
+	}
+	haveKeyKey = core.mEncryptionKey && core.mSigningKey
+		&& core.mEncryptionKey->blobType() == CSSM_KEYBLOB_RAW
+		&& core.mSigningKey->blobType() == CSSM_KEYBLOB_RAW;
+	if (haveKeyKey) {
+		CssmData secrets[] = { *core.mEncryptionKey, *core.mSigningKey };
+		blobKey(secrets, 2, "securityd KeyBlob AES-256-GCM", keyKey);
+	}
+}
+
+DatabaseCryptoCore::ContextSet::~ContextSet()
+{
+	memset(dbKey, 0, sizeof(dbKey));
+	memset(keyKey, 0, sizeof(keyKey));
+	memset(keyCheck, 0, sizeof(keyCheck));
+}
+
+
+//
+// The ContextCache hands out sets of the current generation, making new ones
+// as needed. Sets that come back after a flush() are discarded.
+//
+DatabaseCryptoCore::ContextCache::~ContextCache()
+{
+	for (std::vector<ContextSet *>::const_iterator it = mFree.begin(); it != mFree.end(); it++)
+		delete *it;
+}
+
+DatabaseCryptoCore::ContextSet *DatabaseCryptoCore::ContextCache::checkOut(const DatabaseCryptoCore &core)
+{
+	unsigned generation;
+	{
+		StLock<Mutex> _(*this);
+		if (!mFree.empty()) {
+			ContextSet *set = mFree.back();
+			mFree.pop_back();
+			return set;
+		}
+		generation = mGeneration;
+	}
+	return new ContextSet(core, generation);
+}
+
+void DatabaseCryptoCore::ContextCache::checkIn(ContextSet *set)
+{
+	{
+		StLock<Mutex> _(*this);
+		if (set->generation == mGeneration) {
+			mFree.push_back(set);
+			return;
+		}
+	}
+	delete set;		// retired while checked out
+}
+
+void DatabaseCryptoCore::ContextCache::flush()
+{
+	std::vector<ContextSet *> retired;
+	{
+		StLock<Mutex> _(*this);
+		mGeneration++;
+		retired.swap(mFree);
+	}
+	for (std::vector<ContextSet *>::const_iterator it = retired.begin(); it != retired.end(); it++)
+		delete *it;
+}
+
+unsigned DatabaseCryptoCore::ContextCache::generation()
+{
+	StLock<Mutex> _(*this);
+	return mGeneration;
+}
+
+
+//
+// Check out a ContextSet for the duration of one operation.
+// If the operation fails, we don't trust the set's state and discard it.
+//
+class DatabaseCryptoCore::Contexts {
+public:
+	Contexts(const DatabaseCryptoCore &core)
+		: mCache(core.mContexts), mSet(mCache.checkOut(core)) { }
+	~Contexts()
+	{
+		if (std::uncaught_exception())
+			delete mSet;
+		else
+			mCache.checkIn(mSet);
+	}
+	
+	ContextSet *operator -> () const { return mSet; }
+
+private:
+	ContextCache &mCache;
+	ContextSet *mSet;
+};
+
+
 //
 // Forget the secrets
 //
@@ -64,6 +399,7 @@ void DatabaseCryptoCore::invalidate()
 	mEncryptionKey.release();
 	mSigningKey.release();
 	mIsValid = false;
+	mContexts.flush();
 }
 
 
@@ -85,6 +421,7 @@ void DatabaseCryptoCore::generateNewSecrets()
     
     // secrets established
     mIsValid = true;
+	mContexts.flush();
 }
 
 
@@ -109,6 +446,7 @@ void DatabaseCryptoCore::setup(const DbBlob *blob, const CssmData &passphrase)
 		Server::active().random(mSalt);
     mMasterKey = deriveDbMasterKey(passphrase);
 	mHaveMaster = true;
+	mContexts.flush();
 }
 
 
@@ -133,6 +471,7 @@ void DatabaseCryptoCore::setup(const DbBlob *blob, CssmClient::Key master)
 		Server::active().random(mSalt);
 	mMasterKey = master;
 	mHaveMaster = true;
+	mContexts.flush();
 }
 
 
@@ -148,8 +487,24 @@ void DatabaseCryptoCore::setup(const DbBlob *blob, CssmClient::Key master)
 bool DatabaseCryptoCore::validatePassphrase(const CssmData &passphrase)
 {
 	assert(hasMaster());
-	CssmClient::Key master = deriveDbMasterKey(passphrase);
-	
+	return validateMasterKey(deriveDbMasterKey(passphrase));
+}
+
+
+//
+// Determine whether a master key (derived by the caller, with our salt)
+// is our master secret. Raw keys are compared outright, in constant time.
+// Otherwise, we see if they encrypt alike.
+//
+bool DatabaseCryptoCore::validateMasterKey(const CssmClient::Key &master) const
+{
+	assert(hasMaster());
+	if (master->blobType() == CSSM_KEYBLOB_RAW && mMasterKey->blobType() == CSSM_KEYBLOB_RAW) {
+		CssmData mine = *mMasterKey, theirs = *master;
+		return mine.length() == theirs.length()
+			&& constantTimeEqual(mine.data(), theirs.data(), mine.length());
+	}
+
 	// to compare master with mMaster, see if they encrypt alike
 	StringData probe
 		("Now is the time for all good processes to come to the aid of their kernel.");
@@ -168,17 +523,45 @@ bool DatabaseCryptoCore::validatePassphrase(const CssmData &passphrase)
 	CssmAutoData cipher2(Server::csp().allocator());
 	cryptor.encrypt(probe, cipher2.get(), noRemainder);
 	
-	return cipher1 == cipher2;
+	return cipher1.length() == cipher2.length()
+		&& constantTimeEqual(cipher1.data(), cipher2.data(), cipher1.length());
+}
+
+
+//
+// Check a master key (derived from the blob's salt) against the key-check value
+// of a sealed DbBlob. This tells a wrong passphrase without decrypting anything.
+// Legacy blobs have no key-check value, and a key that isn't raw can't be checked;
+// the answer is then keyCheckUnknown, and only decoding the blob will tell. Since
+// we write legacy blobs unless told otherwise (securityd -G), this only saves work
+// on keychains that -G has migrated; there's no room in the legacy layout for it.
+//
+DatabaseCryptoCore::KeyCheck DatabaseCryptoCore::checkMasterKey(const DbBlob *blob,
+	const CssmClient::Key &master)
+{
+	if (blob->blobVersion != version_AES_GCM || master->blobType() != CSSM_KEYBLOB_RAW
+			|| blob->cryptoBlobLength() < keyCheckSize)
+		return keyCheckUnknown;
+	uint8 kcv[keyCheckSize];
+	CssmData bits = *master;
+	keyCheckValue(bits, kcv);
+	bool match = constantTimeEqual(kcv, blob->cryptoBlob(), keyCheckSize);
+	memset(kcv, 0, sizeof(kcv));
+	return match ? keyCheckMatch : keyCheckMismatch;
 }
 
 
 //
 // Encode a database blob from the core.
+// We write sealed (AES-GCM) blobs only when told to (securityd -G), and only if
+// the master key is in raw form (and thus can be used to make a sealing key).
 //
 DbBlob *DatabaseCryptoCore::encodeCore(const DbBlob &blobTemplate,
     const CssmData &publicAcl, const CssmData &privateAcl) const
 {
     assert(isValid());		// must have secrets to work from
+	if (!Server::legacyBlobs() && mMasterKey->blobType() == CSSM_KEYBLOB_RAW)
+		return sealCore(blobTemplate, publicAcl, privateAcl);
 
     // make a new IV
     uint8 iv[8];
@@ -192,12 +575,9 @@ DbBlob *DatabaseCryptoCore::encodeCore(const DbBlob &blobTemplate,
     incrypt[1] = signingBits;
     incrypt[2] = privateAcl;
     CssmData cryptoBlob, remData;
-    Encrypt cryptor(Server::csp(), CSSM_ALGID_3DES_3KEY_EDE);
-    cryptor.mode(CSSM_ALGMODE_CBCPadIV8);
-    cryptor.padding(CSSM_PADDING_PKCS1);
-    cryptor.key(mMasterKey);
-    CssmData ivd(iv, sizeof(iv)); cryptor.initVector(ivd);
-    cryptor.encrypt(incrypt, 3, &cryptoBlob, 1, remData);
+    Contexts contexts(*this);
+    contexts->initVector(contexts->encryptor, iv);
+    contexts->encryptor.encrypt(incrypt, 3, &cryptoBlob, 1, remData);
     
     // allocate the final DbBlob, uh, blob
     size_t length = sizeof(DbBlob) + publicAcl.length() + cryptoBlob.length();
@@ -217,40 +597,93 @@ DbBlob *DatabaseCryptoCore::encodeCore(const DbBlob &blobTemplate,
     blob->totalLength = blob->startCryptoBlob + cryptoBlob.length();
     
     // sign the blob
+    signCore(blob, contexts);
+    
+    // all done. Clean up
+    Server::csp()->allocator().free(cryptoBlob);
+    return blob;
+}
+
+void DatabaseCryptoCore::signCore(DbBlob *blob, Contexts &contexts) const
+{
     CssmData signChunk[] = {
 		CssmData(blob->data(), fieldOffsetOf(&DbBlob::blobSignature)),
-		CssmData(blob->publicAclBlob(), publicAcl.length() + cryptoBlob.length())
+		CssmData(blob->publicAclBlob(), blob->publicAclBlobLength() + blob->cryptoBlobLength())
 	};
     CssmData signature(blob->blobSignature, sizeof(blob->blobSignature));
-    GenerateMac signer(Server::csp(), CSSM_ALGID_SHA1HMAC_LEGACY);
-    signer.key(mSigningKey);
-    signer.sign(signChunk, 2, signature);
+    contexts->signer.sign(signChunk, 2, signature);
     assert(signature.length() == sizeof(blob->blobSignature));
-    
-    // all done. Clean up
-    Server::csp()->allocator().free(cryptoBlob);
-    return blob;
+}
+
+
+//
+// Re-encode a database blob that only differs from one we made before in its
+// header fields (sequence, parameters) and public ACL. The caller guarantees that
+// oldBlob came from encodeCore with the secrets we have now, and that privateAcl
+// is what it encrypted.
+// A legacy blob keeps its IV and encrypted section as they are; only the signature
+// is computed anew. A sealed blob must be sealed again in full, since reusing its
+// nonce for a different header and public ACL would give away the GCM hash key;
+// its encrypted section is small, so that costs little once the ACL export is saved.
+//
+DbBlob *DatabaseCryptoCore::reencodeCore(const DbBlob *oldBlob, const DbBlob &blobTemplate,
+	const CssmData &publicAcl, const CssmData &privateAcl) const
+{
+	assert(isValid());
+	bool seal = !Server::legacyBlobs() && mMasterKey->blobType() == CSSM_KEYBLOB_RAW;
+	if (seal || oldBlob->version() == version_AES_GCM)
+		return encodeCore(blobTemplate, publicAcl, privateAcl);
+	
+	size_t cryptoLength = oldBlob->cryptoBlobLength();
+	size_t length = sizeof(DbBlob) + publicAcl.length() + cryptoLength;
+	DbBlob *blob = Allocator::standard().malloc<DbBlob>(length);
+	memset(blob, 0x7d, sizeof(DbBlob));	// deterministically fill any alignment gaps
+	blob->initialize();
+	blob->randomSignature = blobTemplate.randomSignature;
+	blob->sequence = blobTemplate.sequence;
+	blob->params = blobTemplate.params;
+	memcpy(blob->salt, mSalt, sizeof(blob->salt));
+	memcpy(blob->iv, oldBlob->iv, sizeof(blob->iv));
+	memcpy(blob->publicAclBlob(), publicAcl, publicAcl.length());
+	blob->startCryptoBlob = sizeof(DbBlob) + publicAcl.length();
+	memcpy(blob->cryptoBlob(), oldBlob->cryptoBlob(), cryptoLength);
+	blob->totalLength = blob->startCryptoBlob + cryptoLength;
+	
+	try {
+		Contexts contexts(*this);
+		signCore(blob, contexts);
+	} catch (...) {
+		Allocator::standard().free(blob);
+		throw;
+	}
+	return blob;
 }
 
 
 //
 // Decode a database blob into the core.
 // Throws exceptions if decoding fails.
-// Memory returned in privateAclBlob is allocated and becomes owned by caller.
+// Memory returned in privateAclBlob is allocated in the SecureArena and becomes
+// owned by caller.
 //
 void DatabaseCryptoCore::decodeCore(const DbBlob *blob, void **privateAclBlob)
 {
 	assert(mHaveMaster);	// must have master key installed
+	if (blob->version() == version_AES_GCM)
+		return unsealCore(blob, privateAclBlob);
     
     // try to decrypt the cryptoblob section
-    Decrypt decryptor(Server::csp(), CSSM_ALGID_3DES_3KEY_EDE);
-    decryptor.mode(CSSM_ALGMODE_CBCPadIV8);
-    decryptor.padding(CSSM_PADDING_PKCS1);
-    decryptor.key(mMasterKey);
-    CssmData ivd = CssmData::wrap(blob->iv); decryptor.initVector(ivd);
+    // (into the secure arena; the plaintext can't be longer than the ciphertext)
     CssmData cryptoBlob = CssmData::wrap(blob->cryptoBlob(), blob->cryptoBlobLength());
-    CssmData decryptedBlob, remData;
-    decryptor.decrypt(cryptoBlob, decryptedBlob, remData);
+	SecretBuffer plaintext(cryptoBlob.length());
+    CssmData decryptedBlob = plaintext, remData;
+	{
+		Contexts contexts(*this);
+		contexts->initVector(contexts->decryptor, blob->iv);
+		decryptedBlob.length(contexts->decryptor.decrypt(cryptoBlob, decryptedBlob, remData));
+	}
+	if (remData.length() || decryptedBlob.length() < sizeof(DbBlob::PrivateBlob))
+		CssmError::throwMe(CSSMERR_APPLEDL_INVALID_DATABASE_BLOB);
     DbBlob::PrivateBlob *privateBlob = decryptedBlob.interpretedAs<DbBlob::PrivateBlob>();
     
     // tentatively establish keys
@@ -260,32 +693,129 @@ void DatabaseCryptoCore::decodeCore(const DbBlob *blob, void **privateAclBlob)
     mSigningKey = makeRawKey(privateBlob->signingKey,
         sizeof(privateBlob->signingKey), CSSM_ALGID_SHA1HMAC,
         CSSM_KEYUSE_SIGN | CSSM_KEYUSE_VERIFY);
+	mContexts.flush();		// (contexts are keyed to the old secrets)
     
     // verify signature on the whole blob
     CssmData signChunk[] = {
 		CssmData::wrap(blob->data(), fieldOffsetOf(&DbBlob::blobSignature)),
     	CssmData::wrap(blob->publicAclBlob(), blob->publicAclBlobLength() + blob->cryptoBlobLength())
 	};
-    CSSM_ALGORITHMS verifyAlgorithm = CSSM_ALGID_SHA1HMAC;
 #if defined(COMPAT_OSX_10_0)
-    if (blob->version() == blob->version_MacOS_10_0)
-        verifyAlgorithm = CSSM_ALGID_SHA1HMAC_LEGACY;	// BSafe bug compatibility
+    if (blob->version() == blob->version_MacOS_10_0) {
+		VerifyMac verifier(Server::csp(), CSSM_ALGID_SHA1HMAC_LEGACY);	// BSafe bug compatibility
+		verifier.key(mSigningKey);
+		verifier.verify(signChunk, 2, CssmData::wrap(blob->blobSignature));
+	} else
 #endif
-    VerifyMac verifier(Server::csp(), verifyAlgorithm);
-    verifier.key(mSigningKey);
-    verifier.verify(signChunk, 2, CssmData::wrap(blob->blobSignature));
+	{
+		Contexts contexts(*this);
+		contexts->verifier.verify(signChunk, 2, CssmData::wrap(blob->blobSignature));
+	}
     
     // all checks out; start extracting fields
     if (privateAclBlob) {
         // extract private ACL blob as a separately allocated area
         uint32 blobLength = decryptedBlob.length() - sizeof(DbBlob::PrivateBlob);
-        *privateAclBlob = Allocator::standard().malloc(blobLength);
+        *privateAclBlob = SecureArena::shared().malloc(blobLength);
         memcpy(*privateAclBlob, privateBlob->privateAclBlob(), blobLength);
     }
         
     // secrets have been established
     mIsValid = true;
-    Allocator::standard().free(privateBlob);
+}
+
+
+//
+// Sealed (AES-256-GCM) DbBlobs.
+// The encrypted section is the same PrivateBlob as before. The blob header (up to
+// the signature) and the public ACL are authenticated along with it; GCM's tag
+// replaces the HMAC signature.
+//
+DbBlob *DatabaseCryptoCore::sealCore(const DbBlob &blobTemplate,
+    const CssmData &publicAcl, const CssmData &privateAcl) const
+{
+	// the plaintext
+	CssmData &encryptionBits = *mEncryptionKey;
+	CssmData &signingBits = *mSigningKey;
+	size_t cryptoLength = encryptionBits.length() + signingBits.length() + privateAcl.length();
+	SecretBuffer plaintext(cryptoLength);
+	uint8 *p = plaintext.data();
+	memcpy(p, encryptionBits.data(), encryptionBits.length()); p += encryptionBits.length();
+	memcpy(p, signingBits.data(), signingBits.length()); p += signingBits.length();
+	memcpy(p, privateAcl.data(), privateAcl.length());
+	
+	// assemble the DbBlob around it (the crypto blob starts with the key check)
+	size_t length = sizeof(DbBlob) + publicAcl.length() + keyCheckSize + cryptoLength;
+	DbBlob *blob = Allocator::standard().malloc<DbBlob>(length);
+	memset(blob, 0x7d, sizeof(DbBlob));	// deterministically fill any alignment gaps
+	blob->initialize();
+	blob->blobVersion = version_AES_GCM;
+	blob->randomSignature = blobTemplate.randomSignature;
+	blob->sequence = blobTemplate.sequence;
+	blob->params = blobTemplate.params;
+	memcpy(blob->salt, mSalt, sizeof(blob->salt));
+	BlobSeal::newNonce(blob->iv, blob->blobSignature);
+	memcpy(blob->publicAclBlob(), publicAcl, publicAcl.length());
+	blob->startCryptoBlob = sizeof(DbBlob) + publicAcl.length();
+	blob->totalLength = blob->startCryptoBlob + keyCheckSize + cryptoLength;
+	uint8 *keyCheck = (uint8 *)blob->cryptoBlob();
+	
+	// encrypt and seal
+	try {
+		Contexts contexts(*this);
+		assert(contexts->haveDbKey);
+		memcpy(keyCheck, contexts->keyCheck, keyCheckSize);
+		BlobSeal gcm(kCCEncrypt, contexts->dbKey, blob->iv, blob->blobSignature);
+		gcm.authenticate(CssmData(blob->data(), fieldOffsetOf(&DbBlob::blobSignature)));
+		gcm.authenticate(CssmData(blob->publicAclBlob(), publicAcl.length()));
+		gcm.authenticate(CssmData(keyCheck, keyCheckSize));
+		gcm.process(plaintext, keyCheck + keyCheckSize);
+		gcm.seal(blob->blobSignature);
+	} catch (...) {
+		Allocator::standard().free(blob);
+		throw;
+	}
+	return blob;
+}
+
+void DatabaseCryptoCore::unsealCore(const DbBlob *blob, void **privateAclBlob)
+{
+	// authenticate and decrypt
+	if (blob->cryptoBlobLength() < keyCheckSize + sizeof(DbBlob::PrivateBlob))
+		CssmError::throwMe(CSSMERR_APPLEDL_INVALID_DATABASE_BLOB);
+	const uint8 *keyCheck = (const uint8 *)blob->cryptoBlob();
+	CssmData cryptoBlob((void *)(keyCheck + keyCheckSize), blob->cryptoBlobLength() - keyCheckSize);
+	SecretBuffer plaintext(cryptoBlob.length());
+	{
+		Contexts contexts(*this);
+		if (!contexts->haveDbKey)
+			CssmError::throwMe(CSSMERR_CSP_INVALID_KEY);
+		if (!constantTimeEqual(keyCheck, contexts->keyCheck, keyCheckSize))
+			CssmError::throwMe(CSSMERR_CSP_VERIFY_FAILED);	// wrong master key
+		BlobSeal gcm(kCCDecrypt, contexts->dbKey, blob->iv, blob->blobSignature);
+		gcm.authenticate(CssmData::wrap(blob->data(), fieldOffsetOf(&DbBlob::blobSignature)));
+		gcm.authenticate(CssmData::wrap(blob->publicAclBlob(), blob->publicAclBlobLength()));
+		gcm.authenticate(CssmData((void *)keyCheck, keyCheckSize));
+		gcm.process(cryptoBlob, plaintext.data());
+		gcm.open(blob->blobSignature);
+	}
+	
+	// it's genuine: establish keys
+	DbBlob::PrivateBlob *privateBlob = (DbBlob::PrivateBlob *)plaintext.data();
+	mEncryptionKey = makeRawKey(privateBlob->encryptionKey,
+		sizeof(privateBlob->encryptionKey), CSSM_ALGID_3DES_3KEY_EDE,
+		CSSM_KEYUSE_WRAP | CSSM_KEYUSE_UNWRAP);
+	mSigningKey = makeRawKey(privateBlob->signingKey,
+		sizeof(privateBlob->signingKey), CSSM_ALGID_SHA1HMAC,
+		CSSM_KEYUSE_SIGN | CSSM_KEYUSE_VERIFY);
+	mContexts.flush();		// (contexts are keyed to the old secrets)
+	
+	if (privateAclBlob) {
+		uint32 blobLength = plaintext.length() - sizeof(DbBlob::PrivateBlob);
+		*privateAclBlob = SecureArena::shared().malloc(blobLength);
+		memcpy(*privateAclBlob, privateBlob->privateAclBlob(), blobLength);
+	}
+	mIsValid = true;
 }
 
 
@@ -300,10 +830,29 @@ void DatabaseCryptoCore::importSecrets(const DatabaseCryptoCore &src)
 	mEncryptionKey = src.mEncryptionKey;
 	mSigningKey = src.mSigningKey;
     mIsValid = true;
+	mContexts.flush();
+}
+
+//
+// Take another core's operational secrets, but not its master key.
+// Caller must keep src from changing (hold its owner's lock) while we copy.
+//
+void DatabaseCryptoCore::copySecrets(const DatabaseCryptoCore &src)
+{
+	assert(src.isValid());
+	mEncryptionKey = src.mEncryptionKey;
+	mSigningKey = src.mSigningKey;
+	mIsValid = true;
+	mContexts.flush();
 }
 
 //
-// Encode a key blob
+// Encode a key blob.
+// Keys are sealed (AES-GCM) only if we are told to (securityd -G).
+// A sealed blob holds the raw key bits and the private ACL, encrypted together;
+// its wrappedHeader describes the raw key (as for cleartext blobs). A reference
+// key is NULL-wrapped into raw form for this; the CSP lets us, since our keys are
+// kept extractable and not sensitive there (see managedAttributes).
 //
 KeyBlob *DatabaseCryptoCore::encodeKeyCore(const CssmKey &inKey,
     const CssmData &publicAcl, const CssmData &privateAcl,
@@ -312,6 +861,7 @@ KeyBlob *DatabaseCryptoCore::encodeKeyCore(const CssmKey &inKey,
     CssmKey key = inKey;
 	uint8 iv[8];
 	CssmKey wrappedKey;
+	bool sealed = !inTheClear && !Server::legacyBlobs();
 
 	if(inTheClear && (privateAcl.Length != 0)) {
 		/* can't store private ACL component in the clear */
@@ -328,6 +878,19 @@ KeyBlob *DatabaseCryptoCore::encodeKeyCore(const CssmKey &inKey,
 		WrapKey wrap(Server::csp(), CSSM_ALGID_NONE);
 		wrap(key, wrappedKey, NULL);
 	}
+	else if (sealed) {
+		// (key bits and private ACL)
+		assert(isValid());		// need our database secrets
+		if (key.blobType() == CSSM_KEYBLOB_RAW) {
+			wrappedKey = key;
+			wrappedKey.wrapAlgorithm(CSSM_ALGID_NONE);
+			wrappedKey.wrapMode(CSSM_ALGMODE_NONE);
+			wrappedKey.KeyData = CssmData();
+		} else {
+			WrapKey wrap(Server::csp(), CSSM_ALGID_NONE);
+			wrap(key, wrappedKey, NULL);
+		}
+	}
 	else {
 		assert(isValid());		// need our database secrets
 		
@@ -335,28 +898,44 @@ KeyBlob *DatabaseCryptoCore::encodeKeyCore(const CssmKey &inKey,
 		Server::active().random(iv);
 		
 	   // use a CMS wrap to encrypt the key
-		WrapKey wrap(Server::csp(), CSSM_ALGID_3DES_3KEY_EDE);
-		wrap.key(mEncryptionKey);
-		wrap.mode(CSSM_ALGMODE_CBCPadIV8);
-		wrap.padding(CSSM_PADDING_PKCS1);
-		CssmData ivd(iv, sizeof(iv)); wrap.initVector(ivd);
-		wrap.add(CSSM_ATTRIBUTE_WRAPPED_KEY_FORMAT,
-			uint32(CSSM_KEYBLOB_WRAPPED_FORMAT_APPLE_CUSTOM));
-		wrap(key, wrappedKey, &privateAcl);
+		Contexts contexts(*this);
+		contexts->initVector(contexts->wrap, iv);
+		contexts->wrap(key, wrappedKey, &privateAcl);
     }
 	
     // stick the held attribute bits back in
 	key.clearAttribute(forcedAttributes);
     key.setAttribute(heldAttributes);
     
+	// a sealed blob's plaintext: key length (4 bytes), key bits, private ACL
+	CssmData keyBits = wrappedKey.data() ? wrappedKey.keyData() : key.keyData();
+	size_t cryptoLength = wrappedKey.length();
+	if (sealed)
+		cryptoLength = sizeof(uint32) + keyBits.length() + privateAcl.length();
+	SecretBuffer plaintext(sealed ? cryptoLength : 0);
+	if (sealed) {
+		Endian<uint32> keyLength = keyBits.length();
+		memcpy(plaintext.data(), &keyLength, sizeof(keyLength));
+		memcpy(plaintext.data() + sizeof(keyLength), keyBits.data(), keyBits.length());
+		memcpy(plaintext.data() + sizeof(keyLength) + keyBits.length(), privateAcl.data(), privateAcl.length());
+		if (wrappedKey.data()) {	// NULL-wrapped key bits: wipe, now they're copied
+			memset(wrappedKey.data(), 0, wrappedKey.length());
+			Server::csp()->allocator().free(wrappedKey.data());
+			wrappedKey.KeyData = CssmData();
+		}
+	}
+	
     // allocate the final KeyBlob, uh, blob
-    size_t length = sizeof(KeyBlob) + publicAcl.length() + wrappedKey.length();
+    size_t length = sizeof(KeyBlob) + publicAcl.length() + cryptoLength;
     KeyBlob *blob = Allocator::standard().malloc<KeyBlob>(length);
     
     // assemble the KeyBlob
     memset(blob, 0, sizeof(KeyBlob));	// fill alignment gaps
     blob->initialize();
-	if(!inTheClear) {
+	if (sealed) {
+		blob->blobVersion = version_AES_GCM;
+		BlobSeal::newNonce(blob->iv, blob->blobSignature);
+	} else if(!inTheClear) {
 		memcpy(blob->iv, iv, sizeof(iv));
 	}
     blob->header = key.header();
@@ -367,13 +946,31 @@ KeyBlob *DatabaseCryptoCore::encodeKeyCore(const CssmKey &inKey,
     blob->wrappedHeader.wrapMode = wrappedKey.wrapMode();
     memcpy(blob->publicAclBlob(), publicAcl, publicAcl.length());
     blob->startCryptoBlob = sizeof(KeyBlob) + publicAcl.length();
-    memcpy(blob->cryptoBlob(), wrappedKey.data(), wrappedKey.length());
-    blob->totalLength = blob->startCryptoBlob + wrappedKey.length();
+	if (!sealed)
+		memcpy(blob->cryptoBlob(), wrappedKey.data(), wrappedKey.length());
+    blob->totalLength = blob->startCryptoBlob + cryptoLength;
     
  	if(inTheClear) {
 		/* indicate that this is cleartext for decoding */
 		blob->setClearTextSignature();
 	}
+	else if (sealed) {
+		// encrypt and seal
+		try {
+			Contexts contexts(*this);
+			if (!contexts->haveKeyKey)
+				CssmError::throwMe(CSSMERR_CSP_INVALID_KEY);
+			BlobSeal gcm(kCCEncrypt, contexts->keyKey, blob->iv, blob->blobSignature);
+			gcm.authenticate(CssmData(blob->data(), fieldOffsetOf(&KeyBlob::blobSignature)));
+			gcm.authenticate(CssmData(blob->publicAclBlob(), blob->publicAclBlobLength()));
+			gcm.process(plaintext, blob->cryptoBlob());
+			gcm.seal(blob->blobSignature);
+		} catch (...) {
+			Allocator::standard().free(blob);
+			throw;
+		}
+		return blob;
+	}
 	else {
 		// sign the blob
 		CssmData signChunk[] = {
@@ -381,9 +978,8 @@ KeyBlob *DatabaseCryptoCore::encodeKeyCore(const CssmKey &inKey,
 			CssmData(blob->publicAclBlob(), blob->publicAclBlobLength() + blob->cryptoBlobLength())
 		};
 		CssmData signature(blob->blobSignature, sizeof(blob->blobSignature));
-		GenerateMac signer(Server::csp(), CSSM_ALGID_SHA1HMAC_LEGACY);	//@@@!!! CRUD
-		signer.key(mSigningKey);
-		signer.sign(signChunk, 2, signature);
+		Contexts contexts(*this);	// (SHA1HMAC_LEGACY) //@@@!!! CRUD
+		contexts->signer.sign(signChunk, 2, signature);
 		assert(signature.length() == sizeof(blob->blobSignature));
     }
 	
@@ -397,7 +993,7 @@ KeyBlob *DatabaseCryptoCore::encodeKeyCore(const CssmKey &inKey,
 // Decode a key blob
 //
 void DatabaseCryptoCore::decodeKeyCore(KeyBlob *blob,
-    CssmKey &key, void * &pubAcl, void * &privAcl) const
+    CssmKey &key, void * &pubAcl, void * &privAcl, size_t *privAclLength) const
 {    
     // Assemble the encrypted blob as a CSSM "wrapped key"
     CssmKey wrappedKey;
@@ -409,23 +1005,27 @@ void DatabaseCryptoCore::decodeKeyCore(KeyBlob *blob,
     wrappedKey.wrapMode(blob->wrappedHeader.wrapMode);
     wrappedKey.KeyData = CssmData(blob->cryptoBlob(), blob->cryptoBlobLength());
 	
-	bool inTheClear = blob->isClearText();
-	if(!inTheClear) {
+	bool sealed = (blob->version() == version_AES_GCM);
+	bool inTheClear = !sealed && blob->isClearText();
+	if(!inTheClear && !sealed) {
 		// verify signature (check against corruption)
 		assert(isValid());		// need our database secrets
 		CssmData signChunk[] = {
 			CssmData::wrap(blob, fieldOffsetOf(&KeyBlob::blobSignature)),
 			CssmData(blob->publicAclBlob(), blob->publicAclBlobLength() + blob->cryptoBlobLength())
 		};
-		CSSM_ALGORITHMS verifyAlgorithm = CSSM_ALGID_SHA1HMAC;
+		CssmData signature(blob->blobSignature, sizeof(blob->blobSignature));
 	#if defined(COMPAT_OSX_10_0)
-		if (blob->version() == blob->version_MacOS_10_0)
-			verifyAlgorithm = CSSM_ALGID_SHA1HMAC_LEGACY;	// BSafe bug compatibility
+		if (blob->version() == blob->version_MacOS_10_0) {
+			VerifyMac verifier(Server::csp(), CSSM_ALGID_SHA1HMAC_LEGACY);	// BSafe bug compatibility
+			verifier.key(mSigningKey);
+			verifier.verify(signChunk, 2, signature);
+		} else
 	#endif
-		VerifyMac verifier(Server::csp(), verifyAlgorithm);
-		verifier.key(mSigningKey);
-		CssmData signature(blob->blobSignature, sizeof(blob->blobSignature));
-		verifier.verify(signChunk, 2, signature);
+		{
+			Contexts contexts(*this);
+			contexts->verifier.verify(signChunk, 2, signature);
+		}
     }
 	/* else signature indicates cleartext */
 	
@@ -442,17 +1042,16 @@ void DatabaseCryptoCore::decodeKeyCore(KeyBlob *blob,
 				(n2h(blob->header.attributes()) & ~managedAttributes) | forcedAttributes),
 			key, &privAclData);
 	}
+	else if (sealed) {
+		// authenticate and decrypt, then bring in the raw key
+		unsealKeyCore(blob, wrappedKey, key, privAclData);
+	}
 	else {
 		// decrypt the key using an unwrapping operation
-		UnwrapKey unwrap(Server::csp(), CSSM_ALGID_3DES_3KEY_EDE);
-		unwrap.key(mEncryptionKey);
-		unwrap.mode(CSSM_ALGMODE_CBCPadIV8);
-		unwrap.padding(CSSM_PADDING_PKCS1);
-		CssmData ivd(blob->iv, sizeof(blob->iv)); unwrap.initVector(ivd);
-		unwrap.add(CSSM_ATTRIBUTE_WRAPPED_KEY_FORMAT,
-			uint32(CSSM_KEYBLOB_WRAPPED_FORMAT_APPLE_CUSTOM));
+		Contexts contexts(*this);
+		contexts->initVector(contexts->unwrap, blob->iv);
 		wrappedKey.clearAttribute(managedAttributes);    //@@@ shouldn't be needed(?)
-		unwrap(wrappedKey,
+		contexts->unwrap(wrappedKey,
 			KeySpec(n2h(blob->header.usage()),
 				(n2h(blob->header.attributes()) & ~managedAttributes) | forcedAttributes),
 			key, &privAclData);
@@ -478,24 +1077,217 @@ void DatabaseCryptoCore::decodeKeyCore(KeyBlob *blob,
         CssmError::throwMe(CSSMERR_CSP_INVALID_KEY);
 	}
 	
+	// move a CSP-allocated private ACL into the secure arena
+	if (!sealed && privAclData.data()) {
+		void *secure = SecureArena::shared().malloc(privAclData.length());
+		memcpy(secure, privAclData.data(), privAclData.length());
+		memset(privAclData.data(), 0, privAclData.length());
+		Server::csp()->allocator().free(privAclData.data());
+		privAclData = CssmData(secure, privAclData.length());
+	}
+	
     // got a valid key: return the pieces
     pubAcl = blob->publicAclBlob();		// points into blob (shared)
-    privAcl = privAclData;				// was allocated by CSP decrypt, else NULL for
+    privAcl = privAclData;				// in the SecureArena, else NULL for
 										// cleatext keys
+	if (privAclLength)
+		*privAclLength = privAclData.length();
     // key was set by unwrap operation
 }
 
 
+//
+// Open a sealed (AES-GCM) key blob. Once the tag checks out, the raw key bits
+// are brought into the CSP with a NULL unwrap, as for cleartext blobs; the
+// private ACL is returned in memory allocated for the caller.
+//
+void DatabaseCryptoCore::unsealKeyCore(KeyBlob *blob, CssmKey &wrappedKey,
+	CssmKey &key, CssmData &privAcl) const
+{
+	assert(isValid());		// need our database secrets
+	CssmData cryptoBlob(blob->cryptoBlob(), blob->cryptoBlobLength());
+	SecretBuffer plaintext(cryptoBlob.length());
+	{
+		Contexts contexts(*this);
+		if (!contexts->haveKeyKey)
+			CssmError::throwMe(CSSMERR_CSP_INVALID_KEY);
+		BlobSeal gcm(kCCDecrypt, contexts->keyKey, blob->iv, blob->blobSignature);
+		gcm.authenticate(CssmData::wrap(blob, fieldOffsetOf(&KeyBlob::blobSignature)));
+		gcm.authenticate(CssmData(blob->publicAclBlob(), blob->publicAclBlobLength()));
+		gcm.process(cryptoBlob, plaintext.data());
+		gcm.open(blob->blobSignature);
+	}
+	
+	// split into key bits and private ACL
+	Endian<uint32> keyLength;
+	if (plaintext.length() < sizeof(keyLength))
+		CssmError::throwMe(CSSMERR_APPLEDL_INVALID_KEY_BLOB);
+	memcpy(&keyLength, plaintext.data(), sizeof(keyLength));
+	uint32 keyBytes = keyLength;
+	if (keyBytes > plaintext.length() - sizeof(keyLength))
+		CssmError::throwMe(CSSMERR_APPLEDL_INVALID_KEY_BLOB);
+	size_t aclBytes = plaintext.length() - sizeof(keyLength) - keyBytes;
+	
+	UnwrapKey unwrap(Server::csp(), CSSM_ALGID_NONE);
+	wrappedKey.clearAttribute(managedAttributes);
+	wrappedKey.KeyData = CssmData(plaintext.data() + sizeof(keyLength), keyBytes);
+	CssmData descriptiveData;
+	unwrap(wrappedKey,
+		KeySpec(n2h(blob->header.usage()),
+			(n2h(blob->header.attributes()) & ~managedAttributes) | forcedAttributes),
+		key, &descriptiveData);
+	wrappedKey.KeyData = CssmData();	// (don't leave it pointing at plaintext)
+	
+	if (aclBytes) {
+		privAcl = CssmData(SecureArena::shared().malloc(aclBytes), aclBytes);
+		memcpy(privAcl.data(), plaintext.data() + sizeof(keyLength) + keyBytes, aclBytes);
+	} else
+		privAcl = CssmData();
+}
+
+
 //
 // Derive the blob-specific database blob encryption key from the passphrase and the salt.
 //
+static const uint32 masterKeyIterations = 1000;		// PBKDF2 iteration count
+static const size_t masterKeySize = 24;				// 3DES_3KEY_EDE key bytes
+
 CssmClient::Key DatabaseCryptoCore::deriveDbMasterKey(const CssmData &passphrase) const
+{
+	CssmClient::Key master;
+	deriveDbMasterKeys(passphrase, mSalt, 1, &master);
+	return master;
+}
+
+
+//
+// Derive master keys for a number of salts (saltSize bytes each, back to back)
+// from a single passphrase. This is what trying a passphrase against several
+// keychains at once comes down to. The native PBKDF2 runs a whole batch in about
+// the time of one derivation; but we only trust it once it has shown that it
+// agrees with the CSP. Failing that, the CSP derivations are spread over the
+// server's WorkPool.
+//
+void DatabaseCryptoCore::deriveDbMasterKeys(const CssmData &passphrase,
+	const uint8 *salts, size_t count, CssmClient::Key *masters)
+{
+	if (count == 0)
+		return;
+	if (nativeDerivation()) {
+		SecretBuffer bits(count * masterKeySize);
+		std::vector<PBKDF2::Derivation> derivations(count);
+		for (size_t n = 0; n < count; n++) {
+			derivations[n].passphrase = passphrase;
+			derivations[n].salt = CssmData((void *)(salts + n * saltSize), saltSize);
+			derivations[n].output = CssmData(bits.data() + n * masterKeySize, masterKeySize);
+		}
+		PBKDF2::derive(&derivations[0], count, masterKeyIterations);
+		for (size_t n = 0; n < count; n++)
+			masters[n] = makeRawKey(bits.data() + n * masterKeySize, masterKeySize,
+				CSSM_ALGID_3DES_3KEY_EDE, CSSM_KEYUSE_ENCRYPT | CSSM_KEYUSE_DECRYPT);
+	} else if (count == 1) {
+		masters[0] = cspDeriveDbMasterKey(passphrase, CssmData((void *)salts, saltSize));
+	} else {
+		struct Derive : public WorkPool::Job {
+			const CssmData *passphrase;
+			CssmData salt;
+			CssmClient::Key *master;
+			CSSM_RETURN result;
+			
+			void operator () ()
+			{
+				try {
+					*master = cspDeriveDbMasterKey(*passphrase, salt);
+					result = CSSM_OK;
+				} catch (const CommonError &err) {
+					result = CssmError::cssmError(err, CSSM_CSP_BASE_ERROR);
+				}
+			}
+		};
+		std::vector<Derive> derivations(count);
+		std::vector<WorkPool::Job *> jobs(count);
+		for (size_t n = 0; n < count; n++) {
+			derivations[n].passphrase = &passphrase;
+			derivations[n].salt = CssmData((void *)(salts + n * saltSize), saltSize);
+			derivations[n].master = &masters[n];
+			derivations[n].result = CSSM_ERRCODE_INTERNAL_ERROR;
+			jobs[n] = &derivations[n];
+		}
+		Server::workPool().run(&jobs[0], count);
+		for (size_t n = 0; n < count; n++)
+			if (derivations[n].result != CSSM_OK)
+				CssmError::throwMe(derivations[n].result);
+	}
+}
+
+
+//
+// Try a passphrase on a number of DbBlobs, reporting for each whether it fits.
+// The master keys are derived as a batch (above); checking each against its
+// blob - by key-check value where the blob has one, or else by decoding it in
+// a scratch core - is spread over the server's WorkPool. Nothing here touches
+// a database, so our caller needn't hold any lock; the blobs must stay put.
+//
+void DatabaseCryptoCore::tryPassphrase(const CssmData &passphrase, const DbBlob * const *blobs,
+	size_t count, CssmClient::Key *masters, CSSM_RETURN *results)
+{
+	if (count == 0)
+		return;
+	std::vector<uint8> salts(count * saltSize);
+	for (size_t n = 0; n < count; n++)
+		memcpy(&salts[n * saltSize], blobs[n]->salt, saltSize);
+	deriveDbMasterKeys(passphrase, &salts[0], count, masters);
+	
+	struct Trial : public WorkPool::Job {
+		const DbBlob *blob;
+		CssmClient::Key master;
+		CSSM_RETURN result;
+		
+		void operator () ()
+		{
+			try {
+				switch (checkMasterKey(blob, master)) {
+				case keyCheckMatch:
+					result = CSSM_OK;
+					return;
+				case keyCheckMismatch:
+					result = CSSMERR_CSP_VERIFY_FAILED;
+					return;
+				case keyCheckUnknown:
+					break;
+				}
+				DatabaseCryptoCore scratch;
+				scratch.setup(blob, master);
+				scratch.decodeCore(blob, NULL);
+				result = CSSM_OK;
+			} catch (const CommonError &err) {
+				result = CssmError::cssmError(err, CSSM_CSP_BASE_ERROR);
+			}
+		}
+	};
+	std::vector<Trial> trials(count);
+	std::vector<WorkPool::Job *> jobs(count);
+	for (size_t n = 0; n < count; n++) {
+		trials[n].blob = blobs[n];
+		trials[n].master = masters[n];
+		trials[n].result = CSSM_ERRCODE_INTERNAL_ERROR;
+		jobs[n] = &trials[n];
+	}
+	Server::workPool().run(&jobs[0], count);
+	for (size_t n = 0; n < count; n++)
+		results[n] = trials[n].result;
+}
+
+
+//
+// The CSP's own derivation, one passphrase and salt at a time.
+//
+CssmClient::Key DatabaseCryptoCore::cspDeriveDbMasterKey(const CssmData &passphrase, const CssmData &salt)
 {
     // derive an encryption key and IV from passphrase and salt
     CssmClient::DeriveKey makeKey(Server::csp(),
-        CSSM_ALGID_PKCS5_PBKDF2, CSSM_ALGID_3DES_3KEY_EDE, 24 * 8);
-    makeKey.iterationCount(1000);
-	CssmData salt = CssmData::wrap(mSalt);
+        CSSM_ALGID_PKCS5_PBKDF2, CSSM_ALGID_3DES_3KEY_EDE, masterKeySize * 8);
+    makeKey.iterationCount(masterKeyIterations);
     makeKey.salt(salt);
     CSSM_PKCS5_PBKDF2_PARAMS params;
     params.Passphrase = passphrase;
@@ -506,6 +1298,47 @@ CssmClient::Key DatabaseCryptoCore::deriveDbMasterKey(const CssmData &passphrase
 }
 
 
+//
+// Decide, once per run, whether to use the native PBKDF2. It must pass its
+// known-answer test and produce the same key bits as the CSP for a master key
+// derivation. If either fails, we log it and stick with the CSP.
+//
+static pthread_once_t nativeDerivationCheck = PTHREAD_ONCE_INIT;
+static bool nativeDerivationOK = false;
+
+static void checkNativeDerivation()
+{
+	try {
+		if (!PBKDF2::selfTest()) {
+			Syslog::error("native PBKDF2 failed its self test; using the CSP");
+			return;
+		}
+		static const char passphrase[] = "Mary had a little lamb";
+		uint8 salt[DatabaseCryptoCore::saltSize];
+		for (unsigned n = 0; n < sizeof(salt); n++)
+			salt[n] = n * 13 + 1;
+		CssmData pass((void *)passphrase, sizeof(passphrase) - 1);
+		CssmData saltData = CssmData::wrap(salt);
+		uint8 bits[masterKeySize];
+		PBKDF2::derive(pass, saltData, masterKeyIterations, CssmData::wrap(bits));
+		CssmClient::Key reference = DatabaseCryptoCore::cspDeriveDbMasterKey(pass, saltData);
+		if (reference->keyData() == CssmData::wrap(bits)) {
+			secdebug("dbcrypto", "native PBKDF2 (%u lanes) verified against CSP", PBKDF2::lanes);
+			nativeDerivationOK = true;
+		} else
+			Syslog::error("native PBKDF2 disagrees with the CSP; using the CSP");
+	} catch (...) {
+		Syslog::error("native PBKDF2 verification failed; using the CSP");
+	}
+}
+
+bool DatabaseCryptoCore::nativeDerivation()
+{
+	pthread_once(&nativeDerivationCheck, checkNativeDerivation);
+	return nativeDerivationOK;
+}
+
+
 //
 // Turn raw keybits into a symmetric key in the CSP
 //
@@ -31,6 +31,9 @@
 #include <securityd_client/ssblob.h>
 #include <security_cdsa_client/cspclient.h>
 #include <security_cdsa_client/keyclient.h>
+#include <security_utilities/threading.h>
+#include <security_utilities/refcount.h>
+#include <vector>
 
 using namespace SecurityServer;
 
@@ -58,34 +61,107 @@ public:
     void decodeCore(const DbBlob *blob, void **privateAclBlob = NULL);
     DbBlob *encodeCore(const DbBlob &blobTemplate,
         const CssmData &publicAcl, const CssmData &privateAcl) const;
+	DbBlob *reencodeCore(const DbBlob *oldBlob, const DbBlob &blobTemplate,
+		const CssmData &publicAcl, const CssmData &privateAcl) const;
+	unsigned secretsGeneration() const { return mContexts.generation(); }
 	void importSecrets(const DatabaseCryptoCore &src);
         
     KeyBlob *encodeKeyCore(const CssmKey &key,
         const CssmData &publicAcl, const CssmData &privateAcl,
 		bool inTheClear) const;
     void decodeKeyCore(KeyBlob *blob,
-        CssmKey &key, void * &pubAcl, void * &privAcl) const;
+        CssmKey &key, void * &pubAcl, void * &privAcl, size_t *privAclLength = NULL) const;
 
     static const uint32 managedAttributes = KeyBlob::managedAttributes;
 	static const uint32 forcedAttributes = KeyBlob::forcedAttributes;
 	
+	// blob version of AES-256-GCM sealed DbBlobs and KeyBlobs (see doc/BLOBFORMAT)
+	static const uint32 version_AES_GCM = 0x00000110;
+	
 public:
 	bool validatePassphrase(const CssmData &passphrase);
+	bool validateMasterKey(const CssmClient::Key &master) const;
+	
+	// check a master key against a DbBlob's key-check value, where it has one
+	enum KeyCheck { keyCheckUnknown, keyCheckMatch, keyCheckMismatch };
+	static KeyCheck checkMasterKey(const DbBlob *blob, const CssmClient::Key &master);
+	
+	// derive the master keys for several DbBlob salts from one passphrase, as a batch
+	static const size_t saltSize = 20;
+	static void deriveDbMasterKeys(const CssmData &passphrase,
+		const uint8 *salts, size_t count, CssmClient::Key *masters);
+	
+	// try one passphrase on several DbBlobs at once, without installing anything;
+	// results[n] is CSSM_OK where it fits, and masters[n] is then its master key
+	static void tryPassphrase(const CssmData &passphrase, const DbBlob * const *blobs,
+		size_t count, CssmClient::Key *masters, CSSM_RETURN *results);
+
+protected:
+	void copySecrets(const DatabaseCryptoCore &src); // operational secrets only
 	
 private:
 	bool mHaveMaster;				// master key has been entered (setup)
     bool mIsValid;					// master secrets are valid (decode or generateNew)
     
 	CssmClient::Key mMasterKey;		// database master key
-	uint8 mSalt[20];				// salt for master key derivation from passphrase (only)
+	uint8 mSalt[saltSize];			// salt for master key derivation from passphrase (only)
 	
     CssmClient::Key mEncryptionKey;	// master encryption key
     CssmClient::Key mSigningKey;	// master signing key
 
+	//
+	// CSP contexts keyed to our secrets, kept for reuse so that blob coding doesn't
+	// set up and tear down a CSP context per operation. A context can't be used by
+	// two threads at once, so an operation checks out a whole ContextSet and returns
+	// it when done; there are only ever as many sets as threads that have used this
+	// core at the same time. Any change of secrets (including invalidate) retires
+	// all sets.
+	//
+	class ContextSet;
+	class ContextCache : public Mutex {
+	public:
+		ContextCache() : mGeneration(0) { }
+		~ContextCache();
+		
+		ContextSet *checkOut(const DatabaseCryptoCore &core);
+		void checkIn(ContextSet *set);
+		void flush();					// retire all sets
+		unsigned generation();			// (never 0 once we have secrets)
+		
+	private:
+		std::vector<ContextSet *> mFree; // sets of the current generation
+		unsigned mGeneration;			// bumped by flush()
+	};
+	mutable ContextCache mContexts;
+	class Contexts;						// a checked-out ContextSet (scoped)
+	
+	void signCore(DbBlob *blob, Contexts &contexts) const; // (legacy DbBlob HMAC)
+	
+	// AES-256-GCM (version_AES_GCM) blob coding
+	DbBlob *sealCore(const DbBlob &blobTemplate,
+		const CssmData &publicAcl, const CssmData &privateAcl) const;
+	void unsealCore(const DbBlob *blob, void **privateAclBlob);
+	void unsealKeyCore(KeyBlob *blob, CssmKey &wrappedKey,
+		CssmKey &key, CssmData &privAcl) const;
+	
     CssmClient::Key deriveDbMasterKey(const CssmData &passphrase) const;
-    CssmClient::Key makeRawKey(void *data, size_t length,
+	static CssmClient::Key cspDeriveDbMasterKey(const CssmData &passphrase, const CssmData &salt);
+	static bool nativeDerivation();
+    static CssmClient::Key makeRawKey(void *data, size_t length,
         CSSM_ALGORITHMS algid, CSSM_KEYUSE usage);
 };
 
 
+//
+// A private copy of a core's operational secrets, for decoding its key blobs
+// without holding its owner's lock (see KeychainKey::prefetch). Make one while
+// holding that lock. It keeps its own references to the CSP keys, so a lockDb()
+// invalidating the original can't pull them out from under a decode.
+//
+class SecretsSnapshot : public DatabaseCryptoCore, public RefCount {
+public:
+	SecretsSnapshot(const DatabaseCryptoCore &src) { copySecrets(src); }
+};
+
+
 #endif //_H_DBCRYPTO
@@ -36,6 +36,7 @@
 // file that some fool administrator removed yesterday.
 //
 #include "entropy.h"
+#include "fastrandom.h"
 #include "dtrace.h"
 #include <sys/sysctl.h>
 #include <mach/clock_types.h>
@@ -136,7 +137,7 @@ static double CalculateEntropy(const void* buffer, size_t bufferSize)
 // Note that the sysctl will block until the buffer is full or the timeout expires.
 // We currently use a 1ms timeout, which almost always fills the buffer and
 // does not provide enough of a delay to worry about it. If we ever get worried,
-// we could call longTermActivity on the server object to get another thread going.
+// we could call longTermWait on the server object to get another thread going.
 //
 
 void EntropyManager::collectEntropy()
@@ -196,6 +197,9 @@ void EntropyManager::collectEntropy()
     {
         Syslog::alert("Entropy collection fulfillment took %d loops", loopCount);
     }
+    
+    // have the buffered generators pick up what we just fed the kernel
+    FastRandomGenerator::reseed();
 }
 
 
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// fastrandom - per-thread buffered ChaCha20 random number generator
+//
+#include "fastrandom.h"
+#include <security_utilities/devrandom.h>
+#include <security_utilities/globalizer.h>
+#include <security_utilities/logging.h>
+#include <security_utilities/debugging.h>
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+
+using std::min;
+
+
+//
+// The ChaCha20 block function (RFC 7539), with a 32-bit block counter and
+// a 96-bit nonce. Our streams always use a zero nonce; every key is used
+// for one run of counters and then discarded.
+//
+static const size_t keySize = 32;
+static const size_t chachaBlockSize = 64;
+
+static inline uint32_t rotl(uint32_t x, unsigned n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = rotl(d, 16); \
+	c += d; b ^= c; b = rotl(b, 12); \
+	a += b; d ^= a; d = rotl(d, 8); \
+	c += d; b ^= c; b = rotl(b, 7);
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void chachaBlock(const uint8_t key[keySize], uint32_t counter,
+	const uint8_t nonce[12], uint8_t out[chachaBlockSize])
+{
+	uint32_t input[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,	// "expand 32-byte k"
+		load32(key), load32(key + 4), load32(key + 8), load32(key + 12),
+		load32(key + 16), load32(key + 20), load32(key + 24), load32(key + 28),
+		counter, load32(nonce), load32(nonce + 4), load32(nonce + 8)
+	};
+	uint32_t x[16];
+	memcpy(x, input, sizeof(x));
+	for (unsigned round = 0; round < 10; round++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12])
+		QUARTERROUND(x[1], x[5], x[9], x[13])
+		QUARTERROUND(x[2], x[6], x[10], x[14])
+		QUARTERROUND(x[3], x[7], x[11], x[15])
+		QUARTERROUND(x[0], x[5], x[10], x[15])
+		QUARTERROUND(x[1], x[6], x[11], x[12])
+		QUARTERROUND(x[2], x[7], x[8], x[13])
+		QUARTERROUND(x[3], x[4], x[9], x[14])
+	}
+	for (unsigned n = 0; n < 16; n++)
+		store32(out + 4 * n, x[n] + input[n]);
+	memset(x, 0, sizeof(x));
+	memset(input, 0, sizeof(input));
+	asm volatile("" : : "r"(x), "r"(input) : "memory");	// keep the wipes
+}
+
+#undef QUARTERROUND
+
+static void wipe(void *addr, size_t length)
+{
+	memset(addr, 0, length);
+	asm volatile("" : : "r"(addr) : "memory");
+}
+
+
+//
+// Global state: the reseed epoch (bumped by reseed() and in the child of a fork)
+// and a count of seedings, for diagnostics and tests.
+//
+static volatile uint32_t reseedEpoch = 1;
+static volatile int64_t seedCount = 0;
+
+static void forkedChild()
+{
+	__sync_fetch_and_add(&reseedEpoch, 1);
+}
+
+static pthread_once_t setupOnce = PTHREAD_ONCE_INIT;
+static bool chachaOK = false;
+
+static void setup()
+{
+	if (FastRandomGenerator::selfTest()) {
+		pthread_atfork(NULL, NULL, forkedChild);
+		chachaOK = true;
+	} else
+		Syslog::error("ChaCha20 failed its self test; random numbers come from /dev/random");
+}
+
+
+//
+// One thread's stream. Bytes [bufferSize - mAvailable, bufferSize) of the
+// buffer are unused output; everything before that has been wiped.
+//
+class RandomStream {
+public:
+	RandomStream() : mAvailable(0), mOutput(0), mEpoch(0) { memset(mKey, 0, sizeof(mKey)); }
+	~RandomStream() { wipe(mKey, sizeof(mKey)); wipe(mBuffer, sizeof(mBuffer)); }
+	
+	void random(uint8_t *data, size_t length);
+	
+private:
+	void seed();
+	void refill();
+	void generate(uint8_t *data, size_t length);
+	
+private:
+	uint8_t mKey[keySize];
+	uint8_t mBuffer[FastRandomGenerator::bufferSize];
+	size_t mAvailable;
+	uint64_t mOutput;				// bytes since last seeding
+	uint32_t mEpoch;				// reseedEpoch when last seeded (0 = never)
+};
+
+static ThreadNexus<RandomStream> streams;
+
+static const uint8_t zeroNonce[12] = { 0 };
+
+
+//
+// Mix fresh kernel entropy into the key and drop any buffered output.
+// (The old key is kept in the mix, so a weak read can't make things worse.)
+//
+void RandomStream::seed()
+{
+	uint8_t fresh[keySize];
+	DevRandomGenerator().random(fresh, sizeof(fresh));
+	for (unsigned n = 0; n < keySize; n++)
+		mKey[n] ^= fresh[n];
+	wipe(fresh, sizeof(fresh));
+	wipe(mBuffer, sizeof(mBuffer));
+	mAvailable = 0;
+	mOutput = 0;
+	mEpoch = reseedEpoch;
+	__sync_fetch_and_add(&seedCount, 1);
+	secdebug("fastrandom", "%p seeded (epoch %u)", this, mEpoch);
+}
+
+
+//
+// Generate a new buffer; its first keySize bytes become the next key
+//
+void RandomStream::refill()
+{
+	for (unsigned n = 0; n < FastRandomGenerator::bufferSize / chachaBlockSize; n++)
+		chachaBlock(mKey, n, zeroNonce, mBuffer + n * chachaBlockSize);
+	memcpy(mKey, mBuffer, keySize);
+	wipe(mBuffer, keySize);
+	mAvailable = FastRandomGenerator::bufferSize - keySize;
+}
+
+
+//
+// Generate a large request directly: block 0 supplies the next key,
+// blocks 1... the output.
+//
+void RandomStream::generate(uint8_t *data, size_t length)
+{
+	uint8_t block[chachaBlockSize];
+	chachaBlock(mKey, 0, zeroNonce, block);
+	uint8_t nextKey[keySize];
+	memcpy(nextKey, block, keySize);
+	for (uint32_t counter = 1; length > 0; counter++) {
+		if (length >= chachaBlockSize) {
+			chachaBlock(mKey, counter, zeroNonce, data);
+			data += chachaBlockSize;
+			length -= chachaBlockSize;
+		} else {
+			chachaBlock(mKey, counter, zeroNonce, block);
+			memcpy(data, block, length);
+			length = 0;
+		}
+	}
+	memcpy(mKey, nextKey, keySize);
+	wipe(nextKey, sizeof(nextKey));
+	wipe(block, sizeof(block));
+}
+
+
+void RandomStream::random(uint8_t *data, size_t length)
+{
+	if (mEpoch != reseedEpoch || mOutput >= FastRandomGenerator::reseedBytes)
+		seed();
+	mOutput += length;
+	
+	if (length > FastRandomGenerator::largeRequest) {
+		generate(data, length);
+		return;
+	}
+	while (length > 0) {
+		if (mAvailable == 0)
+			refill();
+		uint8_t *from = mBuffer + FastRandomGenerator::bufferSize - mAvailable;
+		size_t count = min(length, mAvailable);
+		memcpy(data, from, count);
+		wipe(from, count);
+		data += count;
+		length -= count;
+		mAvailable -= count;
+	}
+}
+
+
+//
+// The Generator interface
+//
+void FastRandomGenerator::random(void *data, size_t length)
+{
+	pthread_once(&setupOnce, setup);
+	if (chachaOK)
+		streams().random((uint8_t *)data, length);
+	else
+		DevRandomGenerator().random(data, length);
+}
+
+void FastRandomGenerator::reseed()
+{
+	__sync_fetch_and_add(&reseedEpoch, 1);
+}
+
+uint64_t FastRandomGenerator::seedings()
+{
+	return seedCount;
+}
+
+
+//
+// Known-answer test: the block function test vector of RFC 7539 section 2.3.2
+//
+bool FastRandomGenerator::selfTest()
+{
+	static const uint8_t nonce[12] = {
+		0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00
+	};
+	static const uint8_t expected[chachaBlockSize] = {
+		0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+		0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+		0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+		0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e,
+	};
+	uint8_t key[keySize];
+	for (unsigned n = 0; n < keySize; n++)
+		key[n] = n;
+	uint8_t output[chachaBlockSize];
+	chachaBlock(key, 1, nonce, output);
+	return !memcmp(output, expected, sizeof(output));
+}
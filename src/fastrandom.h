@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// fastrandom - per-thread buffered ChaCha20 random number generator
+//
+#ifndef _H_FASTRANDOM
+#define _H_FASTRANDOM
+
+#include <security_utilities/utilities.h>
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace Security;
+
+
+//
+// FastRandomGenerator is the Server's source of IVs, salts, nonces and handles.
+// Each thread runs its own fast-key-erasure ChaCha20 stream: a refill generates
+// bufferSize bytes, the first 32 of which immediately replace the key, and small
+// requests are served (and wiped) from the rest of the buffer. Requests bigger
+// than largeRequest are generated directly, again re-keying first.
+//
+// A stream seeds itself from /dev/random (DevRandomGenerator) on first use, after
+// reseedBytes of output, after a fork (in the child), and whenever reseed() is
+// called - the EntropyManager does so each time it feeds new entropy to the kernel.
+// If the ChaCha20 known-answer test fails, everything comes from /dev/random.
+//
+// This is a drop-in Generator for UniformRandomBlobs<>.
+//
+class FastRandomGenerator {
+public:
+	void random(void *data, size_t length);
+	
+	static void reseed();					// all streams reseed before their next output
+	static uint64_t seedings();				// (re)seed operations so far, all threads
+	static bool selfTest();					// ChaCha20 known-answer test (RFC 7539)
+	
+	static const size_t bufferSize = 768;	// bytes per refill (12 ChaCha20 blocks)
+	static const size_t largeRequest = 256;	// bigger requests bypass the buffer
+	static const uint64_t reseedBytes = 1024 * 1024; // output between reseeds
+};
+
+
+#endif //_H_FASTRANDOM
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// handles - client handles for securityd objects
+//
+#include "handles.h"
+#include <security_utilities/debugging.h>
+
+
+ModuleNexus<ClientHandleObject::Table> ClientHandleObject::table;
+
+
+//
+// Objects get their handles at birth and give them up at death
+//
+ClientHandleObject::ClientHandleObject()
+	: mHandle(table().allocate(this))
+{
+}
+
+ClientHandleObject::~ClientHandleObject()
+{
+	table().release(mHandle);
+}
+
+
+//
+// Locate the slab a handle points into.
+// Slabs are never deallocated, so once we have one we can use it at leisure.
+// (slabsUsed() orders our reading of the count before that of the slab.)
+//
+ClientHandleObject::Slab &ClientHandleObject::slabFor(Handle handle, CSSM_RETURN error)
+{
+	unsigned slab = (handle & indexMask) >> slabBits;
+	Table &tab = table();
+	if (slab >= tab.slabsUsed())
+		CssmError::throwMe(error);
+	return *tab.slab(slab);
+}
+
+
+ClientHandleObject::Slab::Slab()
+{
+	for (unsigned n = 0; n < slabSize; n++) {
+		slots[n].generation = 1;
+		slots[n].object = NULL;
+	}
+}
+
+
+ClientHandleObject::Table::Table()
+	: mSlabsUsed(0)
+{
+	memset(mSlabs, 0, sizeof(mSlabs));
+}
+
+
+//
+// Allocate a slot.
+// We reuse the slot that has been vacant longest, so that a slot's generation
+// count takes as long as possible to come around again. We only make new slabs
+// when there are no vacant slots at all.
+//
+ClientHandleObject::Handle ClientHandleObject::Table::allocate(ClientHandleObject *object)
+{
+	StLock<Mutex> _(*this);
+	Handle index;
+	if (!mFree.empty()) {
+		index = mFree.front();
+		mFree.pop_front();
+	} else {
+		if (mSlabsUsed == slabCount)
+			CssmError::throwMe(CSSM_ERRCODE_MEMORY_ERROR);	// out of handles
+		// lookups read the count without our lock, so the new slab (and its
+		// slots) must be in place before the count says so
+		mSlabs[mSlabsUsed] = new Slab;
+		__sync_synchronize();
+		index = mSlabsUsed << slabBits;
+		mSlabsUsed = mSlabsUsed + 1;
+		for (unsigned n = 1; n < slabSize; n++)
+			mFree.push_back(index + n);
+	}
+	Slab &slab = *mSlabs[index >> slabBits];
+	StLock<Mutex> __(slab);
+	Slot &slot = slab.slots[index & (slabSize - 1)];
+	slot.object = object;
+	return slot.generation << indexBits | index;
+}
+
+
+//
+// Vacate a slot, invalidating all outstanding handles to it
+//
+void ClientHandleObject::Table::release(Handle handle)
+{
+	Handle index = handle & indexMask;
+	{
+		Slab &slab = *mSlabs[index >> slabBits];
+		StLock<Mutex> _(slab);
+		Slot &slot = slab.slots[index & (slabSize - 1)];
+		assert(slot.generation == handle >> indexBits);
+		slot.object = NULL;
+		slot.generation = (slot.generation % generationMask) + 1;	// 1..generationMask
+	}
+	StLock<Mutex> _(*this);
+	mFree.push_back(index);
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// handles - client handles for securityd objects
+//
+#ifndef _H_HANDLES
+#define _H_HANDLES
+
+#include <security_utilities/threading.h>
+#include <security_utilities/globalizer.h>
+#include <security_utilities/refcount.h>
+#include <security_cdsa_utilities/cssmerrors.h>
+#include <vector>
+#include <deque>
+
+using namespace Security;
+
+
+//
+// A ClientHandleObject can be named by clients through a 32-bit handle.
+// Handles index a slab-allocated slot table; the top bits carry a generation
+// count that is bumped whenever a slot is vacated, so a stale handle (or one
+// made up by a client) is rejected with a single comparison and never finds
+// the slot's next occupant. Each slab has its own lock, which is only ever
+// held for a few instructions, so lookups from different threads almost never
+// contend with each other. Lookups don't take the table lock at all; they only
+// contend with allocation and release of handles in the same slab.
+//
+class ClientHandleObject {
+public:
+	typedef uint32_t Handle;
+	
+	ClientHandleObject();
+	virtual ~ClientHandleObject();
+	
+	Handle handle() const	{ return mHandle; }
+	
+	// find object by handle and type; throw error if not found or of the wrong type
+	template <class Subtype>
+	static Subtype &find(Handle handle, CSSM_RETURN error)
+	{
+		Slab &slab = slabFor(handle, error);
+		StLock<Mutex> _(slab);
+		if (Subtype *object = dynamic_cast<Subtype *>(slab.occupant(handle)))
+			return *object;
+		CssmError::throwMe(error);
+	}
+	
+	template <class Subtype>
+	static RefPointer<Subtype> findRef(Handle handle, CSSM_RETURN error)
+	{
+		Slab &slab = slabFor(handle, error);
+		StLock<Mutex> _(slab);		// object can't go away while we take our reference
+		if (Subtype *object = dynamic_cast<Subtype *>(slab.occupant(handle)))
+			return object;
+		CssmError::throwMe(error);
+	}
+	
+	// handles of all live objects of a type
+	template <class Subtype>
+	static void findAllRefs(std::vector<Handle> &handles);
+
+private:
+	static const unsigned indexBits = 20;		// up to a million live objects
+	static const unsigned slabBits = 10;		// slots per slab (log2)
+	static const unsigned slabSize = 1 << slabBits;
+	static const unsigned slabCount = 1 << (indexBits - slabBits);
+	static const Handle indexMask = (1 << indexBits) - 1;
+	static const uint32_t generationMask = (1 << (32 - indexBits)) - 1;
+	
+	struct Slot {
+		uint32_t generation;			// current generation (never 0)
+		ClientHandleObject *object;		// occupant (or NULL)
+	};
+	
+	struct Slab : public Mutex {
+		Slab();
+		Slot slots[slabSize];
+		
+		// occupant of the slot named by handle, if handle is current (call with lock held)
+		ClientHandleObject *occupant(Handle handle) const
+		{
+			const Slot &slot = slots[handle & (slabSize - 1)];
+			return (slot.generation == handle >> indexBits) ? slot.object : NULL;
+		}
+	};
+	
+	class Table : public Mutex {
+	public:
+		Table();
+		Handle allocate(ClientHandleObject *object);
+		void release(Handle handle);
+		Slab *slab(unsigned index) const	{ return mSlabs[index]; }
+		
+		// readers without our lock may use slabs below this count (see allocate)
+		unsigned slabsUsed() const
+		{ unsigned used = mSlabsUsed; __sync_synchronize(); return used; }
+		
+	private:
+		Slab *mSlabs[slabCount];		// allocated on demand, never freed
+		volatile unsigned mSlabsUsed;	// allocated slabs (published after mSlabs)
+		std::deque<Handle> mFree;		// vacated slots, oldest first
+	};
+	static ModuleNexus<Table> table;
+	
+	static Slab &slabFor(Handle handle, CSSM_RETURN error);
+
+	const Handle mHandle;
+};
+
+
+template <class Subtype>
+void ClientHandleObject::findAllRefs(std::vector<Handle> &handles)
+{
+	Table &tab = table();
+	for (unsigned n = 0; n < tab.slabsUsed(); n++) {
+		Slab &slab = *tab.slab(n);
+		StLock<Mutex> _(slab);
+		for (unsigned i = 0; i < slabSize; i++)
+			if (dynamic_cast<Subtype *>(slab.slots[i].object))
+				handles.push_back(slab.slots[i].generation << indexBits | (n << slabBits | i));
+	}
+}
+
+
+#endif //_H_HANDLES
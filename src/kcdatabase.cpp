@@ -43,6 +43,7 @@
 #include "server.h"
 #include "session.h"
 #include "notifications.h"
+#include "securearena.h"
 #include <vector>           // @@@  4003540 workaround
 #include <security_agent_client/agentclient.h>
 #include <security_cdsa_utilities/acl_any.h>	// for default owner ACLs
@@ -62,7 +63,8 @@ void unflattenKey(const CssmData &flatKey, CssmKey &rawKey);	//>> make static me
 //
 KeychainDatabase::KeychainDatabase(const DLDbIdentifier &id, const DBParameters &params, Process &proc,
             const AccessCredentials *cred, const AclEntryPrototype *owner)
-    : LocalDatabase(proc), mValidData(false), version(0), mBlob(NULL)
+    : LocalDatabase(proc), mValidData(false), version(0), mBlob(NULL),
+	  mAclVersion(0), mBlobSecrets(0), mBlobAcl(0)
 {
     // save a copy of the credentials for later access control
     mCred = DataWalkers::copy(cred, Allocator::standard());
@@ -111,7 +113,8 @@ KeychainDatabase::KeychainDatabase(const DLDbIdentifier &id, const DBParameters
 //
 KeychainDatabase::KeychainDatabase(const DLDbIdentifier &id, const DbBlob *blob, Process &proc,
     const AccessCredentials *cred)
-	: LocalDatabase(proc), mValidData(false), version(0)
+	: LocalDatabase(proc), mValidData(false), version(0),
+	  mAclVersion(0), mBlobSecrets(0), mBlobAcl(0)
 {
 	validateBlob(blob);
 
@@ -150,7 +153,8 @@ KeychainDatabase::KeychainDatabase(const DLDbIdentifier &id, const DbBlob *blob,
 // the re-encoding can declare it done.  
 //
 KeychainDatabase::KeychainDatabase(KeychainDatabase &src, Process &proc, DbHandle dbToClone)
-	: LocalDatabase(proc), mValidData(false), version(0), mBlob(NULL)
+	: LocalDatabase(proc), mValidData(false), version(0), mBlob(NULL),
+	  mAclVersion(0), mBlobSecrets(0), mBlobAcl(0)
 {
 	mCred = DataWalkers::copy(src.mCred, Allocator::standard());
 
@@ -211,6 +215,7 @@ KeychainDatabase::~KeychainDatabase()
         common().dbName(), this, &common());
     Allocator::standard().free(mCred);
 	Allocator::standard().free(mBlob);
+	SecureArena::shared().free(mBlobPrivateAcl.data());
 }
 
 
@@ -323,6 +328,8 @@ void KeychainDatabase::encode()
 	Allocator::standard().free(mBlob);
 	mBlob = blob;
 	version = common().version;
+	mBlobSecrets = common().secretsGeneration();
+	mBlobAcl = mAclVersion;
 	secdebug("KCdb", "encoded database %p common %p(%s) version %u params=(%u,%u)",
 		this, &common(), dbName(), version,
 		common().mParams.idleTimeout, common().mParams.lockOnSleep);
@@ -377,21 +384,56 @@ void KeychainDatabase::commitSecretsForSync(KeychainDatabase &cloneDb)
     // items until after this call.  
     // 
 	// @@@  This specific implementation is a workaround for 4003540.  
-	std::vector<U32HandleObject::Handle> handleList;
-	U32HandleObject::findAllRefs<KeychainKey>(handleList);
-    size_t count = handleList.size();
-	if (count > 0) {
-        for (unsigned int n = 0; n < count; ++n) {
-            RefPointer<KeychainKey> kckey = 
-                U32HandleObject::findRefAndLock<KeychainKey>(handleList[n], CSSMERR_CSP_INVALID_KEY_REFERENCE);
-            StLock<Mutex> _(*kckey/*, true*/);
-            if (kckey->database().global().identifier() == identifier()) {
-                kckey->key();               // force decode
-                kckey->invalidateBlob();
-				secdebug("kcrecode", "changed extant key %p (proc %d)",
-						 &*kckey, kckey->process().pid());
-            }
-        }
+	std::vector<ClientHandleObject::Handle> handleList;
+	ClientHandleObject::findAllRefs<KeychainKey>(handleList);
+	std::vector<RefPointer<KeychainKey> > keys;
+	for (unsigned int n = 0; n < handleList.size(); ++n) {
+		RefPointer<KeychainKey> kckey = 
+			ClientHandleObject::findRef<KeychainKey>(handleList[n], CSSMERR_CSP_INVALID_KEY_REFERENCE);
+		if (kckey->database().global().identifier() == identifier())
+			keys.push_back(kckey);
+	}
+	
+	// Decode those of our common in parallel first, as the KeyPrefetcher would,
+	// with a snapshot of its secrets (we hold its lock, the jobs don't). That
+	// leaves out keys of other sessions' commons (and any that fail to decode);
+	// the loop below deals with those as before.
+	struct Decode : public WorkPool::Job {
+		KeychainKey *key;
+		KeychainDbCommon *common;
+		const SecretsSnapshot *secrets;
+		void operator () ()
+		{
+			try {
+				key->prefetch(*common, *secrets, common->lockEpoch());
+			} catch (...) {
+				// (left to the loop below)
+			}
+		}
+	};
+	RefPointer<SecretsSnapshot> secrets = new SecretsSnapshot(common());
+	std::vector<Decode> decodes;
+	for (size_t n = 0; n < keys.size(); n++)
+		if (&keys[n]->database().common() == &common()) {
+			Decode decode;
+			decode.key = keys[n].get();
+			decode.common = &common();
+			decode.secrets = secrets.get();
+			decodes.push_back(decode);
+		}
+	std::vector<WorkPool::Job *> jobs(decodes.size());
+	for (size_t n = 0; n < decodes.size(); n++)
+		jobs[n] = &decodes[n];
+	if (!jobs.empty())
+		Server::workPool().run(&jobs[0], jobs.size());
+	
+	for (size_t n = 0; n < keys.size(); n++) {
+		RefPointer<KeychainKey> &kckey = keys[n];
+		StLock<Mutex> _(*kckey/*, true*/);
+		kckey->key();               // force decode (if still needed)
+		kckey->invalidateBlob();
+		secdebug("kcrecode", "changed extant key %p (proc %d)",
+				 &*kckey, kckey->process().pid());
 	}
 
     // it is now safe to replace the old op secrets
@@ -487,6 +529,81 @@ void KeychainDatabase::makeUnlocked(const CssmData &passphrase)
 	assert(mValidData);
 }
 
+void KeychainDatabase::makeUnlocked(const CssmClient::Key &master)
+{
+	if (isLocked()) {
+		if (!decode(master))
+			CssmError::throwMe(CSSM_ERRCODE_OPERATION_AUTH_DENIED);
+	} else if (!mValidData)	{
+		if (!decode())
+			CssmError::throwMe(CSSM_ERRCODE_OPERATION_AUTH_DENIED);
+	}
+	assert(!isLocked());
+	assert(mValidData);
+}
+
+
+//
+// Try one passphrase against a list of databases, and unlock the first one (in
+// order) it fits. Return its index, or -1 if there's none. If asked, report for
+// each database whether the passphrase fits it (CSSM_OK) or why not.
+// The passphrase is tried on copies of all the blobs at once, in parallel and
+// without holding any database lock (DatabaseCryptoCore::tryPassphrase). Only
+// then do we take the lock of the first database it fits, and unlock it.
+//
+namespace {
+	struct BlobCopies : public vector<const DbBlob *> {
+		~BlobCopies()
+		{
+			for (const_iterator it = begin(); it != end(); it++)
+				Allocator::standard().free((void *)*it);
+		}
+	};
+}
+
+int KeychainDatabase::unlockAny(const CssmData &passphrase,
+	const std::vector<RefPointer<KeychainDatabase> > &dbs, std::vector<CSSM_RETURN> *results)
+{
+	size_t count = dbs.size();
+	vector<CSSM_RETURN> outcome(count, CSSMERR_APPLEDL_INVALID_DATABASE_BLOB);
+	BlobCopies blobs;
+	vector<size_t> tried;		// index into dbs of each blob copy
+	for (size_t n = 0; n < count; n++) {
+		StLock<Mutex> _(dbs[n]->common());
+		if (dbs[n]->mBlob) {
+			blobs.push_back(dbs[n]->mBlob->copy());
+			tried.push_back(n);
+		}
+	}
+	vector<CssmClient::Key> masters(blobs.size());
+	vector<CSSM_RETURN> trials(blobs.size());
+	if (!blobs.empty())
+		DatabaseCryptoCore::tryPassphrase(passphrase, &blobs[0], blobs.size(), &masters[0], &trials[0]);
+	for (size_t t = 0; t < tried.size(); t++)
+		outcome[tried[t]] = trials[t];
+
+	int unlocked = -1;
+	for (size_t t = 0; t < tried.size() && unlocked < 0; t++) {
+		if (trials[t] != CSSM_OK)
+			continue;
+		size_t n = tried[t];
+		try {
+			StLock<Mutex> _(dbs[n]->common());
+			// the salt may have changed (recoded) while we weren't holding the lock
+			if (memcmp(blobs[t]->salt, dbs[n]->mBlob->salt, DatabaseCryptoCore::saltSize))
+				dbs[n]->makeUnlocked(passphrase);
+			else
+				dbs[n]->makeUnlocked(masters[t]);
+			unlocked = n;
+		} catch (const CommonError &err) {
+			outcome[n] = CssmError::cssmError(err, CSSM_DL_BASE_ERROR);	// not this one after all
+		}
+	}
+	if (results)
+		results->swap(outcome);
+	return unlocked;
+}
+
 
 //
 // Nonthrowing passphrase-based unlock. This returns false if unlock failed.
@@ -496,7 +613,27 @@ void KeychainDatabase::makeUnlocked(const CssmData &passphrase)
 bool KeychainDatabase::decode(const CssmData &passphrase)
 {
 	assert(mBlob);
-	common().setup(mBlob, passphrase);
+	CssmClient::Key master;
+	DatabaseCryptoCore::deriveDbMasterKeys(passphrase, mBlob->salt, 1, &master);
+	return decode(master);
+}
+
+
+//
+// Nonthrowing unlock with a master key the caller derived from our blob's salt.
+// Where the blob carries a key-check value (sealed blobs, written with -G), a wrong
+// key is turned away right here, before it replaces the common's master secret or
+// anything gets decrypted.
+// Caller must hold common lock.
+//
+bool KeychainDatabase::decode(const CssmClient::Key &master)
+{
+	assert(mBlob);
+	if (DatabaseCryptoCore::checkMasterKey(mBlob, master) == DatabaseCryptoCore::keyCheckMismatch) {
+		secdebug("KCdb", "%p master key check failed", this);
+		return false;
+	}
+	common().setup(mBlob, master);
 	return decode();
 }
 
@@ -517,7 +654,8 @@ bool KeychainDatabase::decode()
 			acl().importBlob(mBlob->publicAclBlob(), privateAclBlob);
 			mValidData = true;
 		}
-		Allocator::standard().free(privateAclBlob);
+		SecureArena::shared().free(privateAclBlob);
+		Server::keyPrefetcher().prefetch(*this);	// (if enabled)
 		return true;
 	}
 	secdebug("KCdb", "%p decode failed", this);
@@ -831,7 +969,9 @@ void unflattenKey(const CssmData &flatKey, CssmKey &rawKey)
 //
 // Verify a putative database passphrase.
 // If the database is already unlocked, just check the passphrase.
-// Otherwise, unlock with that passphrase and report success.
+// Otherwise, check it against the blob's key-check value if there is one,
+// or unlock with that passphrase (on the side) and report success.
+// Either way, the passphrase is derived only once.
 // Caller must hold the common lock.
 //
 bool KeychainDatabase::validatePassphrase(const CssmData &passphrase) const
@@ -842,8 +982,18 @@ bool KeychainDatabase::validatePassphrase(const CssmData &passphrase) const
 	} else {
 		// no master secret - perform "blind" unlock to avoid actual unlock
 		try {
+			CssmClient::Key master;
+			DatabaseCryptoCore::deriveDbMasterKeys(passphrase, mBlob->salt, 1, &master);
+			switch (DatabaseCryptoCore::checkMasterKey(mBlob, master)) {
+			case DatabaseCryptoCore::keyCheckMatch:
+				return true;
+			case DatabaseCryptoCore::keyCheckMismatch:
+				return false;
+			default:
+				break;
+			}
 			DatabaseCryptoCore test;
-			test.setup(mBlob, passphrase);
+			test.setup(mBlob, master);
 			test.decodeCore(mBlob, NULL);
 			return true;
 		} catch (...) {
@@ -893,7 +1043,7 @@ void KeychainDatabase::decodeKey(KeyBlob *blob, CssmKey &key, void * &pubAcl, vo
 		unlockDb();							// we need our keys
 
 	common().decodeKeyCore(blob, key, pubAcl, privAcl);
-	// memory protocol: pubAcl points into blob; privAcl was allocated
+	// memory protocol: pubAcl points into blob; privAcl is in the SecureArena
 	
     activity();
 }
@@ -921,13 +1071,90 @@ KeyBlob *KeychainDatabase::recodeKey(KeychainKey &oldKey)
 		/* careful....*/
 		inTheClear = true;
 	}
-	KeyBlob *blob = common().encodeKeyCore(oldKey.cssmKey(), publicAcl, privateAcl, inTheClear);
+	CssmClient::Key cspKey = oldKey.key();	// (held in case oldKey is evicted meanwhile)
+	KeyBlob *blob = common().encodeKeyCore(static_cast<const CssmKey &>(*cspKey),
+		publicAcl, privateAcl, inTheClear);
 	oldKey.acl().allocator.free(publicAcl);
 	oldKey.acl().allocator.free(privateAcl);
 	return blob;
 }
 
 
+//
+// Batched recode for keychain synchronization: take a number of key blobs of our
+// recoding source, and encode each anew with our operational secrets, in parallel
+// on the server's WorkPool. results[n] says how each one fared; where that's
+// CSSM_OK, newBlobs[n] holds the new blob, which belongs to the caller.
+// The blobs are recoded as they are - key and ACL blobs, as decoded, go straight
+// into the new blob - so no key objects or ACLs are made for them.
+// Both keychains' (common) locks are held throughout, so neither can lock, or
+// change its secrets, while the jobs use them without taking any lock. The
+// blobs are converted in place (by decodeKeyCore).
+// (No IPC reaches this yet; the recodeKeys request comes with its ucsp.defs
+// routine and ClientSession call.)
+//
+void KeychainDatabase::recodeKeys(KeychainDatabase &source, KeyBlob **blobs, size_t count,
+	KeyBlob **newBlobs, CSSM_RETURN *results)
+{
+	if (mRecodingSource != &source)
+		CssmError::throwMe(CSSMERR_CSP_INVALID_KEY);
+	StLock<Mutex> _(source.common());	// (same order as commitSecretsForSync)
+	StLock<Mutex> __(common());
+	
+	struct Recode : public WorkPool::Job {
+		const DatabaseCryptoCore *from, *to;
+		KeyBlob *blob;
+		KeyBlob **newBlob;
+		CSSM_RETURN *result;
+		
+		static bool inTheClear(const KeyBlob *blob)
+		{ return blob->version() != DatabaseCryptoCore::version_AES_GCM && blob->isClearText(); }
+		
+		void operator () ()
+		{
+			void *privateAcl = NULL;
+			try {
+				bool clear = inTheClear(blob);
+				CssmKey key;
+				void *publicAcl;
+				size_t privateAclLength;
+				from->decodeKeyCore(blob, key, publicAcl, privateAcl, &privateAclLength);
+				CssmClient::Key decoded(Server::csp(), key);
+				*newBlob = to->encodeKeyCore(*decoded,
+					CssmData(publicAcl, blob->publicAclBlobLength()),
+					CssmData(privateAcl, privateAclLength), clear);
+				*result = CSSM_OK;
+			} catch (const CommonError &err) {
+				*result = CssmError::cssmError(err, CSSM_CSP_BASE_ERROR);
+			}
+			SecureArena::shared().free(privateAcl);
+		}
+	};
+	std::vector<Recode> recodes(count);
+	std::vector<WorkPool::Job *> jobs(count);
+	bool needSecrets = false;
+	for (size_t n = 0; n < count; n++) {
+		recodes[n].from = &source.common();
+		recodes[n].to = &common();
+		recodes[n].blob = blobs[n];
+		recodes[n].newBlob = &newBlobs[n];
+		recodes[n].result = &results[n];
+		newBlobs[n] = NULL;
+		results[n] = CSSM_ERRCODE_INTERNAL_ERROR;
+		jobs[n] = &recodes[n];
+		if (!Recode::inTheClear(blobs[n]))
+			needSecrets = true;
+	}
+	if (needSecrets) {
+		source.unlockDb();		// in case we autolocked since starting the sync
+		unlockDb();
+	}
+	if (count)
+		Server::workPool().run(&jobs[0], count);
+	activity();
+}
+
+
 //
 // Modify database parameters
 //
@@ -978,6 +1205,7 @@ void KeychainDatabase::changedAcl()
 {
 	StLock<Mutex> _(common());
 	version = 0;
+	mAclVersion++;
 }
 
 
@@ -995,6 +1223,7 @@ void KeychainDatabase::validateBlob(const DbBlob *blob)
 			break;
 #endif
 		case DbBlob::version_MacOS_10_1:
+		case DatabaseCryptoCore::version_AES_GCM:
 			break;
 		default:
 			CssmError::throwMe(CSSMERR_APPLEDL_INCOMPATIBLE_DATABASE_BLOB);
@@ -1043,7 +1272,7 @@ void KeychainDatabase::dumpNode()
 //
 KeychainDbCommon::KeychainDbCommon(Session &ssn, const DbIdentifier &id)
 	: LocalDbCommon(ssn), sequence(0), version(1), mIdentifier(id),
-      mIsLocked(true), mValidParams(false)
+      mIsLocked(true), mValidParams(false), mLockEpoch(0)
 {
     // match existing DbGlobal or create a new one
 	Server &server = Server::active();
@@ -1149,6 +1378,8 @@ void KeychainDbCommon::lockDb()
 {
     StLock<Mutex> _(*this);
     if (!isLocked()) {
+		mLockEpoch++;			// stop any background key decoding
+		Server::keyPrefetcher().cancel(*this);
 		DatabaseCryptoCore::invalidate();
         notify(kNotificationEventLocked);
 		SECURITYD_KEYCHAIN_LOCK(this, (char*)this->dbName());
@@ -1162,15 +1393,17 @@ void KeychainDbCommon::lockDb()
 }
 
 
+//
+// Encode a database's blob. Where db already has a blob we encoded with the
+// same secrets, we only redo what changed: if the ACL hasn't changed either, we
+// don't even export it, and take both ACL sections as they were; if only its
+// public half changed, the encrypted section still stands (see reencodeCore).
+// Caller must hold our lock, and update db's record of what its blob holds.
+//
 DbBlob *KeychainDbCommon::encode(KeychainDatabase &db)
 {
     assert(!isLocked());	// must have been unlocked by caller
     
-    // export database ACL to blob form
-    CssmData pubAcl, privAcl;
-    db.acl().exportBlob(pubAcl, privAcl);
-    
-    // tell the cryptocore to form the blob
     DbBlob form;
     form.randomSignature = identifier();
     form.sequence = sequence;
@@ -1178,7 +1411,28 @@ DbBlob *KeychainDbCommon::encode(KeychainDatabase &db)
 	h2ni(form.params.idleTimeout);
 	
 	assert(hasMaster());
-    DbBlob *blob = encodeCore(form, pubAcl, privAcl);
+	bool sameSecrets = db.mBlob && db.mBlobSecrets == secretsGeneration();
+	if (sameSecrets && db.mBlobAcl == db.mAclVersion) {
+		CssmData pubAcl = CssmData::wrap(db.mBlob->publicAclBlob(), db.mBlob->publicAclBlobLength());
+		return reencodeCore(db.mBlob, form, pubAcl, db.mBlobPrivateAcl);
+	}
+	
+    // export database ACL to blob form
+    CssmData pubAcl, privAcl;
+    db.acl().exportBlob(pubAcl, privAcl);
+    
+    // tell the cryptocore to form the blob
+	DbBlob *blob;
+	if (sameSecrets && privAcl.length() == db.mBlobPrivateAcl.length()
+			&& !memcmp(privAcl.data(), db.mBlobPrivateAcl.data(), privAcl.length()))
+		blob = reencodeCore(db.mBlob, form, pubAcl, privAcl);
+	else
+		blob = encodeCore(form, pubAcl, privAcl);
+	
+	// remember the private ACL that went into it
+	SecureArena::shared().free(db.mBlobPrivateAcl.data());
+	db.mBlobPrivateAcl = CssmData(SecureArena::shared().malloc(privAcl.length()), privAcl.length());
+	memcpy(db.mBlobPrivateAcl.data(), privAcl.data(), privAcl.length());
     
     // clean up and go
     db.acl().allocator.free(pubAcl);
@@ -101,6 +101,7 @@ public:
 	bool unlockDb(DbBlob *blob, void **privateAclBlob = NULL);
 	void lockDb();				// make locked (if currently unlocked)
 	bool isLocked()			{ return mIsLocked; } // lock status
+	uint32 lockEpoch() const { return mLockEpoch; } // counts lockDb() events
 	void setUnlocked();
 	void invalidateBlob()	{ version++; }
 	
@@ -144,6 +145,7 @@ private:
 	// all following data protected by object lock
 	bool mIsLocked;				// logically locked
 	bool mValidParams;			// mParams has been set
+	volatile uint32 mLockEpoch;	// bumped by lockDb() (may be read without lock)
 };
 
 
@@ -190,9 +192,13 @@ public:
 	void lockDb();											// unconditional lock
 	void unlockDb();										// full-feature unlock
 	void unlockDb(const CssmData &passphrase);				// unlock with passphrase
+	static int unlockAny(const CssmData &passphrase,		// first of dbs passphrase unlocks
+		const std::vector<RefPointer<KeychainDatabase> > &dbs,
+		std::vector<CSSM_RETURN> *results = NULL);			// (and how it fared with each)
 
 	bool decode();											// unlock given established master key
 	bool decode(const CssmData &passphrase);				// set master key from PP, try unlock
+	bool decode(const CssmClient::Key &master);				// set derived master key, try unlock
 
 	bool validatePassphrase(const CssmData &passphrase) const; // nonthrowing validation
 	bool isLocked()			{ return common().isLocked(); }	// lock status
@@ -203,6 +209,8 @@ public:
     void decodeKey(KeyBlob *blob, CssmKey &key, void * &pubAcl, void * &privAcl);
 	KeyBlob *encodeKey(const CssmKey &key, const CssmData &pubAcl, const CssmData &privAcl);
 	KeyBlob *recodeKey(KeychainKey &oldKey);	
+	void recodeKeys(KeychainDatabase &source, KeyBlob **blobs, size_t count,
+		KeyBlob **newBlobs, CSSM_RETURN *results);
     bool validBlob() const	{ return mBlob && version == common().version; }
 
 	// manage database parameters
@@ -232,6 +240,7 @@ protected:
 	void makeUnlocked();							// interior version of unlock()
 	void makeUnlocked(const AccessCredentials *cred); // like () with explicit cred
 	void makeUnlocked(const CssmData &passphrase);	// interior version of unlock(CssmData)
+	void makeUnlocked(const CssmClient::Key &master); // like (CssmData) with the derived master key
 	
 	void establishOldSecrets(const AccessCredentials *creds);
 	void establishNewSecrets(const AccessCredentials *creds, SecurityAgent::Reason reason);
@@ -248,6 +257,12 @@ private:
         
     uint32 version;					// version stamp for blob validity
     DbBlob *mBlob;					// database blob (encoded)
+	uint32 mAclVersion;				// bumped by changedAcl
+	
+	// what mBlob was encoded from, so encode() can reuse its unchanged parts
+	unsigned mBlobSecrets;			// common's secrets generation (0 if not encoded here)
+	uint32 mBlobAcl;				// mAclVersion
+	CssmData mBlobPrivateAcl;		// private ACL blob (in the SecureArena)
     
     AccessCredentials *mCred;		// local access credentials (always valid)
 	
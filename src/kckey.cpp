@@ -28,6 +28,9 @@
 #include "kckey.h"
 #include "server.h"
 #include "database.h"
+#include "kcdatabase.h"
+#include "securearena.h"
+#include "residentkeys.h"
 #include <security_cdsa_utilities/acl_any.h>
 #include <security_cdsa_utilities/cssmendian.h>
 
@@ -37,7 +40,7 @@
 // Note that this doesn't decode the blob (yet).
 //
 KeychainKey::KeychainKey(Database &db, const KeyBlob *blob)
-	: LocalKey(db, n2h(blob->header.attributes()))
+	: LocalKey(db, n2h(blob->header.attributes())), mUsed(false), mEvicted(false)
 {
     // perform basic validation on the incoming blob
 	assert(blob);
@@ -48,6 +51,7 @@ KeychainKey::KeychainKey(Database &db, const KeyBlob *blob)
         break;
 #endif
     case KeyBlob::version_MacOS_10_1:
+    case DatabaseCryptoCore::version_AES_GCM:
         break;
     default:
         CssmError::throwMe(CSSMERR_APPLEDL_INCOMPATIBLE_KEY_BLOB);
@@ -67,18 +71,20 @@ KeychainKey::KeychainKey(Database &db, const KeyBlob *blob)
 //
 KeychainKey::KeychainKey(Database &db, const CssmKey &newKey, uint32 moreAttributes,
 	const AclEntryPrototype *owner)
-	: LocalKey(db, newKey, moreAttributes)
+	: LocalKey(db, newKey, moreAttributes), mUsed(false), mEvicted(false)
 {
 	assert(moreAttributes & CSSM_KEYATTR_PERMANENT);
 	setOwner(owner);
     mBlob = NULL;
 	mValidBlob = false;
 	db.addReference(*this);
+	ResidentKeys::shared().decoded(*this, mKey, db.session().sessionId(), false);
 }
 
 
 KeychainKey::~KeychainKey()
 {
+	ResidentKeys::shared().forget(*this);	// first, so eviction can't find us half-destroyed
     Allocator::standard().free(mBlob);
     secdebug("SSkey", "%p destroyed", this);
 }
@@ -121,19 +127,113 @@ void KeychainKey::decode()
         void *publicAcl, *privateAcl;
 		CssmKey key;
         database().decodeKey(mBlob, key, publicAcl, privateAcl);
-		mKey = CssmClient::Key(Server::csp(), key);
-        acl().importBlob(publicAcl, privateAcl);
-        // publicAcl points into the blob; privateAcl was allocated for us
-        Allocator::standard().free(privateAcl);
-        
-        // extract managed attribute bits
-        mAttributes = mKey.header().attributes() & managedAttributes;
-        mKey.header().clearAttribute(managedAttributes);
-		mKey.header().setAttribute(forcedAttributes);
+		decoded(key, publicAcl, privateAcl);
+	}
+}
+
+//
+// Install the results of decoding our blob.
+// Caller must hold the key object lock.
+//
+void KeychainKey::decoded(const CssmKey &key, void *publicAcl, void *privateAcl)
+{
+	mKey = CssmClient::Key(Server::csp(), key);
+	acl().importBlob(publicAcl, privateAcl);
+	// publicAcl points into the blob; privateAcl is ours, in the SecureArena
+	SecureArena::shared().free(privateAcl);
+	
+	// extract managed attribute bits
+	mAttributes = mKey.header().attributes() & managedAttributes;
+	mKey.header().clearAttribute(managedAttributes);
+	mKey.header().setAttribute(forcedAttributes);
+
+	// key is valid now
+	mValidKey = true;
+	ResidentKeys::shared().decoded(*this, mKey, database().session().sessionId(), mEvicted);
+	mEvicted = false;
+}
+
+
+//
+// Residency management (see ResidentKeys).
+// Marking use is a plain store; the CLOCK sweep tolerates a lost update.
+//
+void KeychainKey::used()
+{
+	mUsed = true;
+}
+
+bool KeychainKey::usedSinceLastLook()
+{
+	bool used = mUsed;
+	mUsed = false;
+	return used;
+}
 
-        // key is valid now
-		mValidKey = true;
+//
+// Called by ResidentKeys with its lock held; we only try for our own lock.
+// Only a key that can be decoded again from a valid blob is evicted. Dropping
+// mKey releases its CSP key unless a request (or stream) still holds a reference.
+//
+bool KeychainKey::evict()
+{
+	if (!tryLock())
+		return false;
+	bool evicted = mValidKey && mValidBlob;
+	if (evicted) {
+		mKey = CssmClient::Key();
+		mValidKey = false;
+		mEvicted = true;
+		secdebug("SSkey", "%p evicted", this);
+	}
+	unlock();
+	return evicted;
+}
+
+
+//
+// Background decoding for the KeyPrefetcher.
+// Unlike decode(), this never unlocks the keychain, and it doesn't take the
+// keychain's (common) lock, so many keys of one keychain can be decoded at
+// once. Instead, it decodes with a SecretsSnapshot that the caller took under
+// that lock; a concurrent lockDb() then can't release the keys we're using.
+// We still check that the keychain was not locked (and perhaps unlocked again)
+// before and after, so we don't install a key the keychain no longer vouches for.
+// Returns true if the key was decoded by this call.
+//
+bool KeychainKey::needsDecode()
+{
+	StLock<Mutex> _(*this);
+	return !mValidKey && mValidBlob;
+}
+
+bool KeychainKey::prefetch(KeychainDbCommon &common, const SecretsSnapshot &secrets, uint32 epoch)
+{
+	StLock<Mutex> _(*this);
+	if (mValidKey || !mValidBlob)
+		return false;		// someone beat us to it
+	if (common.lockEpoch() != epoch || common.isLocked())
+		return false;		// locked since we were queued
+	
+	// decodeKeyCore converts the blob header in place; undo that if we back out
+	CssmKey::Header header = mBlob->header;
+	void *publicAcl, *privateAcl;
+	CssmKey key;
+	try {
+		secrets.decodeKeyCore(mBlob, key, publicAcl, privateAcl);
+	} catch (...) {
+		mBlob->header = header;
+		throw;
+	}
+	if (common.lockEpoch() != epoch) {
+		// locked while we were decoding; don't keep the result
+		mBlob->header = header;
+		CssmClient::Key discard(Server::csp(), key);
+		SecureArena::shared().free(privateAcl);
+		return false;
 	}
+	decoded(key, publicAcl, privateAcl);
+	return true;
 }
 
 
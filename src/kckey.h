@@ -34,6 +34,8 @@
 
 
 class KeychainDatabase;
+class KeychainDbCommon;
+class SecretsSnapshot;
 
 
 //
@@ -61,6 +63,10 @@ public:
 	KeyBlob *blob();
 	
 	void invalidateBlob();
+	
+	// background decoding (see KeyPrefetcher)
+	bool needsDecode();
+	bool prefetch(KeychainDbCommon &common, const SecretsSnapshot &secrets, uint32 epoch);
     
     // ACL state management hooks
 	void instantiateAcl();
@@ -76,14 +82,24 @@ public:
 	
 private:
     void decode();
+	void decoded(const CssmKey &key, void *publicAcl, void *privateAcl);
 	void getKey();
 	virtual void getHeader(CssmKey::Header &hdr); // get header (only) without mKey
+	void used();
+	
+	// for ResidentKeys
+	friend class ResidentKeys;
+	bool usedSinceLastLook();	// (and clear the mark)
+	bool evict();				// drop mKey, back to the encoded state (if we can)
 
 private:
 	CssmKey::Header mHeaderCache; // cached, cleaned blob header cache
 
 	KeyBlob *mBlob;			// key blob encoded by mDatabase
 	bool mValidBlob;		// mBlob is valid key encoding
+	
+	volatile bool mUsed;	// mKey handed out since ResidentKeys last looked
+	bool mEvicted;			// mKey was evicted (and not decoded since)
 };
 
 
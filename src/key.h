@@ -73,7 +73,7 @@ public:
 	virtual CSSM_KEYATTR_FLAGS attributes() = 0;
 	bool attribute(CSSM_KEYATTR_FLAGS f) { return attributes() & f; }
 	
-	virtual void returnKey(U32HandleObject::Handle &h, CssmKey::Header &hdr) = 0;
+	virtual void returnKey(ClientHandleObject::Handle &h, CssmKey::Header &hdr) = 0;
 };
 
 
@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// keypairpool - background pre-generation of key pairs
+//
+#include "keypairpool.h"
+#include "securearena.h"
+#include "server.h"
+#include <security_cdsa_client/genkey.h>
+#include <security_cdsa_client/wrapkey.h>
+#include <security_utilities/logging.h>
+#include <security_utilities/debugging.h>
+#include <mach/mach.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const unsigned maxDepth = 64;		// per shelf
+static const unsigned errorDelay = 60;		// seconds to wait after a failed generation
+
+static const struct {
+	const char *name;
+	CSSM_ALGORITHMS algorithm;
+} algorithms[] = {
+	{ "rsa", CSSM_ALGID_RSA },
+	{ "ecdsa", CSSM_ALGID_ECDSA },
+};
+static const unsigned algorithmCount = sizeof(algorithms) / sizeof(algorithms[0]);
+
+static const char *algorithmName(CSSM_ALGORITHMS algorithm)
+{
+	for (unsigned n = 0; n < algorithmCount; n++)
+		if (algorithms[n].algorithm == algorithm)
+			return algorithms[n].name;
+	return "?";
+}
+
+
+//
+// CPU time used by the calling thread, in seconds
+//
+static double threadCPUSeconds()
+{
+	thread_basic_info_data_t info;
+	mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+	mach_port_t self = mach_thread_self();
+	kern_return_t rc = thread_info(self, THREAD_BASIC_INFO, (thread_info_t)&info, &count);
+	mach_port_deallocate(mach_task_self(), self);
+	if (rc != KERN_SUCCESS)
+		return 0;
+	return info.user_time.seconds + info.system_time.seconds
+		+ (info.user_time.microseconds + info.system_time.microseconds) / 1E6;
+}
+
+
+KeyPairPool::KeyPairPool(Server &server)
+	: mServer(server), mBudget(defaultBudget), mTaken(*this), mStarted(false), mUnpooled(0)
+{
+}
+
+KeyPairPool::~KeyPairPool()
+{
+	for (std::vector<Shelf>::iterator shelf = mShelves.begin(); shelf != mShelves.end(); shelf++)
+		for (std::deque<Pair>::iterator pair = shelf->pairs.begin(); pair != shelf->pairs.end(); pair++)
+			release(*pair);
+}
+
+
+//
+// Parse a pool specification: comma-separated algorithm:bits:depth entries,
+// plus optionally cpu=percent for the refill budget.
+// Returns false (and changes nothing) if the specification is bad.
+//
+bool KeyPairPool::configure(const char *spec)
+{
+	assert(!mStarted);
+	std::vector<Shelf> shelves;
+	unsigned budget = mBudget;
+	std::vector<char> buffer(spec, spec + strlen(spec) + 1);
+	char *state;
+	for (char *item = strtok_r(&buffer[0], ",", &state); item; item = strtok_r(NULL, ",", &state)) {
+		if (!strncmp(item, "cpu=", 4)) {
+			budget = atoi(item + 4);
+			if (budget < 1 || budget > 100)
+				return false;
+			continue;
+		}
+		char name[16];
+		unsigned bits, depth;
+		if (sscanf(item, "%15[a-z]:%u:%u", name, &bits, &depth) != 3 || depth < 1 || depth > maxDepth)
+			return false;
+		Shelf shelf;
+		shelf.algorithm = CSSM_ALGID_NONE;
+		for (unsigned n = 0; n < algorithmCount; n++)
+			if (!strcmp(name, algorithms[n].name))
+				shelf.algorithm = algorithms[n].algorithm;
+		if (shelf.algorithm == CSSM_ALGID_NONE)
+			return false;
+		shelf.bits = bits;
+		shelf.depth = depth;
+		shelf.hits = shelf.empty = shelf.generated = 0;
+		shelf.cpuSeconds = 0;
+		shelves.push_back(shelf);
+	}
+	mShelves.swap(shelves);
+	mBudget = budget;
+	return true;
+}
+
+
+//
+// Start the filler thread. The pool's shelves are fixed from here on.
+//
+void KeyPairPool::start()
+{
+	StLock<Mutex> _(*this);
+	if (mStarted || mShelves.empty())
+		return;
+	mStarted = true;
+	(new Filler(*this))->run();
+	secdebug("keypool", "filling %ld shelves at %u%% CPU", mShelves.size(), mBudget);
+}
+
+
+//
+// Find the shelf for a key pair generation context. Only the algorithm and
+// key size may be specified; anything else (an RSA public exponent, DSA or EC
+// parameters...) makes the request unpoolable.
+//
+KeyPairPool::Shelf *KeyPairPool::shelfFor(const Context &context)
+{
+	if (context.type() != CSSM_ALGCLASS_KEYGEN)
+		return NULL;
+	for (uint32 n = 0; n < context.NumberOfAttributes; n++)
+		switch (context.ContextAttributes[n].AttributeType) {
+		case CSSM_ATTRIBUTE_KEY_LENGTH:
+		case CSSM_ATTRIBUTE_DL_DB_HANDLE:	// (where the client will store it; not our business)
+			break;
+		default:
+			return NULL;
+		}
+	uint32 bits = context.getInt(CSSM_ATTRIBUTE_KEY_LENGTH);
+	for (std::vector<Shelf>::iterator shelf = mShelves.begin(); shelf != mShelves.end(); shelf++)
+		if (shelf->algorithm == context.algorithm() && shelf->bits == bits)
+			return &*shelf;
+	return NULL;
+}
+
+
+//
+// Hand out a pooled pair, if we have one that fits
+//
+bool KeyPairPool::take(const Context &context,
+	const CssmClient::KeySpec &pubSpec, CssmKey &pubKey,
+	const CssmClient::KeySpec &privSpec, CssmKey &privKey)
+{
+	if (!enabled())
+		return false;
+	Pair pair;
+	{
+		StLock<Mutex> _(*this);
+		Shelf *shelf = shelfFor(context);
+		if (!shelf) {
+			mUnpooled++;
+			return false;
+		}
+		if (shelf->pairs.empty()) {
+			shelf->empty++;
+			return false;
+		}
+		pair = shelf->pairs.front();
+		shelf->pairs.pop_front();
+		shelf->hits++;
+		mTaken.signal();
+	}
+	
+	try {
+		install(pair.publicKey, pubSpec, pubKey);
+		try {
+			install(pair.privateKey, privSpec, privKey);
+		} catch (...) {
+			CssmClient::Key discard(Server::csp(), pubKey);
+			throw;
+		}
+	} catch (...) {
+		release(pair);
+		throw;
+	}
+	release(pair);
+	return true;
+}
+
+
+//
+// Bring a raw pooled key into the CSP with the caller's usage and attributes
+//
+void KeyPairPool::install(const CssmKey &raw, const CssmClient::KeySpec &spec, CssmKey &key)
+{
+	CssmKey wrappedKey = raw;
+	wrappedKey.wrapAlgorithm(CSSM_ALGID_NONE);
+	wrappedKey.wrapMode(CSSM_ALGMODE_NONE);
+	CssmClient::UnwrapKey unwrap(Server::csp(), CSSM_ALGID_NONE);
+	CssmData descriptiveData;
+	unwrap(wrappedKey, spec, key, &descriptiveData);
+}
+
+
+//
+// Generate a pair for a shelf, and move its key bits into the SecureArena
+//
+static void secure(CssmKey &key)
+{
+	CssmData &bits = key.keyData();
+	void *secureBits = SecureArena::shared().malloc(bits.length());
+	memcpy(secureBits, bits.data(), bits.length());
+	memset(bits.data(), 0, bits.length());
+	Server::csp()->allocator().free(bits.data());
+	key.KeyData = CssmData(secureBits, bits.length());
+}
+
+void KeyPairPool::generate(Shelf &shelf, Pair &pair)
+{
+	CssmClient::GenerateKey generator(Server::csp(), shelf.algorithm, shelf.bits);
+	CssmClient::KeySpec spec(CSSM_KEYUSE_ANY, CSSM_KEYATTR_RETURN_DATA | CSSM_KEYATTR_EXTRACTABLE);
+	generator(pair.publicKey, spec, pair.privateKey, spec);
+	secure(pair.publicKey);
+	secure(pair.privateKey);
+}
+
+void KeyPairPool::release(Pair &pair)
+{
+	SecureArena::shared().free(pair.publicKey.keyData().data());
+	SecureArena::shared().free(pair.privateKey.keyData().data());
+}
+
+
+//
+// Wait until some shelf is short, and return the one that is emptiest
+// relative to its depth
+//
+KeyPairPool::Shelf *KeyPairPool::nextToFill()
+{
+	StLock<Mutex> _(*this);
+	for (;;) {
+		Shelf *emptiest = NULL;
+		for (std::vector<Shelf>::iterator shelf = mShelves.begin(); shelf != mShelves.end(); shelf++)
+			if (shelf->pairs.size() < shelf->depth && (!emptiest
+					|| shelf->pairs.size() * emptiest->depth < emptiest->pairs.size() * shelf->depth))
+				emptiest = &*shelf;
+		if (emptiest)
+			return emptiest;
+		mTaken.wait();
+	}
+}
+
+
+//
+// The filler thread lives forever. It runs below the priority of request
+// threads, and after each generation sleeps long enough to hold its share
+// of one CPU to the budget.
+//
+void KeyPairPool::Filler::action()
+{
+	mPool.mServer.attachThread();
+	int policy;
+	struct sched_param param;
+	if (!pthread_getschedparam(pthread_self(), &policy, &param)) {
+		param.sched_priority = sched_get_priority_min(policy);
+		pthread_setschedparam(pthread_self(), policy, &param);
+	}
+	
+	for (;;) {
+		Shelf *shelf = mPool.nextToFill();
+		Pair pair;
+		double cpu = threadCPUSeconds();
+		try {
+			mPool.generate(*shelf, pair);
+		} catch (...) {
+			Syslog::error("cannot pre-generate %s-%u key pairs; retrying in %u seconds",
+				algorithmName(shelf->algorithm), shelf->bits, errorDelay);
+			sleep(errorDelay);
+			continue;
+		}
+		cpu = threadCPUSeconds() - cpu;
+		{
+			StLock<Mutex> _(mPool);
+			shelf->pairs.push_back(pair);
+			shelf->generated++;
+			shelf->cpuSeconds += cpu;
+		}
+		if (mPool.mBudget < 100)
+			usleep(useconds_t(cpu * 1E6 * (100 - mPool.mBudget) / mPool.mBudget));
+	}
+}
+
+
+//
+// Statistics
+//
+void KeyPairPool::statistics(std::vector<Statistics> &stats) const
+{
+	StLock<Mutex> _(const_cast<KeyPairPool &>(*this));
+	stats.clear();
+	for (std::vector<Shelf>::const_iterator shelf = mShelves.begin(); shelf != mShelves.end(); shelf++) {
+		Statistics s;
+		s.algorithm = shelf->algorithm;
+		s.bits = shelf->bits;
+		s.depth = shelf->depth;
+		s.ready = shelf->pairs.size();
+		s.hits = shelf->hits;
+		s.empty = shelf->empty;
+		s.generated = shelf->generated;
+		s.cpuSeconds = shelf->cpuSeconds;
+		stats.push_back(s);
+	}
+}
+
+void KeyPairPool::dump()
+{
+	if (!enabled())
+		return;
+	std::vector<Statistics> stats;
+	statistics(stats);
+	for (std::vector<Statistics>::const_iterator s = stats.begin(); s != stats.end(); s++) {
+		uint64_t requests = s->hits + s->empty;
+		Syslog::notice("keypair pool %s-%u: %u/%u ready, %llu hits, %llu empty (%.1f%% hit rate), %llu generated in %.2fs CPU",
+			algorithmName(s->algorithm), s->bits, s->ready, s->depth, s->hits, s->empty,
+			requests ? 100.0 * s->hits / requests : 0.0, s->generated, s->cpuSeconds);
+	}
+	Syslog::notice("keypair pool: %llu unpooled key pair requests, refill budget %u%% CPU",
+		mUnpooled, mBudget);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// keypairpool - background pre-generation of key pairs
+//
+#ifndef _H_KEYPAIRPOOL
+#define _H_KEYPAIRPOOL
+
+#include <security_utilities/threading.h>
+#include <security_cdsa_utilities/context.h>
+#include <security_cdsa_client/keyclient.h>
+#include <deque>
+#include <vector>
+
+using namespace Security;
+
+class Server;
+
+
+//
+// A KeyPairPool keeps a few freshly generated key pairs of commonly requested
+// (algorithm, size) combinations on hand, so that a key pair generation request
+// that matches can be answered at once instead of tying up a lane thread for
+// the hundreds of milliseconds an RSA key generation can take.
+//
+// Pooled pairs are held as raw key material in the SecureArena. Handing one out
+// brings both halves into the CSP with a NULL unwrap, under the caller's usage
+// and attributes; the caller then makes Keys of them (with its ACL) as usual.
+// Requests with context attributes other than the key size are never pooled.
+//
+// A single background thread (at low priority) refills the pool, the emptiest
+// shelf first, and rests after each generation long enough to keep its CPU use
+// under the budget (a percentage of one CPU). The pool is off unless configured
+// (securityd -P).
+//
+class KeyPairPool : public Mutex {
+public:
+	KeyPairPool(Server &server);
+	~KeyPairPool();
+	
+	// "rsa:2048:4,ecdsa:256:8,cpu=10" - algorithm:bits:depth entries, optional CPU budget
+	bool configure(const char *spec);
+	bool enabled() const		{ return !mShelves.empty(); }
+	void start();				// begin filling (once the CSP is loaded)
+	
+	// take a pooled pair matching context (keyGen class), or return false
+	bool take(const Context &context,
+		const CssmClient::KeySpec &pubSpec, CssmKey &pubKey,
+		const CssmClient::KeySpec &privSpec, CssmKey &privKey);
+	
+	struct Statistics {
+		CSSM_ALGORITHMS algorithm;
+		uint32 bits;
+		unsigned depth;				// configured shelf depth
+		unsigned ready;				// pairs on the shelf
+		uint64_t hits;				// requests answered from the shelf
+		uint64_t empty;				// matching requests that found the shelf empty
+		uint64_t generated;			// pairs generated for the shelf
+		double cpuSeconds;			// CPU time spent generating them
+	};
+	void statistics(std::vector<Statistics> &stats) const;
+	uint64_t unpooled() const	{ return mUnpooled; } // key pair requests that match no shelf
+	void dump();				// to the system log (on SIGINFO)
+	
+	static const unsigned defaultBudget = 10;	// percent of one CPU
+	
+private:
+	struct Pair {
+		CssmKey publicKey;			// raw; KeyData in the SecureArena
+		CssmKey privateKey;			// ditto
+	};
+	
+	struct Shelf {
+		CSSM_ALGORITHMS algorithm;
+		uint32 bits;
+		unsigned depth;
+		std::deque<Pair> pairs;
+		uint64_t hits, empty, generated;
+		double cpuSeconds;
+	};
+	
+	class Filler : public Thread {
+	public:
+		Filler(KeyPairPool &pool) : mPool(pool) { }
+		void action();
+		
+	private:
+		KeyPairPool &mPool;
+	};
+	
+	Shelf *shelfFor(const Context &context);	// (caller holds lock)
+	Shelf *nextToFill();						// wait for a shelf that needs a pair
+	void generate(Shelf &shelf, Pair &pair);
+	static void install(const CssmKey &raw, const CssmClient::KeySpec &spec, CssmKey &key);
+	static void release(Pair &pair);
+	
+	Server &mServer;
+	std::vector<Shelf> mShelves;	// fixed after configure()
+	unsigned mBudget;				// CPU budget (percent)
+	Condition mTaken;				// signalled when a pair is taken
+	bool mStarted;
+	uint64_t mUnpooled;
+};
+
+
+#endif //_H_KEYPAIRPOOL
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// keyprefetch - decode keychain keys ahead of use after unlock
+//
+#include "keyprefetch.h"
+#include "kcdatabase.h"
+#include "kckey.h"
+#include "server.h"
+#include <security_utilities/debugging.h>
+#include <vector>
+
+
+KeyPrefetcher::KeyPrefetcher(Server &server, unsigned maxThreads, size_t maxQueue)
+	: mServer(server), mEnabled(false), mWork(*this),
+	  mMaxQueue(maxQueue), mMaxThreads(maxThreads), mThreads(0)
+{
+}
+
+
+//
+// Schedule the still-encoded keys of a (just unlocked) keychain for decoding.
+// Our caller holds the keychain's lock, so we only queue the database here;
+// a worker thread will look for the keys (see expand). While we have the lock,
+// we take the snapshot of its secrets that all of its keys will be decoded with.
+//
+void KeyPrefetcher::prefetch(KeychainDatabase &db)
+{
+	if (!mEnabled)
+		return;
+	Item item = { &db, NULL, &db.common(),
+		new SecretsSnapshot(db.common()), db.common().lockEpoch(), 0 };
+	StLock<Mutex> _(*this);
+	queue(item);
+}
+
+void KeyPrefetcher::queue(const Item &item)
+{
+	mQueue.push_back(item);
+	if (mThreads < mMaxThreads && mThreads < mQueue.size()) {
+		mThreads++;
+		(new Worker(*this))->run();
+	} else
+		mWork.signal();
+}
+
+
+//
+// Find the encoded keys of a keychain and queue them, as far as the queue limit
+// allows. That's the keys of all databases open on its common, in any process,
+// not just those of the database that was unlocked. If there are more, we queue
+// ourselves again behind them, and pick up the rest once the queue has drained
+// that far. We give up if a pass makes no progress (keys that won't decode);
+// those are left to be decoded on first use.
+//
+void KeyPrefetcher::expand(const Item &item)
+{
+	if (item.common->lockEpoch() != item.epoch)
+		return;			// locked again already
+	std::vector<ClientHandleObject::Handle> handles;
+	ClientHandleObject::findAllRefs<KeychainKey>(handles);
+	std::vector<RefPointer<KeychainKey> > encoded;
+	for (size_t n = 0; n < handles.size(); n++) {
+		try {
+			RefPointer<KeychainKey> key =
+				ClientHandleObject::findRef<KeychainKey>(handles[n], CSSMERR_CSP_INVALID_KEY_REFERENCE);
+			if (&key->database().common() == item.common && key->needsDecode())
+				encoded.push_back(key);
+		} catch (...) {
+			// (gone since we listed it)
+		}
+	}
+	if (item.encoded && encoded.size() >= item.encoded) {
+		secdebug("prefetch", "%p no progress with %ld encoded keys; leaving them",
+			item.common, encoded.size());
+		return;
+	}
+	
+	StLock<Mutex> _(*this);
+	size_t queued = 0;
+	for (std::vector<RefPointer<KeychainKey> >::const_iterator it = encoded.begin();
+			it != encoded.end() && mQueue.size() < mMaxQueue; it++, queued++) {
+		Item keyItem = { &(*it)->database(), *it, item.common, item.secrets, item.epoch, 0 };
+		queue(keyItem);
+	}
+	if (queued < encoded.size()) {
+		Item again = item;
+		if (queued)			// (else the queue was full; that's no lack of progress)
+			again.encoded = encoded.size();
+		queue(again);
+	}
+	secdebug("prefetch", "%p queued %ld of %ld encoded keys (%ld pending)",
+		item.common, queued, encoded.size(), mQueue.size());
+}
+
+
+//
+// Drop all queued work for a keychain (it's being locked).
+// Workers already decoding a key of it will notice the epoch change
+// and throw their result away.
+//
+void KeyPrefetcher::cancel(KeychainDbCommon &common)
+{
+	std::deque<Item> keep;		// (old queue is released after we unlock)
+	StLock<Mutex> _(*this);
+	for (std::deque<Item>::const_iterator it = mQueue.begin(); it != mQueue.end(); it++)
+		if (it->common != &common)
+			keep.push_back(*it);
+	if (keep.size() != mQueue.size()) {
+		secdebug("prefetch", "%p lock cancelled %ld queued keys",
+			&common, mQueue.size() - keep.size());
+		mQueue.swap(keep);
+	}
+}
+
+
+KeyPrefetcher::Item KeyPrefetcher::next()
+{
+	StLock<Mutex> _(*this);
+	while (mQueue.empty())
+		mWork.wait();
+	Item item = mQueue.front();
+	mQueue.pop_front();
+	return item;
+}
+
+
+//
+// Worker threads live forever, decoding keys as they come.
+// Decoding failures are not our problem; the key will be decoded
+// (and any error reported) on first use.
+//
+void KeyPrefetcher::Worker::action()
+{
+	mPrefetcher.mServer.attachThread();
+	for (;;) {
+		Item item = mPrefetcher.next();
+		try {
+			if (item.key)
+				item.key->prefetch(*item.common, *item.secrets, item.epoch);
+			else
+				mPrefetcher.expand(item);
+		} catch (...) {
+			secdebug("prefetch", "%p/%p failed to decode (ignored)", item.db.get(), item.key.get());
+		}
+	}
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// keyprefetch - decode keychain keys ahead of use after unlock
+//
+#ifndef _H_KEYPREFETCH
+#define _H_KEYPREFETCH
+
+#include <security_utilities/threading.h>
+#include <security_utilities/refcount.h>
+#include "dbcrypto.h"
+#include <deque>
+
+using namespace Security;
+
+class Server;
+class KeychainDatabase;
+class KeychainDbCommon;
+class KeychainKey;
+
+
+//
+// A KeyPrefetcher decodes the KeyBlobs of a keychain's keys in the background,
+// spread over several threads, right after the keychain is unlocked. Without it,
+// each key is decoded on first use, one at a time, under the keychain's lock.
+// This is optional; it's off unless enabled (securityd -K).
+// The work queue is bounded: keys that don't fit are queued once it has drained.
+// Locking the keychain cancels all outstanding work for it.
+//
+class KeyPrefetcher : public Mutex {
+public:
+	KeyPrefetcher(Server &server, unsigned maxThreads, size_t maxQueue = 16384);
+	
+	void enable(bool on)		{ mEnabled = on; }
+	bool enabled() const		{ return mEnabled; }
+	
+	void prefetch(KeychainDatabase &db);		// queue db's encoded keys
+	void cancel(KeychainDbCommon &common);		// drop queued keys of common
+
+private:
+	// a keychain whose keys are to be queued, or a key to decode
+	struct Item {
+		RefPointer<KeychainDatabase> db; // database (of key, if any)
+		RefPointer<KeychainKey> key; // key to decode (or NULL to queue common's keys)
+		KeychainDbCommon *common;	// db's common (held alive through db)
+		RefPointer<SecretsSnapshot> secrets; // common's secrets when db was unlocked
+		uint32 epoch;				// common's lock epoch when db was unlocked
+		size_t encoded;				// encoded keys left by the last expand (0 if none yet)
+	};
+	
+	class Worker : public Thread {
+	public:
+		Worker(KeyPrefetcher &prefetcher) : mPrefetcher(prefetcher) { }
+		void action();
+		
+	private:
+		KeyPrefetcher &mPrefetcher;
+	};
+	
+	Item next();					// wait for and dequeue an item
+	void queue(const Item &item);	// add an item (caller holds lock)
+	void expand(const Item &item);	// queue a keychain's encoded keys
+	
+	Server &mServer;
+	bool mEnabled;
+	Condition mWork;				// signalled when work is queued
+	std::deque<Item> mQueue;		// keys waiting to be decoded
+	const size_t mMaxQueue;			// queue limit
+	const unsigned mMaxThreads;		// worker thread limit
+	unsigned mThreads;				// worker threads started
+};
+
+
+#endif //_H_KEYPREFETCH
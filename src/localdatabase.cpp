@@ -30,6 +30,7 @@
 #include "localkey.h"
 #include "server.h"
 #include "session.h"
+#include "verifycache.h"
 #include <security_agent_client/agentclient.h>
 #include <security_cdsa_utilities/acl_any.h>	// for default owner ACLs
 #include <security_cdsa_client/wrapkey.h>
@@ -54,13 +55,22 @@ static inline LocalKey &myKey(Key &key)
 	return safer_cast<LocalKey &>(key);
 }
 
+//
+// A keychain key may be evicted (see ResidentKeys) while we work with it, so
+// operations hold their own reference to its CSP key for as long as they use it.
+//
+static inline const CssmKey &cssmKey(const CssmClient::Key &cspKey)
+{
+	return static_cast<const CssmKey &>(*cspKey);
+}
+
 
 //
 // Key inquiries
 //
 void LocalDatabase::queryKeySizeInBits(Key &key, CssmKeySize &result)
 {
-    CssmClient::Key theKey(Server::csp(), myKey(key));
+    CssmClient::Key theKey = myKey(key).key();
     result = theKey.sizeInBits();
 }
 
@@ -71,7 +81,8 @@ void LocalDatabase::queryKeySizeInBits(Key &key, CssmKeySize &result)
 void LocalDatabase::generateSignature(const Context &context, Key &key,
 	CSSM_ALGORITHMS signOnlyAlgorithm, const CssmData &data, CssmData &signature)
 {
-	context.replace(CSSM_ATTRIBUTE_KEY, myKey(key).cssmKey());
+	CssmClient::Key cspKey = myKey(key).key();
+	context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspKey));
 	key.validate(CSSM_ACL_AUTHORIZATION_SIGN, context);
 	CssmClient::Sign signer(Server::csp(), context.algorithm(), signOnlyAlgorithm);
 	signer.override(context);
@@ -81,16 +92,32 @@ void LocalDatabase::generateSignature(const Context &context, Key &key,
 void LocalDatabase::verifySignature(const Context &context, Key &key,
 	CSSM_ALGORITHMS verifyOnlyAlgorithm, const CssmData &data, const CssmData &signature)
 {
-	context.replace(CSSM_ATTRIBUTE_KEY, myKey(key).cssmKey());
+	// a repeat of a verification that succeeded before needs no public key operation
+	VerifyCache &cache = VerifyCache::shared();
+	VerifyCache::Tag tag;
+	bool cacheable = cache.enabled() && VerifyCache::cacheable(context);
+	if (cacheable) {
+		VerifyCache::tag(key.canonicalDigest(), context.algorithm(), verifyOnlyAlgorithm,
+			data, signature, tag);
+		if (cache.verified(tag))
+			return;
+	}
+	
+	CssmClient::Key cspKey = myKey(key).key();
+	context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspKey));
 	CssmClient::Verify verifier(Server::csp(), context.algorithm(), verifyOnlyAlgorithm);
 	verifier.override(context);
 	verifier.verify(data, signature);
+	
+	if (cacheable)
+		cache.remember(tag, key.canonicalDigest());
 }
 
 void LocalDatabase::generateMac(const Context &context, Key &key,
 	const CssmData &data, CssmData &mac)
 {
-	context.replace(CSSM_ATTRIBUTE_KEY, myKey(key).cssmKey());
+	CssmClient::Key cspKey = myKey(key).key();
+	context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspKey));
 	key.validate(CSSM_ACL_AUTHORIZATION_MAC, context);
 	CssmClient::GenerateMac signer(Server::csp(), context.algorithm());
 	signer.override(context);
@@ -100,7 +127,8 @@ void LocalDatabase::generateMac(const Context &context, Key &key,
 void LocalDatabase::verifyMac(const Context &context, Key &key,
 	const CssmData &data, const CssmData &mac)
 {
-	context.replace(CSSM_ATTRIBUTE_KEY, myKey(key).cssmKey());
+	CssmClient::Key cspKey = myKey(key).key();
+	context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspKey));
 	key.validate(CSSM_ACL_AUTHORIZATION_MAC, context);
 	CssmClient::VerifyMac verifier(Server::csp(), context.algorithm());
 	verifier.override(context);
@@ -114,7 +142,8 @@ void LocalDatabase::verifyMac(const Context &context, Key &key,
 void LocalDatabase::encrypt(const Context &context, Key &key,
 	const CssmData &clear, CssmData &cipher)
 {
-	context.replace(CSSM_ATTRIBUTE_KEY, myKey(key).cssmKey());
+	CssmClient::Key cspKey = myKey(key).key();
+	context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspKey));
 	key.validate(CSSM_ACL_AUTHORIZATION_ENCRYPT, context);
 	CssmClient::Encrypt cryptor(Server::csp(), context.algorithm());
 	cryptor.override(context);
@@ -129,7 +158,8 @@ void LocalDatabase::encrypt(const Context &context, Key &key,
 void LocalDatabase::decrypt(const Context &context, Key &key,
 	const CssmData &cipher, CssmData &clear)
 {
-	context.replace(CSSM_ATTRIBUTE_KEY, myKey(key).cssmKey());
+	CssmClient::Key cspKey = myKey(key).key();
+	context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspKey));
 	key.validate(CSSM_ACL_AUTHORIZATION_DECRYPT, context);
 	CssmClient::Decrypt cryptor(Server::csp(), context.algorithm());
 	cryptor.override(context);
@@ -142,10 +172,160 @@ void LocalDatabase::decrypt(const Context &context, Key &key,
 }
 
 
+//
+// Staged cryptography.
+// Each kind of stream drives one CSP operation in staged mode. The context (with
+// our key in it) is set up, and the key's ACL consulted, once when the stream starts.
+// Output is produced (and allocated) chunk by chunk, so the memory a stream holds
+// doesn't grow with the amount of data pushed through it.
+// A stream holds its own reference to the CSP key its context points at, so the
+// key matter stays put for as long as the stream lives, even if the Key lets go
+// of it meanwhile (as a KeychainKey does when ResidentKeys evicts it).
+//
+class LocalStream : public Database::Stream {
+public:
+	LocalStream(Key &key, Operation op, const CssmClient::Key &cspKey)
+		: Stream(key, op), mCspKey(cspKey) { }
+
+private:
+	CssmClient::Key mCspKey;
+};
+
+class EncryptStream : public LocalStream {
+public:
+	EncryptStream(Key &key, const CssmClient::Key &cspKey, const Context &context)
+		: LocalStream(key, Stream::encrypt, cspKey), mCryptor(Server::csp(), context.algorithm())
+	{ mCryptor.override(context); mCryptor.init(); }
+	
+	void update(const CssmData &clear, CssmData &cipher)
+	{ cipher.length(mCryptor.encrypt(clear, cipher)); }
+	void final(const CssmData &, CssmData &cipher)
+	{ mCryptor.final(cipher); }
+
+private:
+	CssmClient::Encrypt mCryptor;
+};
+
+class DecryptStream : public LocalStream {
+public:
+	DecryptStream(Key &key, const CssmClient::Key &cspKey, const Context &context)
+		: LocalStream(key, Stream::decrypt, cspKey), mCryptor(Server::csp(), context.algorithm())
+	{ mCryptor.override(context); mCryptor.init(); }
+	
+	void update(const CssmData &cipher, CssmData &clear)
+	{ clear.length(mCryptor.decrypt(cipher, clear)); }
+	void final(const CssmData &, CssmData &clear)
+	{ mCryptor.final(clear); }
+
+private:
+	CssmClient::Decrypt mCryptor;
+};
+
+class SignStream : public LocalStream {
+public:
+	SignStream(Key &key, const CssmClient::Key &cspKey, const Context &context,
+			CSSM_ALGORITHMS signOnlyAlgorithm)
+		: LocalStream(key, Stream::generateSignature, cspKey),
+		  mSigner(Server::csp(), context.algorithm(), signOnlyAlgorithm)
+	{ mSigner.override(context); mSigner.init(); }
+	
+	void update(const CssmData &data, CssmData &)
+	{ mSigner.sign(data); }
+	void final(const CssmData &, CssmData &signature)
+	{ mSigner(signature); }
+
+private:
+	CssmClient::Sign mSigner;
+};
+
+class VerifyStream : public LocalStream {
+public:
+	VerifyStream(Key &key, const CssmClient::Key &cspKey, const Context &context,
+			CSSM_ALGORITHMS verifyOnlyAlgorithm)
+		: LocalStream(key, Stream::verifySignature, cspKey),
+		  mVerifier(Server::csp(), context.algorithm(), verifyOnlyAlgorithm)
+	{ mVerifier.override(context); mVerifier.init(); }
+	
+	void update(const CssmData &data, CssmData &)
+	{ mVerifier.verify(data); }
+	void final(const CssmData &signature, CssmData &)
+	{ mVerifier(signature); }
+
+private:
+	CssmClient::Verify mVerifier;
+};
+
+class MacStream : public LocalStream {
+public:
+	MacStream(Key &key, const CssmClient::Key &cspKey, const Context &context)
+		: LocalStream(key, Stream::generateMac, cspKey), mSigner(Server::csp(), context.algorithm())
+	{ mSigner.override(context); mSigner.init(); }
+	
+	void update(const CssmData &data, CssmData &)
+	{ mSigner.sign(data); }
+	void final(const CssmData &, CssmData &mac)
+	{ mSigner(mac); }
+
+private:
+	CssmClient::GenerateMac mSigner;
+};
+
+class VerifyMacStream : public LocalStream {
+public:
+	VerifyMacStream(Key &key, const CssmClient::Key &cspKey, const Context &context)
+		: LocalStream(key, Stream::verifyMac, cspKey), mVerifier(Server::csp(), context.algorithm())
+	{ mVerifier.override(context); mVerifier.init(); }
+	
+	void update(const CssmData &data, CssmData &)
+	{ mVerifier.verify(data); }
+	void final(const CssmData &mac, CssmData &)
+	{ mVerifier(mac); }
+
+private:
+	CssmClient::VerifyMac mVerifier;
+};
+
+void LocalDatabase::startStream(const Context &context, Key &key, Stream::Operation op,
+	CSSM_ALGORITHMS signOnlyAlgorithm, RefPointer<Stream> &stream)
+{
+	CssmClient::Key cspKey = myKey(key).key();	// (the stream keeps this reference)
+	context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspKey));
+	switch (op) {
+	case Stream::encrypt:
+		key.validate(CSSM_ACL_AUTHORIZATION_ENCRYPT, context);
+		stream = new EncryptStream(key, cspKey, context);
+		break;
+	case Stream::decrypt:
+		key.validate(CSSM_ACL_AUTHORIZATION_DECRYPT, context);
+		stream = new DecryptStream(key, cspKey, context);
+		break;
+	case Stream::generateSignature:
+		key.validate(CSSM_ACL_AUTHORIZATION_SIGN, context);
+		stream = new SignStream(key, cspKey, context, signOnlyAlgorithm);
+		break;
+	case Stream::verifySignature:
+		stream = new VerifyStream(key, cspKey, context, signOnlyAlgorithm);
+		break;
+	case Stream::generateMac:
+		key.validate(CSSM_ACL_AUTHORIZATION_MAC, context);
+		stream = new MacStream(key, cspKey, context);
+		break;
+	case Stream::verifyMac:
+		key.validate(CSSM_ACL_AUTHORIZATION_MAC, context);
+		stream = new VerifyMacStream(key, cspKey, context);
+		break;
+	default:
+		CssmError::throwMe(CSSM_ERRCODE_INVALID_DATA);
+	}
+	key.addReference(*stream);	// dies with its key
+}
+
+
 //
 // Key generation and derivation.
 // Currently, we consider symmetric key generation to be fast, but
-// asymmetric key generation to be (potentially) slow.
+// asymmetric key generation to be (potentially) slow - unless the
+// KeyPairPool has a pair ready.
 //
 void LocalDatabase::generateKey(const Context &context,
 		const AccessCredentials *cred, const AclEntryPrototype *owner,
@@ -169,18 +349,21 @@ void LocalDatabase::generateKey(const Context &context,
 	uint32 pubUsage, uint32 pubAttrs, uint32 privUsage, uint32 privAttrs,
     RefPointer<Key> &publicKey, RefPointer<Key> &privateKey)
 {
-	// prepare a context
-	CssmClient::GenerateKey generate(Server::csp(), context.algorithm());
-	generate.override(context);
-	
-	// this may take a while; let our server object know
-	Server::active().longTermActivity();
-	
-	// generate keys
+	// take a pre-generated pair, if there's one that fits
 	// @@@ turn "none" return into reference if permanent (only)
 	CssmKey pubKey, privKey;
-	generate(pubKey, LocalKey::KeySpec(pubUsage, pubAttrs),
-		privKey, LocalKey::KeySpec(privUsage, privAttrs));
+	LocalKey::KeySpec pubSpec(pubUsage, pubAttrs), privSpec(privUsage, privAttrs);
+	if (!Server::keyPairPool().take(context, pubSpec, pubKey, privSpec, privKey)) {
+		// prepare a context
+		CssmClient::GenerateKey generate(Server::csp(), context.algorithm());
+		generate.override(context);
+		
+		// this may take a while; let our server object know
+		Server::active().longTermWait();
+		
+		// generate keys
+		generate(pubKey, pubSpec, privKey, privSpec);
+	}
 		
 	// register and return the generated keys
 	publicKey = makeKey(pubKey, pubAttrs & LocalKey::managedAttributes, 
@@ -202,14 +385,17 @@ void LocalDatabase::wrapKey(const Context &context, const AccessCredentials *cre
     keyToBeWrapped.validate(context.algorithm() == CSSM_ALGID_NONE ?
             CSSM_ACL_AUTHORIZATION_EXPORT_CLEAR : CSSM_ACL_AUTHORIZATION_EXPORT_WRAPPED,
         cred);
+    CssmClient::Key cspWrappingKey;
     if (wrappingKey) {
-        context.replace(CSSM_ATTRIBUTE_KEY, myKey(*wrappingKey).cssmKey());
+        cspWrappingKey = myKey(*wrappingKey).key();
+        context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspWrappingKey));
 		wrappingKey->validate(CSSM_ACL_AUTHORIZATION_ENCRYPT, context);
 	}
+    CssmClient::Key cspKey = myKey(keyToBeWrapped).key();
     CssmClient::WrapKey wrap(Server::csp(), context.algorithm());
     wrap.override(context);
     wrap.cred(cred);
-    wrap(myKey(keyToBeWrapped), wrappedKey, &descriptiveData);
+    wrap(cssmKey(cspKey), wrappedKey, &descriptiveData);
 }
 
 void LocalDatabase::unwrapKey(const Context &context,
@@ -217,8 +403,10 @@ void LocalDatabase::unwrapKey(const Context &context,
 	Key *wrappingKey, Key *publicKey, CSSM_KEYUSE usage, CSSM_KEYATTR_FLAGS attrs,
 	const CssmKey wrappedKey, RefPointer<Key> &unwrappedKey, CssmData &descriptiveData)
 {
+    CssmClient::Key cspWrappingKey;
     if (wrappingKey) {
-        context.replace(CSSM_ATTRIBUTE_KEY, myKey(*wrappingKey).cssmKey());
+        cspWrappingKey = myKey(*wrappingKey).key();
+        context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspWrappingKey));
 		wrappingKey->validate(CSSM_ACL_AUTHORIZATION_DECRYPT, context);
 	}
 	// we are not checking access on the public key, if any
@@ -234,9 +422,12 @@ void LocalDatabase::unwrapKey(const Context &context,
         unwrap.owner(ownerInput);
 	}
 	
+    CssmClient::Key cspPublicKey;
+    if (publicKey)
+        cspPublicKey = myKey(*publicKey).key();
     CssmKey result;
 	unwrap(wrappedKey, LocalKey::KeySpec(usage, attrs), result, &descriptiveData,
-		publicKey ? &myKey(*publicKey).cssmKey() : NULL);
+		publicKey ? &cssmKey(cspPublicKey) : NULL);
     unwrappedKey = makeKey(result, attrs & LocalKey::managedAttributes, owner);
 }
 
@@ -248,9 +439,11 @@ void LocalDatabase::deriveKey(const Context &context, Key *key,
 	const AccessCredentials *cred, const AclEntryPrototype *owner,
 	CssmData *param, uint32 usage, uint32 attrs, RefPointer<Key> &derivedKey)
 {
+    CssmClient::Key cspKey;
     if (key) {
 		key->validate(CSSM_ACL_AUTHORIZATION_DERIVE, context);
-        context.replace(CSSM_ATTRIBUTE_KEY, myKey(*key).cssmKey());
+        cspKey = myKey(*key).key();
+        context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspKey));
 	}
 	CssmClient::DeriveKey derive(Server::csp(), context.algorithm(), CSSM_ALGID_NONE);
 	derive.override(context);
@@ -273,7 +466,8 @@ void LocalDatabase::getOutputSize(const Context &context, Key &key, uint32 input
 {
     // We're fudging here somewhat, since the context can be any type.
     // ctx.override will fix the type, and no-one's the wiser.
-	context.replace(CSSM_ATTRIBUTE_KEY, myKey(key).cssmKey());
+	CssmClient::Key cspKey = myKey(key).key();
+	context.replace(CSSM_ATTRIBUTE_KEY, cssmKey(cspKey));
     CssmClient::Digest ctx(Server::csp(), context.algorithm());
     ctx.override(context);
     result = ctx.getOutputSize(inputSize, encrypt);
@@ -73,6 +73,9 @@ public:
 	void encrypt(const Context &context, Key &key, const CssmData &clear, CssmData &cipher);
 	void decrypt(const Context &context, Key &key, const CssmData &cipher, CssmData &clear);
 	
+	void startStream(const Context &context, Key &key, Stream::Operation op,
+		CSSM_ALGORITHMS signOnlyAlgorithm, RefPointer<Stream> &stream);
+	
 	void generateKey(const Context &context,
 		const AccessCredentials *cred, const AclEntryPrototype *owner,
 		CSSM_KEYUSE usage, CSSM_KEYATTR_FLAGS attrs, RefPointer<Key> &newKey);
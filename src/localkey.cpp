@@ -28,6 +28,7 @@
 #include "localkey.h"
 #include "server.h"
 #include "database.h"
+#include "verifycache.h"
 #include <security_cdsa_utilities/acl_any.h>
 
 
@@ -75,6 +76,8 @@ void LocalKey::setup(const CssmKey &newKey, CSSM_KEYATTR_FLAGS moreAttributes)
 
 LocalKey::~LocalKey()
 {
+	if (mDigest.length())	// (only keys with a digest can have verify cache entries)
+		VerifyCache::shared().forget(mDigest.get());
     secdebug("SSkey", "%p destroyed", this);
 }
 
@@ -106,6 +109,7 @@ CssmClient::Key LocalKey::keyValue()
 		getKey();
 		mValidKey = true;
 	}
+	used();
     return mKey;
 }
 
@@ -122,12 +126,13 @@ CSSM_KEYATTR_FLAGS LocalKey::attributes()
 //
 // Return a key's handle and header in external form
 //
-void LocalKey::returnKey(U32HandleObject::Handle &h, CssmKey::Header &hdr)
+void LocalKey::returnKey(ClientHandleObject::Handle &h, CssmKey::Header &hdr)
 {
 	StLock<Mutex> _(*this);
 
     // return handle
     h = this->handle();
+    RequestTrace::handleOut(h);
 	
 	// obtain the key header, from the valid key or the blob if no valid key
 	if (mValidKey) {
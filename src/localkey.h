@@ -64,6 +64,8 @@ public:
 	LocalDatabase &database() const;
 	
     // yield the decoded internal key -- internal attributes
+	// (a keychain key may be evicted at any time; the CssmKey forms are only good
+	// while someone holds a key() reference)
 	CssmClient::Key key()		{ return keyValue(); }
 	const CssmKey &cssmKey()	{ return keyValue(); }
 	operator CssmClient::Key ()	{ return keyValue(); }
@@ -71,7 +73,7 @@ public:
     operator const CSSM_KEY & () { return keyValue(); }
     
     // yield the approximate external key header -- external attributes
-    void returnKey(U32HandleObject::Handle &h, CssmKey::Header &hdr);
+    void returnKey(ClientHandleObject::Handle &h, CssmKey::Header &hdr);
 	
 	// generate the canonical key digest
 	const CssmData &canonicalDigest();
@@ -104,6 +106,7 @@ protected:
 	
 	virtual void getKey();				// decode into mKey or throw
 	virtual void getHeader(CssmKey::Header &hdr); // get header (only) without mKey
+	virtual void used() { }				// mKey is being handed out
 
 protected:
 	bool mValidKey;			// CssmKey form is valid
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// machtime - mach_absolute_time unit conversions
+//
+#ifndef _H_MACHTIME
+#define _H_MACHTIME
+
+#include <mach/mach_time.h>
+#include <stdint.h>
+
+
+//
+// The timebase is fetched once, on first use, and shared by everyone.
+// Conversion divides before multiplying so that long intervals don't
+// overflow with the large timebase ratios some machines have.
+//
+class MachTime {
+public:
+	static uint64_t nanoseconds(uint64_t machTime)
+	{
+		const mach_timebase_info_data_t &tb = timebase();
+		return machTime / tb.denom * tb.numer + machTime % tb.denom * tb.numer / tb.denom;
+	}
+	static uint64_t microseconds(uint64_t machTime)
+	{ return nanoseconds(machTime) / 1000; }
+
+private:
+	static const mach_timebase_info_data_t &timebase();
+};
+
+
+#endif //_H_MACHTIME
@@ -34,6 +34,10 @@
 #include "notifications.h"
 #include "pcscmonitor.h"
 #include "auditevents.h"
+#include "reqtrace.h"
+#include "cryptobench.h"
+#include "verifycache.h"
+#include "residentkeys.h"
 #include "self.h"
 
 #include <security_utilities/daemon.h>
@@ -98,6 +102,13 @@ int main(int argc, char *argv[])
 	const char *tokenCacheDir = "/var/db/TokenCache";
     const char *entropyFile = "/var/db/SystemEntropyCache";
 	const char *equivDbFile = EQUIVALENCEDBPATH;
+	const char *requestTraceFile = NULL;
+	bool prefetchKeys = false;
+	const char *keyPairPools = NULL;
+	int verifyCacheSize = 0;
+	size_t residentKeyBudget = 0;
+	bool sealedBlobs = false;
+	const char *benchmarkFile = NULL;
 	const char *smartCardOptions = getenv("SMARTCARDS");
 	uint32_t keychainAclDefault = CSSM_ACL_KEYCHAIN_PROMPT_INVALID | CSSM_ACL_KEYCHAIN_PROMPT_UNSIGNED;
 	unsigned int verbose = 0;
@@ -112,11 +123,15 @@ int main(int argc, char *argv[])
 	extern char *optarg;
 	extern int optind;
 	int arg;
-	while ((arg = getopt(argc, argv, "a:c:de:E:imN:s:t:T:uvWX")) != -1) {
+	while ((arg = getopt(argc, argv, "a:B:c:de:E:GimKM:N:P:R:s:t:T:uvV:WX")) != -1) {
 		switch (arg) {
 		case 'a':
 			authorizationConfig = optarg;
 			break;
+		case 'B':
+			benchmarkFile = optarg;
+			debugMode = true;	// stay in the foreground
+			break;
 		case 'c':
 			tokenCacheDir = optarg;
 			break;
@@ -129,15 +144,30 @@ int main(int argc, char *argv[])
         case 'E':
             entropyFile = optarg;
             break;
+		case 'G':
+			sealedBlobs = true;
+			break;
 		case 'i':
 			keychainAclDefault &= ~CSSM_ACL_KEYCHAIN_PROMPT_INVALID;
 			break;
         case 'm':
             mdsIsInstalled = true;
             break;
+		case 'K':
+			prefetchKeys = true;
+			break;
+		case 'M':
+			residentKeyBudget = strtoul(optarg, NULL, 10) * 1024;
+			break;
 		case 'N':
 			bootstrapName = optarg;
 			break;
+		case 'P':
+			keyPairPools = optarg;
+			break;
+		case 'R':
+			requestTraceFile = optarg;
+			break;
 		case 's':
 			smartCardOptions = optarg;
 			break;
@@ -158,6 +188,10 @@ int main(int argc, char *argv[])
 		case 'v':
 			verbose++;
 			break;
+		case 'V':
+			if ((verifyCacheSize = atoi(optarg)) < 0)
+				verifyCacheSize = 0;
+			break;
 		case 'X':
 			doFork = true;
 			reExecute = true;
@@ -222,6 +256,7 @@ int main(int argc, char *argv[])
 		|| signal(SIGINT, handleSignals) == SIG_ERR
 		|| signal(SIGTERM, handleSignals) == SIG_ERR
 		|| signal(SIGPIPE, handleSignals) == SIG_ERR
+		|| signal(SIGINFO, handleSignals) == SIG_ERR
 #if !defined(NDEBUG)
 		|| signal(SIGUSR1, handleSignals) == SIG_ERR
 #endif //NDEBUG
@@ -263,6 +298,18 @@ int main(int argc, char *argv[])
 	server.floatingThread(true);
 	server.waitForClients(waitForClients);
 	server.verbosity(verbose);
+	if (requestTraceFile)
+		RequestTrace::open(requestTraceFile);
+	if (prefetchKeys)
+		server.prefetchKeys(true);
+	if (keyPairPools && !server.keyPairPools(keyPairPools))
+		usage(argv[0]);
+	if (verifyCacheSize)
+		VerifyCache::shared().capacity(verifyCacheSize);
+	if (residentKeyBudget)
+		ResidentKeys::shared().budget(residentKeyBudget);
+	if (sealedBlobs)
+		server.legacyBlobs(false);
     
 	// add the RNG seed timer
 # if defined(NDEBUG)
@@ -283,7 +330,14 @@ int main(int argc, char *argv[])
     
     // install MDS (if needed) and initialize the local CSSM
     server.loadCssm(mdsIsInstalled);
+	
+	// benchmark the database crypto core instead of entering service (-B)
+	if (benchmarkFile)
+		exit(CryptoBenchmark::run(benchmarkFile));
     
+	// start pre-generating key pairs (-P)
+	Server::keyPairPool().start();
+	
 	// create the shared memory notification hub
 	new SharedMemoryListener(messagingName, kSharedMemoryPoolSize);
 	
@@ -307,11 +361,18 @@ static void usage(const char *me)
 {
 	fprintf(stderr, "Usage: %s [-dwX]"
 		"\n\t[-a authConfigFile]                    Authorization configuration file"
+		"\n\t[-B resultFile]                        benchmark the keychain crypto core and exit (- for stdout)"
 		"\n\t[-c tokencache]                        smartcard token cache directory"
 		"\n\t[-e equivDatabase] 					path to code equivalence database"
+		"\n\t[-G]                                   write keychain blobs in the sealed (AES-GCM) format (migrates them as they're rewritten)"
+		"\n\t[-K]                                   decode keychain keys in the background after unlock"
+		"\n\t[-M kbytes]                            budget for decoded keychain keys (evict beyond it)"
 		"\n\t[-N serviceName]                       MACH service name"
+		"\n\t[-P alg:bits:depth,...[,cpu=percent]]  pre-generate key pairs (e.g. rsa:2048:4)"
+		"\n\t[-R traceFile]                         record a request trace for replay"
 		"\n\t[-s off|on|conservative|aggressive]    smartcard operation level"
 		"\n\t[-t maxthreads] [-T threadTimeout]     server thread control"
+		"\n\t[-V entries]                           cache this many signature verification successes"
 		"\n", me);
 	exit(2);
 }
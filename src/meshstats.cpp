@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// meshstats - live snapshots of the object mesh
+//
+#include "meshstats.h"
+#include "server.h"
+#include "session.h"
+#include <security_utilities/logging.h>
+#include <cxxabi.h>
+
+
+//
+// Take a snapshot.
+// The Server's registries are copied out first, so that no registry lock
+// is held while we walk (and lock) the nodes themselves. The Server itself
+// is not refcounted (it lives on main's stack), so it is walked directly.
+//
+MeshSnapshot::MeshSnapshot()
+	: mWhen(Time::now())
+{
+	add(Server::active());
+	std::vector<RefPointer<NodeCore> > roots;
+	Server::active().meshRoots(roots);
+	std::vector<RefPointer<Session> > sessions;
+	Session::allSessions(sessions);
+	roots.insert(roots.end(), sessions.begin(), sessions.end());
+	for (std::vector<RefPointer<NodeCore> >::const_iterator it = roots.begin(); it != roots.end(); it++)
+		add(**it);
+}
+
+
+void MeshSnapshot::add(NodeCore &node)
+{
+	TypeStatistics &stats = mRaw[&typeid(node)];
+	double age = (mWhen - node.created()).seconds();
+	if (age < 0)
+		age = 0;		// made after we started
+	stats.count++;
+	stats.bytes += node.memoryEstimate();
+	stats.totalAge += age;
+	if (age > stats.oldest)
+		stats.oldest = age;
+	node.forEachReference(*this);
+}
+
+
+//
+// Resolve type names. Distinct type_infos may (rarely) name the same type,
+// so entries are merged by name.
+//
+MeshSnapshot::Table MeshSnapshot::table() const
+{
+	Table result;
+	for (RawTable::const_iterator it = mRaw.begin(); it != mRaw.end(); it++) {
+		const char *mangled = it->first->name();
+		int status;
+		char *demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+		TypeStatistics &stats = result[demangled ? demangled : mangled];
+		::free(demangled);
+		stats.count += it->second.count;
+		stats.bytes += it->second.bytes;
+		stats.totalAge += it->second.totalAge;
+		if (it->second.oldest > stats.oldest)
+			stats.oldest = it->second.oldest;
+	}
+	return result;
+}
+
+
+//
+// Produce a CF dictionary of per-type statistics
+//
+static void setNumber(CFMutableDictionaryRef dict, CFStringRef key, uint64_t value)
+{
+	CFRef<CFNumberRef> number(makeCFNumber((long long)value));
+	CFDictionarySetValue(dict, key, number);
+}
+
+CFDictionaryRef MeshSnapshot::copyDictionary() const
+{
+	Table types = table();
+	CFMutableDictionaryRef result = CFDictionaryCreateMutable(NULL, 0,
+		&kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	for (Table::const_iterator it = types.begin(); it != types.end(); it++) {
+		const TypeStatistics &stats = it->second;
+		CFRef<CFMutableDictionaryRef> entry(CFDictionaryCreateMutable(NULL, 0,
+			&kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks));
+		setNumber(entry, CFSTR("count"), stats.count);
+		setNumber(entry, CFSTR("bytes"), stats.bytes);
+		setNumber(entry, CFSTR("oldest"), uint64_t(stats.oldest));
+		setNumber(entry, CFSTR("meanAge"), uint64_t(stats.totalAge / stats.count));
+		CFRef<CFStringRef> name(makeCFString(it->first));
+		CFDictionarySetValue(result, name, entry);
+	}
+	return result;
+}
+
+
+//
+// Write a summary to the system log (on SIGINFO)
+//
+void MeshSnapshot::dump() const
+{
+	Table types = table();
+	Syslog::notice("object mesh (ages in seconds):");
+	for (Table::const_iterator it = types.begin(); it != types.end(); it++) {
+		const TypeStatistics &stats = it->second;
+		Syslog::notice(" %s count=%llu bytes=%llu oldest=%.0f mean=%.0f",
+			it->first.c_str(), stats.count, stats.bytes,
+			stats.oldest, stats.totalAge / stats.count);
+	}
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// meshstats - live snapshots of the object mesh
+//
+#ifndef _H_MESHSTATS
+#define _H_MESHSTATS
+
+#include "structure.h"
+#include <security_utilities/cfutilities.h>
+#include <string>
+#include <map>
+
+
+//
+// A MeshSnapshot is a census of the object mesh at one point in time:
+// for each node type, how many nodes there are, how much memory they
+// (approximately) hold, and how old they are.
+// Taking a snapshot walks the mesh from the Server's roots (connections,
+// processes, sessions and the Server itself) down through the References of
+// each node. There is no global lock; each node is locked only long enough
+// to copy its References, so a snapshot is cheap enough to poll in production.
+// The price is that it is not atomic: nodes created or killed during the walk
+// may or may not be counted.
+//
+class MeshSnapshot {
+public:
+	struct TypeStatistics {
+		TypeStatistics() : count(0), bytes(0), oldest(0), totalAge(0) { }
+		
+		uint64_t count;					// number of live nodes
+		uint64_t bytes;					// sum of memoryEstimate()
+		double oldest;					// age of oldest node (seconds)
+		double totalAge;				// sum of ages (seconds)
+	};
+	typedef std::map<std::string, TypeStatistics> Table;
+	
+	MeshSnapshot();						// take a snapshot of the active Server's mesh
+	
+	void add(NodeCore &node);			// count node and (recursively) its References
+	void operator () (NodeCore &node) { add(node); }
+	
+	Table table() const;				// by (demangled) type name
+	
+	CFDictionaryRef copyDictionary() const;	// type name -> statistics
+	void dump() const;					// summary to the system log
+
+private:
+	Time::Absolute mWhen;				// when the snapshot was started
+	typedef std::map<const std::type_info *, TypeStatistics> RawTable;
+	RawTable mRaw;						// by type_info (names are resolved on output)
+};
+
+
+#endif //_H_MESHSTATS
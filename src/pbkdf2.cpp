@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// pbkdf2 - multi-lane PBKDF2 (HMAC/SHA-1) key derivation
+//
+#include "pbkdf2.h"
+#include <security_cdsa_utilities/cssmerrors.h>
+#include <algorithm>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+using std::min;
+
+
+//
+// The lane vector. This uses the compiler's generic vector extension, so the
+// same code becomes SSE2, AVX2, or plain scalar code as the target allows.
+//
+#if defined(__AVX2__)
+typedef uint32_t Lanes __attribute__((vector_size(32)));
+#else
+typedef uint32_t Lanes __attribute__((vector_size(16)));
+#endif
+
+const unsigned PBKDF2::lanes = sizeof(Lanes) / sizeof(uint32_t);
+
+static const size_t digestSize = 20;		// SHA-1 digest bytes
+static const size_t blockSize = 64;			// SHA-1 block bytes
+
+
+//
+// The SHA-1 compression function, written once for both a single word (uint32_t)
+// and a vector of lanes. The message schedule is kept in a 16-word ring.
+//
+template <class W>
+static inline W rol(W x, unsigned n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+template <class W>
+static inline W schedule(W *w, unsigned t)
+{
+	return w[t & 15] = rol(w[(t + 13) & 15] ^ w[(t + 8) & 15] ^ w[(t + 2) & 15] ^ w[t & 15], 1);
+}
+
+#define SHA1_ROUND(f, k, wt) \
+	{ W tmp = rol(a, 5) + (f) + e + (k) + (wt); e = d; d = c; c = rol(b, 30); b = a; a = tmp; }
+
+template <class W>
+static void compress(W *h, W *w)
+{
+	W a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	unsigned t = 0;
+	for (; t < 16; t++)
+		SHA1_ROUND(d ^ (b & (c ^ d)), 0x5A827999, w[t]);
+	for (; t < 20; t++)
+		SHA1_ROUND(d ^ (b & (c ^ d)), 0x5A827999, schedule(w, t));
+	for (; t < 40; t++)
+		SHA1_ROUND(b ^ c ^ d, 0x6ED9EBA1, schedule(w, t));
+	for (; t < 60; t++)
+		SHA1_ROUND((b & c) | (d & (b | c)), 0x8F1BBCDC, schedule(w, t));
+	for (; t < 80; t++)
+		SHA1_ROUND(b ^ c ^ d, 0xCA62C1D6, schedule(w, t));
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+#undef SHA1_ROUND
+
+
+//
+// A plain (one lane) SHA-1 for the odd setup steps: hashing long passphrases,
+// the HMAC pads, and the salted first step of each chain.
+//
+namespace {
+
+class SHA1 {
+public:
+	SHA1()
+	{
+		static const uint32_t iv[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+		memcpy(h, iv, sizeof(h));
+		used = 0;
+		length = 0;
+	}
+	
+	// continue from a saved state after whole blocks
+	SHA1(const uint32_t *state, uint64_t bytesDone)
+	{
+		memcpy(h, state, sizeof(h));
+		used = 0;
+		length = bytesDone;
+	}
+	
+	void update(const void *data, size_t size)
+	{
+		const uint8_t *p = (const uint8_t *)data;
+		length += size;
+		while (size > 0) {
+			size_t n = min(size, blockSize - used);
+			memcpy(buffer + used, p, n);
+			used += n; p += n; size -= n;
+			if (used == blockSize) {
+				block();
+				used = 0;
+			}
+		}
+	}
+	
+	void finish(uint32_t *digest)
+	{
+		uint64_t bits = length * 8;
+		uint8_t pad = 0x80;
+		update(&pad, 1);
+		pad = 0;
+		while (used != blockSize - 8)
+			update(&pad, 1);
+		for (int n = 7; n >= 0; n--)
+			buffer[blockSize - 1 - n] = uint8_t(bits >> (8 * n));
+		block();
+		memcpy(digest, h, sizeof(h));
+	}
+	
+	void finish(uint8_t *digest)
+	{
+		uint32_t words[5];
+		finish(words);
+		for (unsigned n = 0; n < digestSize; n++)
+			digest[n] = uint8_t(words[n / 4] >> (24 - 8 * (n % 4)));
+	}
+	
+	uint32_t h[5];				// chaining state
+
+private:
+	void block()
+	{
+		uint32_t w[16];
+		for (unsigned n = 0; n < 16; n++)
+			w[n] = uint32_t(buffer[4*n]) << 24 | uint32_t(buffer[4*n+1]) << 16
+				| uint32_t(buffer[4*n+2]) << 8 | buffer[4*n+3];
+		compress(h, w);
+	}
+	
+	uint8_t buffer[blockSize];	// partial block
+	size_t used;				// bytes in buffer
+	uint64_t length;			// total bytes hashed
+};
+
+} // end anonymous namespace
+
+
+//
+// One chain: the HMAC key states for its passphrase, the running U(i),
+// and the accumulated output block T.
+//
+struct PBKDF2::Chain {
+	uint32_t inner[5];			// SHA-1 state after (key ^ ipad)
+	uint32_t outer[5];			// SHA-1 state after (key ^ opad)
+	uint32_t u[5];				// U(i)
+	uint32_t t[5];				// U(1) ^ ... ^ U(i)
+	uint8_t *output;			// where this block goes
+	size_t length;				// and how much of it
+};
+
+
+//
+// Run the remaining HMAC iterations of up to (lanes) chains side by side.
+// Every iteration hashes exactly one 20-byte message per HMAC half, so the
+// padded message blocks are fixed except for their first five words.
+//
+void PBKDF2::iterate(Chain **chains, unsigned count, uint32 rounds)
+{
+	Lanes inner[5], outer[5], u[5], t[5];
+	for (unsigned lane = 0; lane < lanes; lane++) {
+		const Chain &chain = *chains[lane < count ? lane : 0];	// idle lanes duplicate lane 0
+		for (unsigned n = 0; n < 5; n++) {
+			inner[n][lane] = chain.inner[n];
+			outer[n][lane] = chain.outer[n];
+			u[n][lane] = chain.u[n];
+			t[n][lane] = chain.t[n];
+		}
+	}
+	
+	Lanes padding[11];			// 0x80, zeros, and the bit count of (key block + digest)
+	for (unsigned lane = 0; lane < lanes; lane++) {
+		padding[0][lane] = 0x80000000;
+		for (unsigned n = 1; n < 10; n++)
+			padding[n][lane] = 0;
+		padding[10][lane] = (blockSize + digestSize) * 8;
+	}
+	
+	while (rounds-- > 0) {
+		Lanes w[16], h[5];
+		
+		// inner hash: H(key ^ ipad || U)
+		for (unsigned n = 0; n < 5; n++) {
+			w[n] = u[n];
+			h[n] = inner[n];
+		}
+		for (unsigned n = 0; n < 11; n++)
+			w[5 + n] = padding[n];
+		compress(h, w);
+		
+		// outer hash: H(key ^ opad || inner)
+		for (unsigned n = 0; n < 5; n++) {
+			w[n] = h[n];
+			h[n] = outer[n];
+		}
+		for (unsigned n = 0; n < 11; n++)
+			w[5 + n] = padding[n];
+		compress(h, w);
+		
+		for (unsigned n = 0; n < 5; n++) {
+			u[n] = h[n];
+			t[n] ^= h[n];
+		}
+	}
+	
+	for (unsigned lane = 0; lane < count; lane++)
+		for (unsigned n = 0; n < 5; n++)
+			chains[lane]->t[n] = t[n][lane];
+}
+
+
+//
+// Derive a batch. Set up each output block as a chain (with its first HMAC
+// done the ordinary way, since it takes the salt), run the chains through
+// the lanes, then write out the results.
+//
+void PBKDF2::derive(Derivation *derivations, size_t count, uint32 iterations)
+{
+	if (iterations == 0)
+		CssmError::throwMe(CSSMERR_CSP_INVALID_ATTR_ITERATION_COUNT);
+
+	std::vector<Chain> chains;
+	for (size_t d = 0; d < count; d++) {
+		const Derivation &derivation = derivations[d];
+		
+		// HMAC key pads (hashing an overlong key first)
+		uint8_t key[blockSize];
+		memset(key, 0, sizeof(key));
+		if (derivation.passphrase.length() > blockSize) {
+			SHA1 keyHash;
+			keyHash.update(derivation.passphrase.data(), derivation.passphrase.length());
+			keyHash.finish(key);
+		} else if (derivation.passphrase.length() > 0)
+			memcpy(key, derivation.passphrase.data(), derivation.passphrase.length());
+		uint8_t ipad[blockSize], opad[blockSize];
+		for (unsigned n = 0; n < blockSize; n++) {
+			ipad[n] = key[n] ^ 0x36;
+			opad[n] = key[n] ^ 0x5C;
+		}
+		SHA1 innerKey, outerKey;
+		innerKey.update(ipad, blockSize);
+		outerKey.update(opad, blockSize);
+		memset(key, 0, sizeof(key));
+		memset(ipad, 0, sizeof(ipad));
+		memset(opad, 0, sizeof(opad));
+		
+		uint8_t *output = (uint8_t *)derivation.output.data();
+		size_t remaining = derivation.output.length();
+		for (uint32_t block = 1; remaining > 0; block++) {
+			Chain chain;
+			memcpy(chain.inner, innerKey.h, sizeof(chain.inner));
+			memcpy(chain.outer, outerKey.h, sizeof(chain.outer));
+			
+			// U(1) = HMAC(passphrase, salt || INT(block))
+			uint8_t index[4] = { uint8_t(block >> 24), uint8_t(block >> 16), uint8_t(block >> 8), uint8_t(block) };
+			SHA1 inner(chain.inner, blockSize);
+			inner.update(derivation.salt.data(), derivation.salt.length());
+			inner.update(index, sizeof(index));
+			uint8_t innerDigest[digestSize];
+			inner.finish(innerDigest);
+			SHA1 outer(chain.outer, blockSize);
+			outer.update(innerDigest, sizeof(innerDigest));
+			outer.finish(chain.u);
+			memcpy(chain.t, chain.u, sizeof(chain.t));
+			
+			chain.output = output;
+			chain.length = min(remaining, digestSize);
+			output += chain.length;
+			remaining -= chain.length;
+			chains.push_back(chain);
+		}
+	}
+	
+	// the hard part: all the chains, (lanes) at a time
+	Chain *group[sizeof(Lanes) / sizeof(uint32_t)];
+	for (size_t first = 0; first < chains.size(); first += lanes) {
+		unsigned n = 0;
+		for (; n < lanes && first + n < chains.size(); n++)
+			group[n] = &chains[first + n];
+		iterate(group, n, iterations - 1);
+	}
+	
+	for (std::vector<Chain>::iterator it = chains.begin(); it != chains.end(); it++) {
+		for (unsigned n = 0; n < it->length; n++)
+			it->output[n] = uint8_t(it->t[n / 4] >> (24 - 8 * (n % 4)));
+		memset(&*it, 0, offsetof(Chain, output));	// don't leave key material around
+	}
+}
+
+void PBKDF2::derive(const CssmData &passphrase, const CssmData &salt,
+	uint32 iterations, CssmData output)
+{
+	Derivation derivation = { passphrase, salt, output };
+	derive(&derivation, 1, iterations);
+}
+
+
+//
+// Known-answer test, from RFC 6070 (those with reasonable iteration counts).
+// The last case takes two output blocks; the 4096-round cases are then run
+// once more as a single batch to exercise several lanes at once.
+//
+bool PBKDF2::selfTest()
+{
+	static const struct {
+		const char *passphrase;
+		const char *salt;
+		uint32 iterations;
+		size_t length;
+		const char *expected;
+	} cases[] = {
+		{ "password", "salt", 1, 20,
+			"\x0c\x60\xc8\x0f\x96\x1f\x0e\x71\xf3\xa9\xb5\x24\xaf\x60\x12\x06\x2f\xe0\x37\xa6" },
+		{ "password", "salt", 2, 20,
+			"\xea\x6c\x01\x4d\xc7\x2d\x6f\x8c\xcd\x1e\xd9\x2a\xce\x1d\x41\xf0\xd8\xde\x89\x57" },
+		{ "password", "salt", 4096, 20,
+			"\x4b\x00\x79\x01\xb7\x65\x48\x9a\xbe\xad\x49\xd9\x26\xf7\x21\xd0\x65\xa4\x29\xc1" },
+		{ "passwordPASSWORDpassword", "saltSALTsaltSALTsaltSALTsaltSALTsalt", 4096, 25,
+			"\x3d\x2e\xec\x4f\xe4\x1c\x84\x9b\x80\xc8\xd8\x36\x62\xc0\xe4\x4a\x8b\x29\x1a\x96"
+			"\x4c\xf2\xf0\x70\x38" },
+	};
+	static const unsigned caseCount = sizeof(cases) / sizeof(cases[0]);
+	
+	for (unsigned c = 0; c < caseCount; c++) {
+		uint8_t output[32];
+		derive(CssmData((void *)cases[c].passphrase, strlen(cases[c].passphrase)),
+			CssmData((void *)cases[c].salt, strlen(cases[c].salt)),
+			cases[c].iterations, CssmData(output, cases[c].length));
+		if (memcmp(output, cases[c].expected, cases[c].length))
+			return false;
+	}
+	
+	uint8_t output[2][32];
+	Derivation batch[2];
+	for (unsigned n = 0; n < 2; n++) {
+		batch[n].passphrase = CssmData((void *)cases[2 + n].passphrase, strlen(cases[2 + n].passphrase));
+		batch[n].salt = CssmData((void *)cases[2 + n].salt, strlen(cases[2 + n].salt));
+		batch[n].output = CssmData(output[n], cases[2 + n].length);
+	}
+	derive(batch, 2, 4096);
+	return !memcmp(output[0], cases[2].expected, cases[2].length)
+		&& !memcmp(output[1], cases[3].expected, cases[3].length);
+}
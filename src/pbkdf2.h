@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// pbkdf2 - multi-lane PBKDF2 (HMAC/SHA-1) key derivation
+//
+#ifndef _H_PBKDF2
+#define _H_PBKDF2
+
+#include <security_cdsa_utilities/cssmdata.h>
+#include <vector>
+
+using namespace Security;
+
+
+//
+// A native PKCS#5 PBKDF2 with the HMAC/SHA-1 PRF, as used to derive database
+// master keys from passphrases. Nearly all the time goes into the HMAC chain of
+// the iteration count, and each output block of each derivation is its own
+// independent chain. So we run several chains in lockstep, one per lane of a
+// vector register (4 lanes with SSE, 8 with AVX2), and a batch of derivations
+// costs little more than a single one as long as it fits the lanes.
+//
+// The result is bit-for-bit what the CSP's CSSM_ALGID_PKCS5_PBKDF2 produces
+// (see DatabaseCryptoCore for the runtime cross-check).
+//
+class PBKDF2 {
+public:
+	struct Derivation {
+		CssmData passphrase;		// password (HMAC key)
+		CssmData salt;				// salt
+		CssmData output;			// where to put the derived bits (and how many)
+	};
+	
+	static const unsigned lanes;	// chains computed side by side
+	
+	static void derive(Derivation *derivations, size_t count, uint32 iterations);
+	static void derive(const CssmData &passphrase, const CssmData &salt,
+		uint32 iterations, CssmData output);
+
+	static bool selfTest();			// known-answer test (RFC 6070)
+	
+private:
+	struct Chain;
+	static void iterate(Chain **chains, unsigned count, uint32 rounds);
+};
+
+
+#endif //_H_PBKDF2
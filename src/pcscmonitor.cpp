@@ -257,7 +257,7 @@ void PCSCMonitor::childAction()
 //
 void PCSCMonitor::notifyMe(Notification *message)
 {
-	Server::active().longTermActivity();
+	Server::active().longTermWait();
 	StLock<Mutex> _(*this);
 	assert(mServiceLevel == externalDaemon || Child::state() == alive);
 	if (message->event == kNotificationPCSCInitialized)
@@ -494,7 +494,7 @@ bool PCSCMonitor::isExcludedDevice(const IOKit::Device &dev)
 //
 void PCSCMonitor::dying()
 {
-	Server::active().longTermActivity();
+	Server::active().longTermWait();
 	StLock<Mutex> _(*this);
 	assert(Child::state() == dead);
 	clearReaders(Reader::pcsc);
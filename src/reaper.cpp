@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// reaper - tear down dead clients in the background
+//
+#include "reaper.h"
+#include "server.h"
+#include "dtrace.h"
+#include <security_utilities/debugging.h>
+
+
+Reaper::Reaper(Server &server)
+	: mServer(server), mWork(*this), mStarted(false),
+	  mMaxBacklog(0), mReaped(0), mReferences(0)
+{
+}
+
+
+//
+// Hand a node to the Reaper. The caller should already have unhooked it
+// from wherever it could be found; we hold the last interesting reference.
+// The worker thread is started on first use.
+//
+void Reaper::reap(NodeCore &node)
+{
+	StLock<Mutex> _(*this);
+	mQueue.push_back(&node);
+	if (mQueue.size() > mMaxBacklog)
+		mMaxBacklog = mQueue.size();
+	SECURITYD_TEARDOWN_QUEUED(&node, mQueue.size());
+	secdebug("reaper", "%p queued for teardown (backlog %ld)", &node, mQueue.size());
+	if (!mStarted) {
+		mStarted = true;
+		(new Worker(*this))->run();
+	} else
+		mWork.signal();
+}
+
+Reaper::Statistics Reaper::statistics() const
+{
+	StLock<Mutex> _(const_cast<Reaper &>(*this));
+	Statistics stats = { unsigned(mQueue.size()), mMaxBacklog, mReaped, mReferences };
+	return stats;
+}
+
+
+//
+// The front of the queue stays there while it's being reaped, so it
+// counts towards the backlog until it's done.
+//
+RefPointer<NodeCore> Reaper::next()
+{
+	StLock<Mutex> _(*this);
+	while (mQueue.empty())
+		mWork.wait();
+	return mQueue.front();
+}
+
+void Reaper::done(size_t references)
+{
+	RefPointer<NodeCore> node;		// (destroyed after we drop our lock)
+	StLock<Mutex> lock(*this);
+	node = mQueue.front();
+	mQueue.pop_front();
+	SECURITYD_TEARDOWN_DONE(node.get(), references);
+	mReaped++;
+	mReferences += references;
+	lock.unlock();
+}
+
+
+//
+// The reaper thread lives forever
+//
+void Reaper::Worker::action()
+{
+	for (;;) {
+		RefPointer<NodeCore> node = mReaper.next();
+		size_t references = mReaper.mServer.tearDown(*node);
+		node = NULL;
+		mReaper.done(references);
+	}
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// reaper - tear down dead clients in the background
+//
+#ifndef _H_REAPER
+#define _H_REAPER
+
+#include "structure.h"
+#include <security_utilities/threading.h>
+#include <deque>
+
+class Server;
+
+
+//
+// The Reaper takes over nodes that have been cut out of the object mesh
+// (typically a Process whose task died) and kills them on its own thread.
+// Handing a node over is O(1), so the thread that noticed the death goes
+// straight back to work. The Reaper then dismantles each node's References
+// a leaf at a time (see NodeCore::killLeafReference), so a client that dies
+// holding many thousands of keys doesn't pin any lock for the duration.
+// Nodes are reaped in the order they were handed over.
+//
+class Reaper : public Mutex {
+public:
+	Reaper(Server &server);
+	
+	void reap(NodeCore &node);		// kill node (and its References) eventually
+	
+	struct Statistics {
+		unsigned backlog;			// nodes waiting for (or undergoing) teardown
+		unsigned maxBacklog;		// high-water mark of backlog
+		uint64_t reaped;			// nodes torn down
+		uint64_t references;		// References killed along the way
+	};
+	Statistics statistics() const;
+	
+	static const unsigned yieldInterval = 64; // leaves killed between yields
+	
+private:
+	class Worker : public Thread {
+	public:
+		Worker(Reaper &reaper) : mReaper(reaper) { }
+		void action();
+		
+	private:
+		Reaper &mReaper;
+	};
+	
+	RefPointer<NodeCore> next();	// wait for the next node to reap
+	void done(size_t references);	// finished the front node
+	
+	Server &mServer;
+	Condition mWork;				// signalled when nodes are queued
+	std::deque<RefPointer<NodeCore> > mQueue; // front is being reaped
+	bool mStarted;					// worker thread running
+	unsigned mMaxBacklog;			// high-water mark of mQueue
+	uint64_t mReaped;				// nodes torn down
+	uint64_t mReferences;			// References killed
+};
+
+
+#endif //_H_REAPER
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// reqstats - always-on per-request latency statistics
+//
+#include "reqstats.h"
+#include "reqtrace.h"
+#include "machtime.h"
+#include "server.h"
+#include <security_utilities/logging.h>
+#include <pthread.h>
+
+
+RequestStatistics::Shard RequestStatistics::mShards[shardCount];
+
+
+//
+// Histograms
+//
+RequestStatistics::Histogram::Histogram()
+	: count(0), total(0), max(0)
+{
+	memset(bucket, 0, sizeof(bucket));
+}
+
+unsigned RequestStatistics::Histogram::bucketFor(uint64_t usec)
+{
+	if (usec < subBuckets)
+		return usec;
+	unsigned msb = 63 - __builtin_clzll(usec);
+	unsigned sub = (usec >> (msb - subBits)) & (subBuckets - 1);
+	unsigned bucket = (msb - subBits + 1) * subBuckets + sub;
+	return (bucket < buckets) ? bucket : buckets - 1;
+}
+
+uint64_t RequestStatistics::Histogram::bucketBase(unsigned bucket)
+{
+	if (bucket < subBuckets)
+		return bucket;
+	return uint64_t(subBuckets + bucket % subBuckets) << (bucket / subBuckets - 1);
+}
+
+void RequestStatistics::Histogram::add(uint64_t usec)
+{
+	count++;
+	total += usec;
+	if (usec > max)
+		max = usec;
+	bucket[bucketFor(usec)]++;
+}
+
+void RequestStatistics::Histogram::merge(const Histogram &other)
+{
+	count += other.count;
+	total += other.total;
+	if (other.max > max)
+		max = other.max;
+	for (unsigned n = 0; n < buckets; n++)
+		bucket[n] += other.bucket[n];
+}
+
+uint64_t RequestStatistics::Histogram::percentile(double fraction) const
+{
+	uint64_t rank = uint64_t(count * fraction);
+	uint64_t seen = 0;
+	for (unsigned n = 0; n < buckets - 1; n++)
+		if ((seen += bucket[n]) > rank)
+			return min(bucketBase(n + 1) - 1, max);
+	return max;
+}
+
+
+//
+// Record one request.
+// Threads pick their shard by identity, so in steady state each shard
+// lock is only ever taken by the same few threads (and briefly by readers).
+//
+void RequestStatistics::record(const char *name, CSSM_RETURN rcode, uint64_t machTime)
+{
+	uintptr_t self = uintptr_t(pthread_self());
+	Shard &shard = mShards[((self >> 12) ^ (self >> 4)) % shardCount];
+	StLock<Mutex> _(shard);
+	shard.table[Key(name, rcode)].add(MachTime::microseconds(machTime));
+}
+
+
+//
+// Request timers record on the way out
+//
+RequestStatistics::Timer::~Timer()
+{
+	uint64_t latency = mach_absolute_time() - mStart;
+	record(mName, *mRcode, latency);
+	if (RequestTrace::active()) {
+		const mach_msg_header_t *request = Server::currentRequest();
+		RequestTrace::record(mName, mReplyPort, request ? request->msgh_size : 0,
+			*mRcode, mStart, latency);
+	}
+}
+
+
+//
+// Merge all shards into a result table
+//
+void RequestStatistics::snapshot(Table &table)
+{
+	for (unsigned n = 0; n < shardCount; n++) {
+		StLock<Mutex> _(mShards[n]);
+		for (Table::const_iterator it = mShards[n].table.begin(); it != mShards[n].table.end(); it++)
+			table[it->first].merge(it->second);
+	}
+}
+
+
+//
+// Produce a property list summary for the statistics query:
+// { request-name = ( { result, count, mean, p50, p90, p99, max }, ... ) }
+// with all times in microseconds.
+//
+static void setNumber(CFMutableDictionaryRef dict, CFStringRef key, uint64_t value)
+{
+	CFRef<CFNumberRef> number(makeCFNumber((long long)value));
+	CFDictionarySetValue(dict, key, number);
+}
+
+CFDictionaryRef RequestStatistics::copyStatistics()
+{
+	Table table;
+	snapshot(table);
+	CFMutableDictionaryRef result = CFDictionaryCreateMutable(NULL, 0,
+		&kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	for (Table::const_iterator it = table.begin(); it != table.end(); it++) {
+		const Histogram &h = it->second;
+		CFRef<CFStringRef> name(makeCFString(it->first.first));
+		CFMutableArrayRef results = (CFMutableArrayRef)CFDictionaryGetValue(result, name);
+		if (!results) {
+			CFRef<CFMutableArrayRef> array(CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks));
+			CFDictionarySetValue(result, name, array);
+			results = array;
+		}
+		CFRef<CFMutableDictionaryRef> entry(CFDictionaryCreateMutable(NULL, 0,
+			&kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks));
+		setNumber(entry, CFSTR("result"), it->first.second);
+		setNumber(entry, CFSTR("count"), h.count);
+		setNumber(entry, CFSTR("mean"), h.total / h.count);
+		setNumber(entry, CFSTR("p50"), h.percentile(0.50));
+		setNumber(entry, CFSTR("p90"), h.percentile(0.90));
+		setNumber(entry, CFSTR("p99"), h.percentile(0.99));
+		setNumber(entry, CFSTR("max"), h.max);
+		CFArrayAppendValue(results, entry);
+	}
+	return result;
+}
+
+
+//
+// Write a summary to the system log (on SIGINFO)
+//
+void RequestStatistics::dump()
+{
+	Table table;
+	snapshot(table);
+	Syslog::notice("request statistics (microseconds):");
+	for (Table::const_iterator it = table.begin(); it != table.end(); it++) {
+		const Histogram &h = it->second;
+		Syslog::notice(" %s rc=%d count=%llu mean=%llu p50=%llu p90=%llu p99=%llu max=%llu",
+			it->first.first, int(it->first.second), h.count, h.total / h.count,
+			h.percentile(0.50), h.percentile(0.90), h.percentile(0.99), h.max);
+	}
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// reqstats - always-on per-request latency statistics
+//
+#ifndef _H_REQSTATS
+#define _H_REQSTATS
+
+#include <security_utilities/threading.h>
+#include <security_utilities/cfutilities.h>
+#include <Security/cssmtype.h>
+#include <mach/mach_time.h>
+#include <map>
+
+using namespace Security;
+
+
+//
+// RequestStatistics keeps a latency histogram for each (request name, result code)
+// pair seen by the IPC layer. Histogram buckets are log-linear (four linear steps
+// per power of two microseconds), so recording is a handful of integer operations
+// and percentiles are good to within 25%.
+// Recording threads are spread over a fixed set of independently locked shards
+// so they (almost) never contend; readers merge the shards on demand.
+//
+class RequestStatistics {
+public:
+	static const unsigned subBits = 2;
+	static const unsigned subBuckets = 1 << subBits;	// linear steps per power of two
+	static const unsigned buckets = 26 * subBuckets;	// top bucket starts past a minute
+	
+	struct Histogram {
+		Histogram();
+		
+		uint64_t count;					// number of requests
+		uint64_t total;					// sum of latencies (microseconds)
+		uint64_t max;					// largest latency seen (microseconds)
+		uint64_t bucket[buckets];		// log-linear latency buckets
+		
+		void add(uint64_t usec);
+		void merge(const Histogram &other);
+		uint64_t percentile(double fraction) const;	// upper bound (microseconds)
+		
+		static unsigned bucketFor(uint64_t usec);
+		static uint64_t bucketBase(unsigned bucket);
+	};
+	
+	// request names are the string constants from the IPC layer, keyed by address
+	typedef std::pair<const char *, CSSM_RETURN> Key;
+	typedef std::map<Key, Histogram> Table;
+	
+	static void record(const char *name, CSSM_RETURN rcode, uint64_t machTime);
+	static void snapshot(Table &table);		// merged copy of all shards
+	
+	static CFDictionaryRef copyStatistics();	// name -> array of per-result summaries
+	static void dump();							// summary to the system log
+	
+	//
+	// Time a request from construction to destruction, recording the
+	// result code found in *rcode at the end (and tracing it, if enabled)
+	//
+	class Timer {
+	public:
+		Timer(const char *name, mach_port_t replyPort, const CSSM_RETURN *rcode)
+			: mName(name), mReplyPort(replyPort), mRcode(rcode), mStart(mach_absolute_time()) { }
+		~Timer();
+		
+	private:
+		const char *mName;
+		mach_port_t mReplyPort;
+		const CSSM_RETURN *mRcode;
+		uint64_t mStart;
+	};
+
+private:
+	static const unsigned shardCount = 16;
+	struct Shard : public Mutex {
+		Table table;
+	};
+	static Shard mShards[shardCount];
+};
+
+
+#endif //_H_REQSTATS
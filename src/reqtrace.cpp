@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// reqtrace - record a redacted trace of incoming requests for load replay
+//
+#include "reqtrace.h"
+#include "machtime.h"
+#include <security_utilities/logging.h>
+#include <mach/mach_time.h>
+
+
+FILE *RequestTrace::mFile;
+Mutex RequestTrace::mLock;
+uint64_t RequestTrace::mEpoch;
+std::map<mach_port_t, unsigned> RequestTrace::mConnections;
+unsigned RequestTrace::mRecords;
+std::map<uint32_t, unsigned> RequestTrace::mHandles;
+unsigned RequestTrace::mLastHandle;
+ThreadNexus<RequestTrace::HandleList> RequestTrace::mRequestHandles;
+
+static const unsigned flushInterval = 256;	// records between flushes
+
+
+//
+// Start recording to a file (which is truncated)
+//
+void RequestTrace::open(const char *path)
+{
+	StLock<Mutex> _(mLock);
+	if (FILE *f = fopen(path, "w")) {
+		fprintf(f, "# securityd request trace 2\n");
+		mEpoch = mach_absolute_time();
+		mFile = f;
+		Syslog::notice("recording request trace to %s", path);
+	} else
+		Syslog::error("cannot open request trace %s: %m", path);
+}
+
+
+//
+// Requests look up their handles more than once at times; we only note the first.
+//
+void RequestTrace::note(char direction, uint32_t handle)
+{
+	HandleList &handles = mRequestHandles();
+	for (HandleList::const_iterator it = handles.begin(); it != handles.end(); it++)
+		if (it->first == direction && it->second == handle)
+			return;
+	handles.push_back(std::make_pair(direction, handle));
+}
+
+
+//
+// Write out one request, along with the handles noted for it on this thread
+//
+void RequestTrace::record(const char *name, mach_port_t replyPort, mach_msg_size_t size,
+	CSSM_RETURN rcode, uint64_t start, uint64_t latency)
+{
+	HandleList &handles = mRequestHandles();
+	StLock<Mutex> _(mLock);
+	std::map<mach_port_t, unsigned>::iterator it = mConnections.find(replyPort);
+	if (it == mConnections.end())
+		it = mConnections.insert(make_pair(replyPort, unsigned(mConnections.size() + 1))).first;
+	fprintf(mFile, "%llu %u %s %u %d %llu",
+		MachTime::microseconds(start - mEpoch), it->second, name, size, int(rcode),
+		MachTime::microseconds(latency));
+	for (HandleList::const_iterator h = handles.begin(); h != handles.end(); h++) {
+		unsigned &id = mHandles[h->second];
+		if (id == 0 || h->first == '>')
+			id = ++mLastHandle;
+		fprintf(mFile, " %c%u", h->first, id);
+	}
+	fputc('\n', mFile);
+	handles.clear();
+	if (++mRecords >= flushInterval) {
+		fflush(mFile);
+		mRecords = 0;
+	}
+}
+
+
+void RequestTrace::flush()
+{
+	StLock<Mutex> _(mLock);
+	if (mFile) {
+		fflush(mFile);
+		mRecords = 0;
+	}
+}
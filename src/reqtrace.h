@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// reqtrace - record a redacted trace of incoming requests for load replay
+//
+#ifndef _H_REQTRACE
+#define _H_REQTRACE
+
+#include <security_utilities/threading.h>
+#include <security_utilities/globalizer.h>
+#include <Security/cssmtype.h>
+#include <mach/mach.h>
+#include <stdio.h>
+#include <map>
+#include <vector>
+
+using namespace Security;
+
+
+//
+// A RequestTrace, once opened, writes one line per completed request:
+//	<start> <connection> <request-name> <request-bytes> <result> <latency> [<handle>...]
+// where <start> is microseconds since the trace was opened, <latency> is in
+// microseconds, and <connection> is a small number standing in for the client
+// thread (its reply port), assigned in order of first appearance.
+// Each <handle> is a client handle the request looked up ("<3") or handed out
+// (">7"), in that order. Handles are recorded as symbols too: a handed-out handle
+// gets a new one, and a handle first seen as input (made before the trace was
+// opened) gets one on the spot. So a replay can tell which request made the
+// key or database another one uses.
+// Nothing from the request payload is recorded. tests/replay.cpp plays such a
+// trace back against a running securityd.
+//
+class RequestTrace {
+public:
+	static void open(const char *path);
+	static bool active()	{ return mFile != NULL; }
+	
+	static void record(const char *name, mach_port_t replyPort, mach_msg_size_t size,
+		CSSM_RETURN rcode, uint64_t start, uint64_t latency);	// in mach_absolute_time units
+	static void flush();
+	
+	// note a handle used or returned by the request being handled on this thread
+	static void handleIn(uint32_t handle)	{ if (mFile) note('<', handle); }
+	static void handleOut(uint32_t handle)	{ if (mFile) note('>', handle); }
+
+private:
+	typedef std::vector<std::pair<char, uint32_t> > HandleList;
+	static void note(char direction, uint32_t handle);
+
+	static FILE *mFile;
+	static Mutex mLock;
+	static uint64_t mEpoch;				// mach_absolute_time of open
+	static std::map<mach_port_t, unsigned> mConnections; // reply port -> symbolic id
+	static unsigned mRecords;			// records since last flush
+	static std::map<uint32_t, unsigned> mHandles; // client handle -> symbolic id
+	static unsigned mLastHandle;		// last symbolic handle id given out
+	static ThreadNexus<HandleList> mRequestHandles; // noted for this thread's request
+};
+
+
+#endif //_H_REQTRACE
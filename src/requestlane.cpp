@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// requestlane - run classes of requests off the main worker pool
+//
+#include "requestlane.h"
+#include "server.h"
+#include "dtrace.h"
+#include <security_utilities/debugging.h>
+
+
+//
+// However many lane threads are in long-term waits, we won't start more than this
+//
+static const unsigned laneThreadCeiling = 64;
+
+
+RequestLane::RequestLane(Server &server, const char *name, unsigned maxThreads)
+	: mServer(server), mName(name), mWork(*this), mMaxThreads(maxThreads),
+	  mLongTerm(0), mRunning(0), mThreads(0), mIdle(0), mMaxDepth(0), mHandled(0)
+{
+}
+
+
+//
+// Park a request for the lane.
+// We copy the message (including its trailer, which carries the client's audit
+// token); any port rights and out-of-line memory it carries now belong to us.
+// Lane threads are started on demand, up to our limit.
+//
+void RequestLane::defer(const mach_msg_header_t *request)
+{
+	const mach_msg_trailer_t *trailer = (const mach_msg_trailer_t *)
+		((vm_offset_t)request + round_msg(request->msgh_size));
+	size_t size = round_msg(request->msgh_size) + trailer->msgh_trailer_size;
+	mach_msg_header_t *copy = (mach_msg_header_t *)Allocator::standard().malloc(size);
+	memcpy(copy, request, size);
+	
+	StLock<Mutex> _(*this);
+	mQueue.push_back(copy);
+	if (mQueue.size() > mMaxDepth)
+		mMaxDepth = mQueue.size();
+	SECURITYD_REQUEST_DEFERRED((char *)mName, mQueue.size());
+	secdebug("requestlane", "%s: request %d parked (%ld pending)",
+		mName, copy->msgh_id, mQueue.size());
+	grow();
+}
+
+void RequestLane::grow()
+{
+	if (mIdle > 0)
+		mWork.signal();
+	else if (mayRun() && mThreads < laneThreadCeiling) {
+		mThreads++;
+		(new Worker(*this))->run();
+	}
+}
+
+
+//
+// The calling lane thread is going to wait for something outside securityd.
+// Count it out of our limit for the rest of its request, and get another
+// thread going if work is waiting. Server::longTermWait calls this at most
+// once per request.
+//
+void RequestLane::longTermActivity()
+{
+	StLock<Mutex> _(*this);
+	mLongTerm++;
+	secdebug("requestlane", "%s: thread in long-term wait (%u of %u)",
+		mName, mLongTerm, mThreads);
+	if (!mQueue.empty())
+		grow();
+}
+
+RequestLane::Statistics RequestLane::statistics() const
+{
+	StLock<Mutex> _(const_cast<RequestLane &>(*this));
+	Statistics stats = { unsigned(mQueue.size()), mMaxDepth, mHandled,
+		mThreads, mMaxThreads, mLongTerm };
+	return stats;
+}
+
+mach_msg_header_t *RequestLane::next()
+{
+	StLock<Mutex> _(*this);
+	mIdle++;
+	while (mQueue.empty() || !mayRun())
+		mWork.wait();
+	mIdle--;
+	mRunning++;
+	mach_msg_header_t *request = mQueue.front();
+	mQueue.pop_front();
+	return request;
+}
+
+void RequestLane::done(bool longTerm)
+{
+	StLock<Mutex> _(*this);
+	mRunning--;
+	if (longTerm)
+		mLongTerm--;
+	mHandled++;
+	if (!mQueue.empty() && mIdle > 0)
+		mWork.signal();		// (we may have been what held it up)
+}
+
+
+//
+// Lane threads live forever, running parked requests as they come
+//
+void RequestLane::Worker::action()
+{
+	for (;;) {
+		mach_msg_header_t *request = mLane.next();
+		bool longTerm = mLane.mServer.handleDeferred(mLane, request);
+		Allocator::standard().free(request);
+		mLane.done(longTerm);
+	}
+}
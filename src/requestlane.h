@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// requestlane - run classes of requests off the main worker pool
+//
+#ifndef _H_REQUESTLANE
+#define _H_REQUESTLANE
+
+#include <security_utilities/threading.h>
+#include <mach/message.h>
+#include <deque>
+
+using namespace Security;
+
+class Server;
+
+
+//
+// A RequestLane takes requests of a particular class away from the main
+// MachServer worker pool. The pool thread that received such a request parks
+// a copy of the message here and goes straight back to work without replying;
+// a lane thread later runs the request and sends the reply itself.
+// Each lane has its own (small) thread limit, so a burst of slow requests
+// queues up in its lane instead of tying up the pool that serves quick ones.
+// As with MachServer's own pool, a lane thread that declares a long-term wait
+// (on SecurityAgent, say; see Server::longTermWait) stops counting against
+// that limit until it's done with its request, and the lane starts another
+// thread if work is waiting. So pending dialogs can't stall a lane, and a request
+// made on behalf of one of them (by authorizationhost) doesn't queue behind it.
+//
+class RequestLane : public Mutex {
+public:
+	RequestLane(Server &server, const char *name, unsigned maxThreads);
+	
+	const char *name() const	{ return mName; }
+	
+	void defer(const mach_msg_header_t *request);	// park a copy for the lane
+	
+	// the calling lane thread is (about to be) blocked for long, until its request is done
+	void longTermActivity();
+	
+	struct Statistics {
+		unsigned depth;				// requests waiting for a lane thread
+		unsigned maxDepth;			// high-water mark of depth
+		uint64_t handled;			// requests completed
+		unsigned threads;			// lane threads started
+		unsigned maxThreads;		// lane thread limit (not counting long-term waits)
+		unsigned longTerm;			// lane threads in long-term waits
+	};
+	Statistics statistics() const;
+	
+private:
+	class Worker : public Thread {
+	public:
+		Worker(RequestLane &lane) : mLane(lane) { }
+		void action();
+		
+	private:
+		RequestLane &mLane;
+	};
+	
+	mach_msg_header_t *next();		// wait for and dequeue a request
+	void done(bool longTerm);		// a request taken by next() is complete
+	void grow();					// start a thread for waiting work, if we may (caller holds lock)
+	bool mayRun() const { return mRunning - mLongTerm < mMaxThreads; }
+	
+	Server &mServer;
+	const char *mName;
+	Condition mWork;				// signalled when work is queued (or may now run)
+	std::deque<mach_msg_header_t *> mQueue; // parked requests (we own the memory)
+	const unsigned mMaxThreads;		// limit of lane threads running requests, not counting...
+	unsigned mLongTerm;				// ... lane threads in long-term waits
+	unsigned mRunning;				// lane threads running requests
+	unsigned mThreads;				// lane threads started
+	unsigned mIdle;					// lane threads waiting for work
+	unsigned mMaxDepth;				// high-water mark of mQueue
+	uint64_t mHandled;				// requests completed
+};
+
+
+#endif //_H_REQUESTLANE
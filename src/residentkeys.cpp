@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// residentkeys - global LRU of decoded keychain key material
+//
+#include "residentkeys.h"
+#include "kckey.h"
+#include <security_utilities/globalizer.h>
+#include <security_utilities/logging.h>
+#include <security_utilities/debugging.h>
+
+
+ResidentKeys::ResidentKeys()
+	: mBudget(0), mBytes(0), mEvictions(0), mRedecodes(0)
+{
+}
+
+static ModuleNexus<ResidentKeys> residentKeys;
+
+ResidentKeys &ResidentKeys::shared()
+{
+	return residentKeys();
+}
+
+
+void ResidentKeys::budget(size_t bytes)
+{
+	StLock<Mutex> _(*this);
+	mBudget = bytes;
+}
+
+
+//
+// Estimated memory held by a decoded key: the CssmKey, its key data (a raw key,
+// or the CSP's reference), and the key itself inside the CSP - its size in bits,
+// tripled for private keys, whose CSP form carries the CRT parameters.
+//
+size_t ResidentKeys::residentSize(const CssmKey &key)
+{
+	size_t bits = (key.header().LogicalKeySizeInBits + 7) / 8;
+	if (key.keyClass() == CSSM_KEYCLASS_PRIVATE_KEY)
+		bits *= 3;
+	return sizeof(CssmKey) + key.length() + bits;
+}
+
+
+//
+// Account for a freshly decoded key, and evict others if that takes us
+// over budget. Our caller holds the key's lock, so we can only try-lock
+// the keys we'd like to evict.
+//
+void ResidentKeys::decoded(KeychainKey &key, const CssmKey &material,
+	Session::SessionId session, bool redecode)
+{
+	StLock<Mutex> _(*this);
+	std::map<KeychainKey *, Entries::iterator>::iterator it = mByKey.find(&key);
+	if (it != mByKey.end())
+		remove(it->second);		// (decoded again without being evicted)
+	Entry entry = { &key, residentSize(material), session };
+	mEntries.push_front(entry);
+	mByKey[&key] = mEntries.begin();
+	mBytes += entry.bytes;
+	mSessionBytes[session] += entry.bytes;
+	if (redecode)
+		mRedecodes++;
+	if (mBudget && mBytes > mBudget)
+		evictFor(key);
+}
+
+void ResidentKeys::forget(KeychainKey &key)
+{
+	StLock<Mutex> _(*this);
+	std::map<KeychainKey *, Entries::iterator>::iterator it = mByKey.find(&key);
+	if (it != mByKey.end())
+		remove(it->second);
+}
+
+void ResidentKeys::remove(Entries::iterator entry)
+{
+	mBytes -= entry->bytes;
+	std::map<Session::SessionId, size_t>::iterator session = mSessionBytes.find(entry->session);
+	if ((session->second -= entry->bytes) == 0)
+		mSessionBytes.erase(session);
+	mByKey.erase(entry->key);
+	mEntries.erase(entry);
+}
+
+
+//
+// The CLOCK sweep, from the back (least recently decoded). A key used since
+// we last looked gets a second chance at the front; one we can't evict right
+// now (busy, or no valid blob to fall back to) goes to the front as well.
+// We give up after going once around.
+//
+void ResidentKeys::evictFor(KeychainKey &keep)
+{
+	for (size_t looked = 0, count = mEntries.size(); looked < count && mBytes > mBudget; looked++) {
+		Entries::iterator victim = --mEntries.end();
+		KeychainKey *key = victim->key;
+		if (key != &keep && !key->usedSinceLastLook() && key->evict()) {
+			remove(victim);
+			mEvictions++;
+		} else
+			mEntries.splice(mEntries.begin(), mEntries, victim);
+	}
+	if (mBytes > mBudget)
+		secdebug("residentkeys", "still %lu bytes over budget after a sweep", (unsigned long)(mBytes - mBudget));
+}
+
+
+//
+// Statistics
+//
+ResidentKeys::Statistics ResidentKeys::statistics()
+{
+	StLock<Mutex> _(*this);
+	Statistics stats;
+	stats.budget = mBudget;
+	stats.bytes = mBytes;
+	stats.keys = mEntries.size();
+	stats.evictions = mEvictions;
+	stats.redecodes = mRedecodes;
+	stats.sessionBytes = mSessionBytes;
+	return stats;
+}
+
+void ResidentKeys::dump()
+{
+	Statistics stats = statistics();
+	Syslog::notice("resident keys: %lu bytes in %lu keys (budget %lu), %llu evicted, %llu decoded again",
+		(unsigned long)stats.bytes, (unsigned long)stats.keys, (unsigned long)stats.budget,
+		stats.evictions, stats.redecodes);
+	for (std::map<Session::SessionId, size_t>::const_iterator it = stats.sessionBytes.begin();
+			it != stats.sessionBytes.end(); it++)
+		Syslog::notice(" session %d: %lu bytes", int(it->first), (unsigned long)it->second);
+}
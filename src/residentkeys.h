@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// residentkeys - global LRU of decoded keychain key material
+//
+#ifndef _H_RESIDENTKEYS
+#define _H_RESIDENTKEYS
+
+#include "session.h"
+#include <security_utilities/threading.h>
+#include <security_cdsa_client/keyclient.h>
+#include <list>
+#include <map>
+
+class KeychainKey;
+
+
+//
+// ResidentKeys keeps track of the KeychainKeys that hold decoded key material,
+// across all processes and sessions, and how much memory that takes (an estimate;
+// see residentSize). Given a byte budget (securityd -M), it evicts keys to stay
+// within it: an evicted key drops its CssmKey and falls back to its encoded state
+// (its blob), and is decoded again on next use. Only keys with a valid blob can
+// be evicted.
+//
+// Replacement is CLOCK (second chance): use of a key just sets a flag, and the
+// eviction scan moves flagged keys to the front instead of evicting them. So key
+// use never takes our lock.
+//
+// Request threads may use a key's CSP key without holding the key's lock; they
+// hold their own CssmClient::Key reference to it (LocalKey::key()) while they do,
+// so an evicted key's CSP key is released when the last such user lets go.
+//
+class ResidentKeys : public Mutex {
+public:
+	ResidentKeys();
+	
+	static ResidentKeys &shared();			// the one securityd uses
+	
+	void budget(size_t bytes);				// 0 for no limit (accounting only)
+	size_t budget() const		{ return mBudget; }
+	
+	// key has just been decoded (caller holds its lock); may evict others
+	void decoded(KeychainKey &key, const CssmKey &material, Session::SessionId session,
+		bool redecode);
+	void forget(KeychainKey &key);			// key is going away (or was evicted)
+	
+	static size_t residentSize(const CssmKey &key);
+	
+	struct Statistics {
+		size_t budget;
+		size_t bytes;						// resident (estimated)
+		size_t keys;						// resident keys
+		uint64_t evictions;
+		uint64_t redecodes;					// evicted keys decoded again
+		std::map<Session::SessionId, size_t> sessionBytes;
+	};
+	Statistics statistics();
+	void dump();							// to the system log (on SIGINFO)
+	
+private:
+	struct Entry {
+		KeychainKey *key;
+		size_t bytes;
+		Session::SessionId session;
+	};
+	typedef std::list<Entry> Entries;		// most recently decoded (or reprieved) first
+	
+	void remove(Entries::iterator entry);	// (caller holds lock)
+	void evictFor(KeychainKey &keep);		// get under budget (caller holds lock)
+	
+	size_t mBudget;
+	size_t mBytes;
+	Entries mEntries;
+	std::map<KeychainKey *, Entries::iterator> mByKey;
+	std::map<Session::SessionId, size_t> mSessionBytes;
+	uint64_t mEvictions, mRedecodes;
+};
+
+
+#endif //_H_RESIDENTKEYS
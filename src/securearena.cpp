@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// securearena - locked, zeroizing memory for secrets
+//
+#include "securearena.h"
+#include <security_utilities/globalizer.h>
+#include <security_utilities/logging.h>
+#include <security_utilities/debugging.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+
+using std::min;
+
+
+//
+// Every block starts with a header that says where it came from.
+// (It's 16 bytes, so payloads are 16-byte aligned.)
+//
+struct SecureArena::Header {
+	uint32_t magic;
+	uint32_t sizeClass;				// classCount for blocks with their own mapping
+	uint64_t length;				// as requested
+	
+	static const uint32_t magicValue = 0x5ecaa7e1;
+};
+
+
+static size_t pageSize()
+{
+	static const size_t size = getpagesize();
+	return size;
+}
+
+static size_t roundPage(size_t size)
+{
+	return (size + pageSize() - 1) & ~(pageSize() - 1);
+}
+
+
+SecureArena::SecureArena()
+	: mLargeInUse(0), mLargeBytes(0), mChunks(0), mUnlockedChunks(0)
+{
+	for (unsigned c = 0; c < classCount; c++) {
+		SizeClass &sizeClass = mClasses[c];
+		sizeClass.slotSize = minSlot << c;
+		sizeClass.freeList = NULL;
+		sizeClass.slots = sizeClass.inUse = sizeClass.peak = 0;
+	}
+}
+
+SecureArena &SecureArena::shared()
+{
+	static ModuleNexus<SecureArena> arena;
+	return arena();
+}
+
+
+//
+// Zero memory in a way the compiler won't optimize away
+//
+void SecureArena::wipe(void *addr, size_t length)
+{
+	memset(addr, 0, length);
+	__asm__ __volatile__("" : : "r" (addr) : "memory");
+}
+
+
+//
+// Wired anonymous memory.
+// If we can't wire it (resource limits), we use it anyway and say so (once).
+//
+void *SecureArena::map(size_t length)
+{
+	void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (addr == MAP_FAILED)
+		throw std::bad_alloc();
+	if (mlock(addr, length)) {
+		static bool warned = false;
+		if (!warned) {
+			Syslog::notice("secure arena: cannot wire memory (errno=%d); secrets may be paged", errno);
+			warned = true;
+		}
+		StLock<Mutex> _(mLock);
+		mUnlockedChunks++;
+	}
+	return addr;
+}
+
+void SecureArena::unmap(void *addr, size_t length)
+{
+	munlock(addr, length);
+	munmap(addr, length);
+}
+
+
+//
+// Carve a new chunk into slots for a size class.
+// Caller must hold the size class's lock.
+//
+void SecureArena::refill(SizeClass &sizeClass)
+{
+	char *chunk = (char *)map(chunkSize);
+	size_t count = chunkSize / sizeClass.slotSize;
+	for (size_t n = count; n > 0; n--) {		// (so they come out in address order)
+		Slot *slot = (Slot *)(chunk + (n - 1) * sizeClass.slotSize);
+		slot->next = sizeClass.freeList;
+		sizeClass.freeList = slot;
+	}
+	sizeClass.slots += count;
+	StLock<Mutex> _(mLock);
+	mChunks++;
+}
+
+
+//
+// Allocator interface
+//
+void *SecureArena::malloc(size_t size) throw(std::bad_alloc)
+{
+	size_t need = size + sizeof(Header);
+	if (need < size)
+		throw std::bad_alloc();		// overflow
+	unsigned c = 0;
+	while (c < classCount && (minSlot << c) < need)
+		c++;
+	
+	Header *header;
+	if (c < classCount) {
+		SizeClass &sizeClass = mClasses[c];
+		StLock<Mutex> _(sizeClass);
+		if (!sizeClass.freeList)
+			refill(sizeClass);
+		Slot *slot = sizeClass.freeList;
+		sizeClass.freeList = slot->next;
+		if (++sizeClass.inUse > sizeClass.peak)
+			sizeClass.peak = sizeClass.inUse;
+		header = (Header *)slot;		// (the rest of the slot is still zero)
+	} else {
+		size_t length = roundPage(need);
+		header = (Header *)map(length);
+		StLock<Mutex> _(mLock);
+		mLargeInUse++;
+		mLargeBytes += length;
+	}
+	header->magic = Header::magicValue;
+	header->sizeClass = c;
+	header->length = size;
+	return header + 1;
+}
+
+void SecureArena::free(void *addr) throw()
+{
+	if (!addr)
+		return;
+	Header *header = (Header *)addr - 1;
+	if (header->magic != Header::magicValue || header->sizeClass > classCount) {
+		secdebug("securearena", "%p not allocated here; ignored", addr);
+		assert(false);
+		return;
+	}
+	unsigned c = header->sizeClass;
+	if (c < classCount) {
+		SizeClass &sizeClass = mClasses[c];
+		wipe(header, sizeClass.slotSize);
+		StLock<Mutex> _(sizeClass);
+		Slot *slot = (Slot *)header;
+		slot->next = sizeClass.freeList;
+		sizeClass.freeList = slot;
+		sizeClass.inUse--;
+	} else {
+		size_t length = roundPage(header->length + sizeof(Header));
+		wipe(header, header->length + sizeof(Header));
+		unmap(header, length);
+		StLock<Mutex> _(mLock);
+		mLargeInUse--;
+		mLargeBytes -= length;
+	}
+}
+
+void *SecureArena::realloc(void *addr, size_t size) throw(std::bad_alloc)
+{
+	if (!addr)
+		return malloc(size);
+	Header *header = (Header *)addr - 1;
+	bool fits = (header->sizeClass < classCount)
+		? size + sizeof(Header) <= mClasses[header->sizeClass].slotSize
+		: roundPage(size + sizeof(Header)) == roundPage(header->length + sizeof(Header));
+	if (fits) {		// (own mappings keep their size; free() goes by length)
+		if (size < header->length)
+			wipe((char *)addr + size, header->length - size);
+		header->length = size;
+		return addr;
+	}
+	void *newAddr = malloc(size);
+	memcpy(newAddr, addr, min(size_t(header->length), size));
+	free(addr);
+	return newAddr;
+}
+
+
+//
+// Occupancy
+//
+void SecureArena::statistics(Statistics &stats)
+{
+	for (unsigned c = 0; c < classCount; c++) {
+		SizeClass &sizeClass = mClasses[c];
+		StLock<Mutex> _(sizeClass);
+		stats.classes[c].slotSize = sizeClass.slotSize;
+		stats.classes[c].slots = sizeClass.slots;
+		stats.classes[c].inUse = sizeClass.inUse;
+		stats.classes[c].peak = sizeClass.peak;
+	}
+	StLock<Mutex> _(mLock);
+	stats.largeInUse = mLargeInUse;
+	stats.largeBytes = mLargeBytes;
+	stats.chunks = mChunks;
+	stats.unlockedChunks = mUnlockedChunks;
+}
+
+void SecureArena::dump()
+{
+	Statistics stats;
+	statistics(stats);
+	Syslog::notice("secure arena: %llu chunk(s) of %lu bytes (%llu not wired), %llu large block(s) in %llu bytes",
+		stats.chunks, (unsigned long)chunkSize, stats.unlockedChunks, stats.largeInUse, stats.largeBytes);
+	for (unsigned c = 0; c < classCount; c++)
+		if (stats.classes[c].slots)
+			Syslog::notice(" %lu-byte slots: %llu in use of %llu (peak %llu)",
+				(unsigned long)stats.classes[c].slotSize, stats.classes[c].inUse,
+				stats.classes[c].slots, stats.classes[c].peak);
+}
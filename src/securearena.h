@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// securearena - locked, zeroizing memory for secrets
+//
+#ifndef _H_SECUREARENA
+#define _H_SECUREARENA
+
+#include <security_utilities/alloc.h>
+#include <security_utilities/threading.h>
+
+
+//
+// SecureArena is an Allocator for key material and decrypted blob contents.
+// Small requests come out of size classes (powers of two) carved from wired
+// (mlock'd) chunks that are never returned to the system, so secrets stay out
+// of swap and out of the general heap. Requests too big for the largest class get
+// a wired mapping of their own. Every block is zeroed when freed, and comes out
+// zeroed. Memory from here must be freed here (and nowhere else).
+//
+class SecureArena : public Allocator {
+public:
+	SecureArena();
+	
+	void *malloc(size_t size) throw(std::bad_alloc);
+	void free(void *addr) throw();
+	void *realloc(void *addr, size_t size) throw(std::bad_alloc);
+	
+	static SecureArena &shared();				// the one securityd uses
+	
+	static const unsigned classCount = 8;		// slot sizes minSlot .. minSlot << (classCount - 1)
+	static const size_t minSlot = 32;			// (including the block header)
+	static const size_t chunkSize = 64 * 1024;	// wired at a time per class
+	
+	struct Statistics {
+		struct Class {
+			size_t slotSize;				// bytes per slot (including header)
+			uint64_t slots;					// carved so far
+			uint64_t inUse;					// currently allocated
+			uint64_t peak;					// most ever allocated at once
+		} classes[classCount];
+		uint64_t largeInUse;				// own-mapping blocks allocated
+		uint64_t largeBytes;				// ... and their mapped size
+		uint64_t chunks;					// class chunks mapped
+		uint64_t unlockedChunks;			// ... that we couldn't wire (mlock failed)
+	};
+	void statistics(Statistics &stats);
+	void dump();								// occupancy to the system log (on SIGINFO)
+	
+private:
+	struct Header;
+	struct Slot { Slot *next; };			// free list link (in the slot's payload)
+	
+	struct SizeClass : public Mutex {
+		size_t slotSize;
+		Slot *freeList;
+		uint64_t slots, inUse, peak;
+	};
+	
+	void refill(SizeClass &sizeClass);			// carve a new chunk (caller holds its lock)
+	void *map(size_t length);					// wired anonymous mapping
+	void unmap(void *addr, size_t length);
+	static void wipe(void *addr, size_t length);
+	
+	SizeClass mClasses[classCount];
+	
+	Mutex mLock;								// for the following
+	uint64_t mLargeInUse, mLargeBytes;
+	uint64_t mChunks, mUnlockedChunks;
+};
+
+
+#endif //_H_SECUREARENA
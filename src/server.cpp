@@ -35,10 +35,17 @@
 #include "notifications.h"
 #include "child.h"
 #include <mach/mach_error.h>
+#include <sched.h>
 #include <security_utilities/ccaudit.h>
 #include "pcscmonitor.h"
+#include "securearena.h"
+#include "verifycache.h"
+#include "residentkeys.h"
 
 #include "agentquery.h"
+#include "reqstats.h"
+#include "reqtrace.h"
+#include "meshstats.h"
 
 
 using namespace MachPlusPlus;
@@ -56,6 +63,25 @@ Authority::~Authority()
 }
 
 
+//
+// Size limit for incoming and outgoing messages
+//
+static const mach_msg_size_t maxMessageSize = 0x10000;
+
+//
+// Threads available to the request lanes.
+// Crypto work gets (about) one thread per processor. There is (usually) only
+// one user to answer dialogs, so the external lane can be small; besides, a lane
+// thread that is waiting on a dialog doesn't count (see RequestLane).
+//
+static unsigned cryptoLaneThreads()
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 2) ? unsigned(cpus) : 2;
+}
+static const unsigned externalLaneThreads = 4;
+
+
 //
 // Construct the server object
 //
@@ -65,8 +91,14 @@ Server::Server(Authority &authority, CodeSignatures &signatures, const char *boo
     mCSPModule(gGuidAppleCSP, mCssm), mCSP(mCSPModule),
     mAuthority(authority),
 	mCodeSignatures(signatures), 
-	mVerbosity(0),
-	mWaitForClients(true), mShuttingDown(false)
+	mVerbosity(0), mLegacyBlobs(true),
+	mWaitForClients(true), mShuttingDown(false),
+	mCryptoLane(*this, "crypto", cryptoLaneThreads()),
+	mExternalLane(*this, "external", externalLaneThreads),
+	mReaper(*this),
+	mKeyPrefetcher(*this, cryptoLaneThreads()),
+	mKeyPairPool(*this),
+	mWorkPool(*this, cryptoLaneThreads())
 {
 	// make me eternal (in the object mesh)
 	ref();
@@ -94,10 +126,9 @@ Server::~Server()
 Connection &Server::connection(mach_port_t port, audit_token_t &auditToken)
 {
 	Server &server = active();
-	StLock<Mutex> _(server);
-	Connection *conn = server.mConnections.get(port, CSSM_ERRCODE_INVALID_CONTEXT_HANDLE);
+	RefPointer<Connection> conn = server.mConnections.get(port, CSSM_ERRCODE_INVALID_CONTEXT_HANDLE);
 	conn->process().checkSession(auditToken);
-	active().mCurrentConnection() = conn;
+	server.mCurrentConnection() = conn;
 	conn->beginWork(auditToken);
 	return *conn;
 }
@@ -138,7 +169,8 @@ Session &Server::session()
 
 RefPointer<Key> Server::key(KeyHandle key)
 {
-	return U32HandleObject::findRef<Key>(key, CSSMERR_CSP_INVALID_KEY_REFERENCE);
+	RequestTrace::handleIn(key);
+	return ClientHandleObject::findRef<Key>(key, CSSMERR_CSP_INVALID_KEY_REFERENCE);
 }
 
 RefPointer<Database> Server::database(DbHandle db)
@@ -164,9 +196,10 @@ RefPointer<Database> Server::optionalDatabase(DbHandle db, bool persistent)
 // Locate an ACL bearer (database or key) by handle
 // The handle might be used across IPC, so we clamp it accordingly
 //
-AclSource &Server::aclBearer(AclKind kind, U32HandleObject::Handle handle)
+AclSource &Server::aclBearer(AclKind kind, ClientHandleObject::Handle handle)
 {
-	AclSource &bearer = U32HandleObject::find<AclSource>(handle, CSSMERR_CSSM_INVALID_ADDIN_HANDLE);
+	RequestTrace::handleIn(handle);
+	AclSource &bearer = ClientHandleObject::find<AclSource>(handle, CSSMERR_CSSM_INVALID_ADDIN_HANDLE);
 	if (kind != bearer.acl().aclKind())
 		CssmError::throwMe(CSSMERR_CSSM_INVALID_HANDLE_USAGE);
 	return bearer;
@@ -178,7 +211,7 @@ AclSource &Server::aclBearer(AclKind kind, U32HandleObject::Handle handle)
 //
 void Server::run()
 {
-	MachServer::run(0x10000,
+	MachServer::run(maxMessageSize,
         MACH_RCV_TRAILER_TYPE(MACH_MSG_TRAILER_FORMAT_0) |
         MACH_RCV_TRAILER_ELEMENTS(MACH_RCV_TRAILER_AUDIT));
 }
@@ -208,7 +241,175 @@ boolean_t self_server(mach_msg_header_t *, mach_msg_header_t *);
 
 boolean_t Server::handle(mach_msg_header_t *in, mach_msg_header_t *out)
 {
-	return ucsp_server(in, out) || self_server(in, out);
+	RequestState &current = mCurrentRequest();
+	current.message = in;
+	current.deferrable = true;
+	boolean_t result = ucsp_server(in, out) || self_server(in, out);
+	current.message = NULL;
+	return result;
+}
+
+const mach_msg_header_t *Server::currentRequest()
+{
+	return active().mCurrentRequest().message;
+}
+
+
+//
+// Defer the request now being handled to a lane, if we can.
+// Returns true if the request has been parked; the caller must then return
+// MIG_NO_REPLY without further ado. Returns false if we are already on a lane
+// (or not handling a raw request), in which case the caller just proceeds.
+//
+bool Server::deferTo(Lane lane)
+{
+	Server &server = active();
+	RequestState &current = server.mCurrentRequest();
+	if (!current.message || !current.deferrable)
+		return false;
+	switch (lane) {
+	case fastLane:
+		return false;
+	case cryptoLane:
+		server.mCryptoLane.defer(current.message);
+		break;
+	case externalLane:
+		server.mExternalLane.defer(current.message);
+		break;
+	}
+	current.message = NULL;
+	return true;
+}
+
+
+//
+// Run a request parked on a lane and send its reply.
+// This replicates what MachServer does for its own threads, including
+// disposing of the request on error returns.
+//
+bool Server::handleDeferred(RequestLane &lane, mach_msg_header_t *request)
+{
+	attachThread();
+	RequestState &current = mCurrentRequest();
+	current.message = request;
+	current.deferrable = false;		// we're already on a lane
+	current.lane = &lane;
+	current.longTerm = false;
+	mig_reply_error_t *reply = (mig_reply_error_t *)Allocator::standard().malloc(maxMessageSize);
+	boolean_t handled = ucsp_server(request, &reply->Head);
+	current.message = NULL;
+	current.lane = NULL;
+	if (!handled) {
+		Syslog::error("request lane got unrecognized request %d", request->msgh_id);
+		mach_msg_destroy(request);
+	} else if ((reply->Head.msgh_bits & MACH_MSGH_BITS_COMPLEX) || reply->RetCode != MIG_NO_REPLY) {
+		if (!(reply->Head.msgh_bits & MACH_MSGH_BITS_COMPLEX) && reply->RetCode != KERN_SUCCESS) {
+			request->msgh_remote_port = MACH_PORT_NULL;	// don't destroy the reply right
+			mach_msg_destroy(request);
+		}
+		if (reply->Head.msgh_remote_port != MACH_PORT_NULL) {
+			mach_msg_option_t options = MACH_SEND_MSG;
+			if (MACH_MSGH_BITS_REMOTE(reply->Head.msgh_bits) != MACH_MSG_TYPE_MOVE_SEND_ONCE)
+				options |= MACH_SEND_TIMEOUT;
+			kern_return_t rc = mach_msg(&reply->Head, options, reply->Head.msgh_size,
+				0, MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+			if (rc == MACH_SEND_INVALID_DEST || rc == MACH_SEND_TIMED_OUT)
+				mach_msg_destroy(&reply->Head);
+			else if (rc != MACH_MSG_SUCCESS)
+				secdebug("SS", "request lane reply failed (mach error %d)", rc);
+		}
+	}
+	Allocator::standard().free(reply);
+	releaseDeferredAllocations();
+	return current.longTerm;
+}
+
+
+//
+// Declare that the current request is about to block for a long time.
+// On our MachServer threads, that lets the pool start a spare thread. Lane
+// threads aren't MachServer's, so we tell their lane instead (once per request).
+//
+void Server::longTermWait()
+{
+	RequestState &current = mCurrentRequest();
+	if (current.lane) {
+		if (!current.longTerm) {
+			current.longTerm = true;
+			current.lane->longTermActivity();
+		}
+	} else
+		MachServer::longTermActivity();
+}
+
+
+//
+// Our own helper threads (request lanes, the Reaper, etc.) aren't MachServer
+// threads; this makes active() (and thus the static accessors) work on them.
+//
+void Server::attachThread()
+{
+	perThread().server = this;
+}
+
+
+//
+// Report request lane statistics (on SIGINFO)
+//
+void Server::dumpLanes()
+{
+	RequestLane *lanes[] = { &mCryptoLane, &mExternalLane };
+	for (unsigned n = 0; n < sizeof(lanes) / sizeof(lanes[0]); n++) {
+		RequestLane::Statistics stats = lanes[n]->statistics();
+		Syslog::notice("%s lane: depth=%u max=%u handled=%llu threads=%u/%u longterm=%u",
+			lanes[n]->name(), stats.depth, stats.maxDepth, stats.handled,
+			stats.threads, stats.maxThreads, stats.longTerm);
+	}
+}
+
+
+//
+// Tear down a node on behalf of the Reaper: kill its References tree a leaf
+// at a time, then the node itself.
+//
+size_t Server::tearDown(NodeCore &node)
+{
+	attachThread();
+	size_t references = 0;
+	while (node.killLeafReference())
+		if (++references % Reaper::yieldInterval == 0)
+			sched_yield();		// let others at the locks we just dropped
+	node.kill();
+	return references;
+}
+
+void Server::dumpReaper()
+{
+	Reaper::Statistics stats = mReaper.statistics();
+	Syslog::notice("teardown: backlog=%u max=%u reaped=%llu references=%llu",
+		stats.backlog, stats.maxBacklog, stats.reaped, stats.references);
+}
+
+
+//
+// Collect the roots of the object mesh held in the Server's (port-keyed)
+// registries. The registries' stripe locks are held only while copying out.
+//
+namespace {
+	struct RootCollector {
+		RootCollector(std::vector<RefPointer<NodeCore> > &r) : roots(r) { }
+		std::vector<RefPointer<NodeCore> > &roots;
+		
+		template <class Node>
+		void operator () (Port, const RefPointer<Node> &node) { roots.push_back(node.get()); }
+	};
+}
+
+void Server::meshRoots(std::vector<RefPointer<NodeCore> > &roots)
+{
+	RootCollector collector(roots);
+	mConnections.forEach(collector);
+	mProcesses.forEach(collector);
 }
 
 
@@ -225,8 +426,9 @@ void Server::setupConnection(ConnectLevel type, Port replyPort, Port taskPort,
 	AuditToken audit(auditToken);
 	
 	// first, make or find the process based on task port
+	// (the Server lock serializes process creation; lookups elsewhere don't take it)
 	StLock<Mutex> _(*this);
-	RefPointer<Process> &proc = mProcesses[taskPort];
+	RefPointer<Process> proc = mProcesses.getOpt(taskPort);
 	if (proc && proc->session().sessionId() != audit.sessionId())
 		proc->changeSession(audit.sessionId());
 	if (proc && type == connectNewProcess) {
@@ -240,15 +442,16 @@ void Server::setupConnection(ConnectLevel type, Port replyPort, Port taskPort,
 			CssmError::throwMe(CSSM_ERRCODE_INTERNAL_ERROR);
 		assert(info);
 		proc = new Process(taskPort, info, audit);
+		mProcesses.insert(taskPort, proc);
 		notifyIfDead(taskPort);
-		mPids[proc->pid()] = proc;
+		mPids.remove(proc->pid());		// stale entry from a recycled pid, if any
+		mPids.insert(proc->pid(), proc);
 	}
 
 	// now, establish a connection and register it in the server
-	Connection *connection = new Connection(*proc, replyPort);
-	if (mConnections.contains(replyPort))   // malicious re-entry attempt?
+	RefPointer<Connection> connection = new Connection(*proc, replyPort);
+	if (!mConnections.insert(replyPort, connection))   // malicious re-entry attempt?
 		CssmError::throwMe(CSSM_ERRCODE_INTERNAL_ERROR);	//@@@ error code? (client error)
-	mConnections[replyPort] = connection;
 	notifyIfDead(replyPort);
 }
 
@@ -261,11 +464,9 @@ void Server::setupConnection(ConnectLevel type, Port replyPort, Port taskPort,
 //
 void Server::endConnection(Port replyPort)
 {
-	StLock<Mutex> _(*this);
-	PortMap<Connection>::iterator it = mConnections.find(replyPort);
-	assert(it != mConnections.end());
-	it->second->terminate();
-	mConnections.erase(it);
+	RefPointer<Connection> connection = mConnections.remove(replyPort);
+	assert(connection);
+	connection->terminate();
 }
 
 
@@ -275,38 +476,31 @@ void Server::endConnection(Port replyPort)
 //
 void Server::notifyDeadName(Port port)
 {
-	// We need the lock to get a proper iterator on mConnections or mProcesses,
-	// but must release it before we call abort or kill, as these might take 
-	// unbounded time, including calls out to token daemons etc.
-	
-	StLock<Mutex> serverLock(*this);
+	// The registries are self-locking, so we hold no lock while we
+	// call abort or kill, as these might take unbounded time, including
+	// calls out to token daemons etc.
 	secdebug("SSports", "port %d is dead", port.port());
     
     // is it a connection?
-    PortMap<Connection>::iterator conIt = mConnections.find(port);
-    if (conIt != mConnections.end()) {
+	if (RefPointer<Connection> con = mConnections.remove(port)) {
 		SECURITYD_PORTS_DEAD_CONNECTION(port);
-        RefPointer<Connection> con = conIt->second;
-		mConnections.erase(conIt);
-        serverLock.unlock();
-		con->abort();        
-        return;
-    }
+		con->abort();
+		return;
+	}
     
     // is it a process?
-    PortMap<Process>::iterator procIt = mProcesses.find(port);
-    if (procIt != mProcesses.end()) {
+	// (take the Server lock so we don't race a setupConnection for this task)
+	// Once it's out of the registries nobody can find it, so the (potentially
+	// lengthy) kill is left to the Reaper.
+	StLock<Mutex> serverLock(*this);
+	if (RefPointer<Process> proc = mProcesses.remove(port)) {
 		SECURITYD_PORTS_DEAD_PROCESS(port);
-        RefPointer<Process> proc = procIt->second;
-		mPids.erase(proc->pid());
-		mProcesses.erase(procIt);
-        serverLock.unlock();
-		// The kill may take some time; make sure there is a spare thread around
-		// to prevent deadlocks
-		StLock<MachServer, &Server::busy, &Server::idle> _(*this);
-		proc->kill();
-        return;
-    }
+		mPids.remove(proc->pid());
+		serverLock.unlock();
+		mReaper.reap(*proc);
+		return;
+	}
+	serverLock.unlock();
     
 	// well, what IS IT?!
 	SECURITYD_PORTS_DEAD_ORPHAN(port);
@@ -347,11 +541,23 @@ kern_return_t self_server_handleSignal(mach_port_t sport,
 			Syslog::notice("securityd terminated due to SIGINT");
 			_exit(0);
 		case SIGTERM:
+			RequestTrace::flush();
 			Server::active().beginShutdown();
 			break;
 		case SIGPIPE:
 			fprintf(stderr, "securityd ignoring SIGPIPE received");
 			break;
+		case SIGINFO:
+			RequestStatistics::dump();
+			Server::active().dumpLanes();
+			Server::active().dumpReaper();
+			MeshSnapshot().dump();
+			SecureArena::shared().dump();
+			Server::keyPairPool().dump();
+			VerifyCache::shared().dump();
+			ResidentKeys::shared().dump();
+			RequestTrace::flush();
+			break;
 
 #if defined(DEBUGDUMP)
 		case SIGUSR1:
@@ -416,7 +622,7 @@ void Server::SleepWatcher::systemIsWaking()
 void Server::SleepWatcher::systemWillPowerOn()
 {
 	SECURITYD_POWER_ON();
-	Server::active().longTermActivity();
+	Server::active().longTermWait();
 	for (set<PowerWatcher *>::const_iterator it = mPowerClients.begin(); it != mPowerClients.end(); it++)
 		(*it)->systemWillPowerOn();
 }
@@ -439,8 +645,7 @@ void Server::SleepWatcher::remove(PowerWatcher *client)
 //
 Process *Server::findPid(pid_t pid) const
 {
-	PidMap::const_iterator it = mPids.find(pid);
-	return (it == mPids.end()) ? NULL : it->second;
+	return mPids.getOpt(pid);
 }
 
 
@@ -490,10 +695,8 @@ void Server::eventDone()
 {
 	if (this->shuttingDown()) {
 		StLock<Mutex> lazy(*this, false);	// lazy lock acquisition
-		if (SECURITYD_SHUTDOWN_COUNT_ENABLED()) {
-			lazy.lock();
+		if (SECURITYD_SHUTDOWN_COUNT_ENABLED())
 			SECURITYD_SHUTDOWN_COUNT(mProcesses.size(), VProc::Transaction::debugCount());
-		}
 		if (verbosity() >= 2) {
 			lazy.lock();
 			shutdownSnitch();
@@ -503,20 +706,29 @@ void Server::eventDone()
 }
 
 
+namespace {
+	struct SnitchReporter {
+		void operator () (pid_t pid, Process *process)
+		{
+			if (SecCodeRef clientCode = process->processCode()) {
+				CFRef<CFURLRef> path;
+				OSStatus rc = SecCodeCopyPath(clientCode, kSecCSDefaultFlags, &path.aref());
+				if (path)
+					fprintf(reportFile, " %s (%d)\n", cfString(path).c_str(), pid);
+				else
+					fprintf(reportFile,  "pid=%d (error %d)\n", pid, int32_t(rc));
+			}
+		}
+	};
+}
+
 void Server::shutdownSnitch()
 {
 	time_t now;
 	time(&now);
 	fprintf(reportFile, "%.24s %d residual clients:\n",	ctime(&now), int(mPids.size()));
-	for (PidMap::const_iterator it = mPids.begin(); it != mPids.end(); ++it)
-		if (SecCodeRef clientCode = it->second->processCode()) {
-			CFRef<CFURLRef> path;
-			OSStatus rc = SecCodeCopyPath(clientCode, kSecCSDefaultFlags, &path.aref());
-			if (path)
-				fprintf(reportFile, " %s (%d)\n", cfString(path).c_str(), it->first);
-			else
-				fprintf(reportFile,  "pid=%d (error %d)\n", it->first, int32_t(rc));
-		}
+	SnitchReporter reporter;
+	mPids.forEach(reporter);
 	fprintf(reportFile, "\n");
 	fflush(reportFile);
 }
@@ -557,7 +769,7 @@ LongtermStLock::LongtermStLock(Mutex &lck)
 	if (lck.tryLock()) {	// uncontested
 		this->mActive = true;
 	} else {				// contested - need backup thread
-		Server::active().longTermActivity();
+		Server::active().longTermWait();
 		this->lock();
 	}
 }
@@ -45,6 +45,13 @@
 #include "kcdatabase.h"
 #include "authority.h"
 #include "AuthorizationEngine.h"
+#include "requestlane.h"
+#include "reaper.h"
+#include "keyprefetch.h"
+#include "keypairpool.h"
+#include "workpool.h"
+#include "fastrandom.h"
+#include "reqtrace.h"
 #include <map>
 
 #define EQUIVALENCEDBPATH "/var/db/CodeEquivalenceDatabase"
@@ -72,7 +79,7 @@ public:
 //
 class Server : public PerGlobal,
 			   public MachPlusPlus::MachServer,
-               public UniformRandomBlobs<DevRandomGenerator> {
+               public UniformRandomBlobs<FastRandomGenerator> {
 public:
 	Server(Authority &myAuthority, CodeSignatures &signatures, const char *bootstrapName);
 	~Server();
@@ -87,6 +94,7 @@ public:
 	static Server &active() { return safer_cast<Server &>(MachServer::active()); }
 	static const char *bootstrapName() { return active().mBootstrapName.c_str(); }
 	static unsigned int verbosity() { return active().mVerbosity; }
+	static bool legacyBlobs() { return active().mLegacyBlobs; }
 
 	//
 	// Each thread has at most one "active connection". If the server is currently
@@ -112,14 +120,15 @@ public:
 	static RefPointer<Database> database(DbHandle db);
 	static RefPointer<KeychainDatabase> keychain(DbHandle db);
 	static RefPointer<Database> optionalDatabase(DbHandle db, bool persistent = true);
-	static AclSource &aclBearer(AclKind kind, U32HandleObject::Handle handle);
+	static AclSource &aclBearer(AclKind kind, ClientHandleObject::Handle handle);
 	
 	// Generic version of handle lookup
 	template <class ProcessBearer>
     static RefPointer<ProcessBearer> find(uint32_t handle, CSSM_RETURN notFoundError)
 	{
+		RequestTrace::handleIn(handle);
 		RefPointer<ProcessBearer> object = 
-			U32HandleObject::findRef<ProcessBearer>(handle, notFoundError);
+			ClientHandleObject::findRef<ProcessBearer>(handle, notFoundError);
 		if (object->process() != Server::process())
 			CssmError::throwMe(notFoundError);
 		return object;
@@ -131,6 +140,9 @@ public:
     static Authority &authority() { return active().mAuthority; }
 	static CodeSignatures &codeSignatures() { return active().mCodeSignatures; }
 	static CssmClient::CSP &csp() { return active().mCSP; }
+	static KeyPrefetcher &keyPrefetcher() { return active().mKeyPrefetcher; }
+	static KeyPairPool &keyPairPool() { return active().mKeyPairPool; }
+	static WorkPool &workPool() { return active().mWorkPool; }
 
 public:
 	//
@@ -153,6 +165,34 @@ public:
 	{ MachServer::active().releaseWhenDone(alloc, memory); }
 	static void releaseWhenDone(void *memory)
 	{ releaseWhenDone(Allocator::standard(), memory); }
+	
+	// Request classes. Fast requests stay on the main worker pool; the others
+	// are deferred to their own lanes so they can't crowd out fast ones.
+	enum Lane {
+		fastLane,						// main pool (default)
+		cryptoLane,						// CPU-heavy (key pair generation, PBKDF2)
+		externalLane					// waits on SecurityAgent, authorizationhost or tokend
+	};
+	static bool deferTo(Lane lane);
+	bool handleDeferred(RequestLane &lane, mach_msg_header_t *request); // true if it went long-term
+	void dumpLanes();
+	
+	// about to block for long (on SecurityAgent, tokend, etc.); works on lane threads, too
+	// (use this, not MachServer::longTermActivity, which knows nothing of lanes)
+	void longTermWait();
+	
+	// kill a node dismantled from the mesh (on the Reaper's thread); returns References killed
+	size_t tearDown(NodeCore &node);
+	void dumpReaper();
+	
+	// registered roots of the object mesh (for MeshSnapshot): connections and processes
+	void meshRoots(std::vector<RefPointer<NodeCore> > &roots);
+	
+	// make active() work on a thread that isn't one of our (MachServer) threads
+	void attachThread();
+	
+	// the raw request message this thread is working on (NULL if none)
+	static const mach_msg_header_t *currentRequest();
     
 protected:
     // implementation methods of MachServer
@@ -163,6 +203,8 @@ protected:
 	void eventDone();
 
 private:
+	using MachServer::longTermActivity;	// (not for our callers; see longTermWait)
+
 	class SleepWatcher : public MachPlusPlus::PortPowerWatcher {
 	public:
 		void systemWillSleep();
@@ -188,6 +230,9 @@ public:
 	Process *findPid(pid_t pid) const;
 
 	void verbosity(unsigned int v) { mVerbosity = v; }
+	void prefetchKeys(bool on) { mKeyPrefetcher.enable(on); } // background key decoding
+	bool keyPairPools(const char *spec) { return mKeyPairPool.configure(spec); } // pre-generated key pairs
+	void legacyBlobs(bool on) { mLegacyBlobs = on; }	// write pre-AES-GCM blob formats (default)
 	void waitForClients(bool waiting);				// set waiting behavior
 	void beginShutdown();							// start delayed shutdown if configured
 	bool shuttingDown() const { return mShuttingDown; }
@@ -199,10 +244,12 @@ private:
 	std::string mBootstrapName;
 	
 	// connection map (by client reply port)
+	// These registries are lock-striped and are NOT protected by the Server lock.
+	// The Server lock still serializes process creation in setupConnection.
 	PortMap<Connection> mConnections;
 
 	// process map (by process task port)
-	typedef std::map<pid_t, Process *> PidMap;
+	typedef StripedMap<pid_t, Process *> PidMap;
 	PortMap<Process> mProcesses;					// strong reference
 	PidMap mPids;									// weak reference (subsidiary to mProcesses)
 	
@@ -211,6 +258,31 @@ private:
 	// and returned by connection(bool).
 	ThreadNexus<RefPointer<Connection> > mCurrentConnection;
 	
+	// Raw request being handled (per thread), and the lanes that requests
+	// received by the main pool can be deferred to
+	struct RequestState {
+		RequestState() : message(NULL), deferrable(false), lane(NULL), longTerm(false) { }
+		mach_msg_header_t *message;		// request being handled
+		bool deferrable;				// on a main-pool thread (not on a lane)
+		RequestLane *lane;				// lane we're running the request for (if any)
+		bool longTerm;					// ... and we've told it of a long-term wait
+	};
+	ThreadNexus<RequestState> mCurrentRequest;
+	RequestLane mCryptoLane;
+	RequestLane mExternalLane;
+	
+	// background teardown of dead clients
+	Reaper mReaper;
+	
+	// background decoding of keychain keys after unlock
+	KeyPrefetcher mKeyPrefetcher;
+	
+	// pre-generated key pairs
+	KeyPairPool mKeyPairPool;
+	
+	// threads for work that a request splits up (e.g. trying many keychains)
+	WorkPool mWorkPool;
+	
     // CSSM components
     CssmClient::Cssm mCssm;				// CSSM instance
     CssmClient::Module mCSPModule;		// CSP module
@@ -221,13 +293,14 @@ private:
 	
 	// busy state for primary state authority
 	unsigned int mVerbosity;
+	bool mLegacyBlobs;
 	bool mWaitForClients;
 	bool mShuttingDown;
 };
 
 
 //
-// A StLock that (also) declares a longTermActivity (only) once it's been entered.
+// A StLock that (also) declares a long-term wait (only) once it's been entered.
 //
 class LongtermStLock : public StLock<Mutex> {
 public:
@@ -205,6 +205,19 @@ void Session::invalidateAuthHosts()
         it->second->invalidateSessionAuthHosts();
 }
 
+//
+// Take a snapshot of all current sessions.
+// The session lock is held only while copying.
+//
+void Session::allSessions(std::vector<RefPointer<Session> > &sessions)
+{
+	StLock<Mutex> _(mSessionLock);
+	sessions.reserve(sessions.size() + mSessions.size());
+	for (SessionMap::const_iterator it = mSessions.begin(); it != mSessions.end(); it++)
+		sessions.push_back(it->second);
+}
+
+
 //
 // On system sleep, call sleepProcessing on all DbCommons of all Sessions
 //
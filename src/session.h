@@ -157,6 +157,7 @@ public:
 	static Session &find(SessionId id, bool create);	// find and optionally create
     template <class SessionType> static SessionType &find(SecuritySessionId id);
 	static void destroy(SessionId id);
+	static void allSessions(std::vector<RefPointer<Session> > &sessions); // snapshot of all sessions
 
 protected:
 	typedef std::map<SessionId, RefPointer<Session> > SessionMap;
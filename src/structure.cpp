@@ -26,6 +26,7 @@
 // structure - structural framework for securityd objects
 //
 #include "structure.h"
+#include <malloc/malloc.h>
 
 
 //
@@ -34,6 +35,11 @@
 //
 NodeCore::~NodeCore()
 {
+	assert(mRefBucket == NULL);		// references hold us alive
+	for (BucketVector::const_iterator it = mBuckets.begin(); it != mBuckets.end(); it++) {
+		assert((*it)->count == 0);
+		delete *it;
+	}
 #if defined(DEBUGDUMP)
 	StLock<Mutex> _(mCoreLock);
 	mCoreNodes.erase(this);
@@ -66,18 +72,68 @@ void NodeCore::clearReferent()
 }
 
 
+//
+// Find the References bucket for a member type.
+// There are only ever a few of these per node, so a linear search is fine.
+//
+NodeCore::Bucket *NodeCore::bucketFor(const std::type_info &type, bool create)
+{
+	for (BucketVector::const_iterator it = mBuckets.begin(); it != mBuckets.end(); it++)
+		if (*(*it)->type == type)
+			return *it;
+	if (!create)
+		return NULL;
+	Bucket *bucket = new Bucket(type);
+	mBuckets.push_back(bucket);
+	return bucket;
+}
+
+
 void NodeCore::addReference(NodeCore &p)
 {
 	StLock<Mutex> _(*this);
 	assert(p.mReferent == this);
-	mReferences.insert(&p);
+	if (p.mRefBucket)
+		return;		// already a reference (adding is idempotent)
+	Bucket *bucket = bucketFor(typeid(p), true);
+	p.ref();		// the References list holds p alive
+	p.mRefBucket = bucket;
+	p.mPrevRef = NULL;
+	p.mNextRef = bucket->first;
+	if (bucket->first)
+		bucket->first->mPrevRef = &p;
+	bucket->first = &p;
+	bucket->count++;
 }
 
 void NodeCore::removeReference(NodeCore &p)
 {
 	StLock<Mutex> _(*this);
 	assert(hasReference(p));
-	mReferences.erase(&p);
+	unlinkReference(p);
+}
+
+
+//
+// Take p off my References and drop the list's hold on it.
+// This may destroy p. The caller must hold my lock.
+//
+void NodeCore::unlinkReference(NodeCore &p)
+{
+	Bucket *bucket = p.mRefBucket;
+	if (!bucket)
+		return;
+	if (p.mPrevRef)
+		p.mPrevRef->mNextRef = p.mNextRef;
+	else
+		bucket->first = p.mNextRef;
+	if (p.mNextRef)
+		p.mNextRef->mPrevRef = p.mPrevRef;
+	bucket->count--;
+	p.mRefBucket = NULL;
+	p.mPrevRef = p.mNextRef = NULL;
+	if (p.unref() == 0)
+		delete &p;
 }
 
 #if !defined(NDEBUG)
@@ -85,7 +141,7 @@ void NodeCore::removeReference(NodeCore &p)
 bool NodeCore::hasReference(NodeCore &p)
 {
 	assert(p.refCountForDebuggingOnly() > 0);
-	return mReferences.find(&p) != mReferences.end();
+	return p.mRefBucket && p.mReferent == this;
 }
 
 #endif //NDEBUG
@@ -99,8 +155,32 @@ void NodeCore::clearReferences()
 {
 	StLock<Mutex> _(*this);
 	secdebug("ssnode", "%p clearing all %d references",
-		this, int(mReferences.size()));
-	mReferences.erase(mReferences.begin(), mReferences.end());
+		this, int(referenceCount()));
+	for (BucketVector::const_iterator it = mBuckets.begin(); it != mBuckets.end(); it++)
+		while (NodeCore *node = (*it)->first)
+			unlinkReference(*node);
+}
+
+size_t NodeCore::referenceCount() const
+{
+	StLock<Mutex> _(const_cast<NodeCore &>(*this));
+	size_t count = 0;
+	for (BucketVector::const_iterator it = mBuckets.begin(); it != mBuckets.end(); it++)
+		count += (*it)->count;
+	return count;
+}
+
+
+//
+// Estimate the memory held by this node: its own heap block (as found through
+// its most-derived address, so this works for any base) plus its bucket table.
+// Nodes that own substantial outside storage should add it in.
+//
+size_t NodeCore::memoryEstimate() const
+{
+	size_t size = malloc_size(dynamic_cast<const void *>(this));	// (0 if not heap allocated)
+	size += mBuckets.capacity() * sizeof(Bucket *) + mBuckets.size() * sizeof(Bucket);
+	return size;
 }
 
 
@@ -110,11 +190,18 @@ void NodeCore::clearReferences()
 // This is where you should release ports, close files, etc.
 // This default behavior, which you MUST include in your override,
 // propagates kills to all active references, recursively.
+// We kill from a snapshot of the References, so a reference may safely
+// unlink itself (or others) from us while it dies.
 //
 void NodeCore::kill()
 {
 	StLock<Mutex> _(*this);
-	for (ReferenceSet::const_iterator it = mReferences.begin(); it != mReferences.end(); it++)
+	std::vector<RefPointer<NodeCore> > victims;
+	victims.reserve(referenceCount());
+	for (BucketVector::const_iterator b = mBuckets.begin(); b != mBuckets.end(); b++)
+		for (NodeCore *node = (*b)->first; node; node = node->mNextRef)
+			victims.push_back(node);
+	for (std::vector<RefPointer<NodeCore> >::const_iterator it = victims.begin(); it != victims.end(); it++)
 		(*it)->kill();
 	clearReferences();
 }
@@ -124,8 +211,56 @@ void NodeCore::kill(NodeCore &ref)
 {
 	StLock<Mutex> _(*this);
 	assert(hasReference(ref));
+	RefPointer<NodeCore> victim = &ref;		// (unlinking may otherwise destroy it)
+	ref.kill();
+	unlinkReference(ref);
+}
+
+
+//
+// Kill ref if it's still one of my References. Someone else may kill it (or
+// kill me, which kills it too) while our caller isn't holding my lock; then
+// there's nothing left to do, and we say so.
+//
+bool NodeCore::killIfReference(NodeCore &ref)
+{
+	StLock<Mutex> _(*this);
+	if (!ref.mRefBucket || ref.mReferent != this)
+		return false;
+	RefPointer<NodeCore> victim = &ref;		// (unlinking may otherwise destroy it)
 	ref.kill();
-	removeReference(ref);
+	unlinkReference(ref);
+	return true;
+}
+
+
+//
+// Kill one node at the far end of my References tree (one that has no
+// References of its own), and return true; or return false if I have no
+// References left. Calling this until it returns false and then calling kill()
+// tears down the same tree kill() would, but a piece at a time, with each lock
+// held only for the death of one node. Note that this kills a subtree's leaves
+// before its root, so it should only be used where the nodes in the subtree do
+// not need their kill() overrides to run before their References die.
+//
+bool NodeCore::killLeafReference()
+{
+	RefPointer<NodeCore> ref;
+	{
+		StLock<Mutex> _(*this);
+		for (BucketVector::const_iterator b = mBuckets.begin(); b != mBuckets.end() && !ref; b++)
+			ref = (*b)->first;
+	}
+	if (!ref)
+		return false;
+	if (ref->killLeafReference())
+		return true;				// made progress further down
+	StLock<Mutex> _(*this);
+	if (ref->mRefBucket && ref->mReferent == this) {	// (still ours)
+		ref->kill();
+		unlinkReference(*ref);
+	}
+	return true;
 }
 
 
@@ -143,7 +278,8 @@ Mutex NodeCore::mCoreLock;
 
 // add a new NodeCore to the known set
 NodeCore::NodeCore()
-	: Mutex(Mutex::recursive)
+	: Mutex(Mutex::recursive), mCreated(Time::now()),
+	  mRefBucket(NULL), mPrevRef(NULL), mNextRef(NULL)
 {
 	StLock<Mutex> _(mCoreLock);
 	mCoreNodes.insert(this);
@@ -165,13 +301,14 @@ void NodeCore::dumpNode()
 void NodeCore::dump()
 {
  dumpNode();
-	if (!mReferences.empty()) {
+	if (referenceCount() > 0) {
 		Debug::dump(" {");
-		for (ReferenceSet::const_iterator it = mReferences.begin(); it != mReferences.end(); it++) {
-			Debug::dump(" %p", it->get());
-			if ((*it)->mReferent != this)
-				Debug::dump("!*INVALID*");
-		}
+		for (BucketVector::const_iterator b = mBuckets.begin(); b != mBuckets.end(); b++)
+			for (NodeCore *node = (*b)->first; node; node = node->mNextRef) {
+				Debug::dump(" %p", node);
+				if (node->mReferent != this)
+					Debug::dump("!*INVALID*");
+			}
 		Debug::dump(" }");
 	}
 	Debug::dump("\n");
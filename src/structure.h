@@ -30,9 +30,12 @@
 
 #include <security_utilities/refcount.h>
 #include <security_utilities/mach++.h>
-#include <security_cdsa_utilities/u32handleobject.h>
+#include <security_utilities/timeflow.h>
 #include <map>
+#include <vector>
+#include <typeinfo>
 #include "dtrace.h"
+#include "handles.h"
 
 using MachPlusPlus::Port;
 
@@ -66,13 +69,28 @@ class PerGlobal;
 //  References means that a kill() on the referent will (recursively) kill
 //  all references, too.
 //
+// Since a node has at most one referent, it is a member of at most one
+// References set, so the set is kept as intrusive lists threaded through
+// the member nodes themselves (no allocation per reference). Each list
+// holds a counted reference to its members. The lists are bucketed by the
+// (dynamic) type of their members, so typed scans (allReferences, findFirst)
+// decide type membership with one dynamic_cast per bucket rather than one per
+// reference. So add a node to a References set only once it has its final type
+// (i.e. from its most-derived constructor, or later). Scans still compare each
+// member's type with its bucket's, so a node added too early is cast correctly,
+// just more slowly (see BucketScan).
+//
+// The node lock is recursive because Node subclasses lock themselves and
+// then chain to their base kill(); the mesh code itself does not rely on that.
+//
 // Do not inherit directly from NodeCore; use Node<> (below).
 //
 class NodeCore : public RefCount, public Mutex {
 	template <class Base, class Glob> friend class Node;
 public:
 #if !defined(DEBUGDUMP) // (see below if DEBUGDUMP)
-	NodeCore() : Mutex(Mutex::recursive) { }
+	NodeCore() : Mutex(Mutex::recursive), mCreated(Time::now()),
+		mRefBucket(NULL), mPrevRef(NULL), mNextRef(NULL) { }
 #endif
 	virtual ~NodeCore();
 
@@ -85,9 +103,18 @@ public:
 	template <class Sub, class Value>
 	RefPointer<Sub> findFirst(Value (Sub::*func)() const, Value compare);
 	void clearReferences();
+	size_t referenceCount() const;
+	template <class Action>
+	void forEachReference(Action &action);
+	
+	// introspection (see MeshSnapshot)
+	Time::Absolute created() const { return mCreated; }
+	virtual size_t memoryEstimate() const;	// bytes attributable to this node
 
 	virtual void kill();				// kill all references and self
 	virtual void kill(NodeCore &ref);	// kill ref from my references()
+	bool killIfReference(NodeCore &ref); // same, unless ref is gone already (false)
+	bool killLeafReference();			// kill one leaf of my References tree (incremental teardown)
 
 	// for STL ordering (so we can have sets of RefPointers of NodeCores)
 	bool operator < (const NodeCore &other) const
@@ -104,8 +131,27 @@ protected:
 private:
 	RefPointer<NodeCore> mParent;
 	RefPointer<NodeCore> mReferent;
-	typedef set<RefPointer<NodeCore> > ReferenceSet;
-	ReferenceSet mReferences;
+	Time::Absolute mCreated;		// when this node was made
+	
+	// one References list per member type
+	struct Bucket {
+		Bucket(const std::type_info &t) : type(&t), first(NULL), count(0) { }
+		const std::type_info *type;	// (dynamic) type of all members
+		NodeCore *first;			// first member (linked through mNextRef)
+		size_t count;				// number of members
+	};
+	typedef std::vector<Bucket *> BucketVector;
+	BucketVector mBuckets;			// my References, by type (owned)
+	
+	// my membership in my referent's References (guarded by the referent's lock)
+	Bucket *mRefBucket;				// bucket I'm in, or NULL if not referenced
+	NodeCore *mPrevRef;				// previous member of mRefBucket
+	NodeCore *mNextRef;				// next member of mRefBucket
+	
+	Bucket *bucketFor(const std::type_info &type, bool create);
+	void unlinkReference(NodeCore &p);	// (caller holds lock)
+	
+	template <class Sub> class BucketScan;
 	
 	IFDEBUG(bool hasReference(NodeCore &p));
 	
@@ -123,6 +169,37 @@ public: // dump support
 };
 
 
+//
+// Find the members of a References bucket that are of type Sub.
+// Members that have the bucket's type are all Subs or none are, so one
+// dynamic_cast answers for all of them; Sub must be a non-virtual subclass of
+// NodeCore, so that they can then be static_cast to it. A member of another
+// type (added to the bucket before it had its final type) gets its own
+// dynamic_cast. Comparing a member's type with the bucket's is cheap.
+//
+template <class Sub>
+class NodeCore::BucketScan {
+public:
+	BucketScan(const Bucket &bucket) : mType(*bucket.type), mDecided(false), mMatches(false) { }
+	
+	Sub *operator () (NodeCore *node)
+	{
+		if (typeid(*node) != mType)
+			return dynamic_cast<Sub *>(node);
+		if (!mDecided) {
+			mMatches = dynamic_cast<Sub *>(node) != NULL;
+			mDecided = true;
+		}
+		return mMatches ? static_cast<Sub *>(node) : NULL;
+	}
+
+private:
+	const std::type_info &mType;
+	bool mDecided;
+	bool mMatches;
+};
+
+
 //
 // Call a member on each reference of a Node<> object.
 // The object lock is held throughout, and we keep a RefPointer to each object
@@ -133,9 +210,38 @@ template <class Sub>
 void NodeCore::allReferences(void (Sub::*func)())
 {
 	StLock<Mutex> _(*this);
-	for (ReferenceSet::const_iterator it = mReferences.begin(); it != mReferences.end();)
-		if (RefPointer<Sub> sub = dynamic_cast<Sub *>((it++)->get()))
-			(sub->*func)();
+	for (BucketVector::const_iterator b = mBuckets.begin(); b != mBuckets.end(); b++) {
+		BucketScan<Sub> scan(**b);
+		std::vector<RefPointer<Sub> > subs;
+		for (NodeCore *node = (*b)->first; node; node = node->mNextRef)
+			if (Sub *sub = scan(node))
+				subs.push_back(sub);
+		for (typename std::vector<RefPointer<Sub> >::const_iterator it = subs.begin(); it != subs.end(); it++)
+			((*it)->*func)();
+	}
+}
+
+
+//
+// Call action(NodeCore &) on each reference, in no particular order.
+// Unlike allReferences, the object lock is only held while taking a snapshot
+// of the References, not while the action runs. Thus the action may lock
+// (or walk) other nodes freely, but it may see references that have been
+// removed in the meantime.
+//
+template <class Action>
+void NodeCore::forEachReference(Action &action)
+{
+	std::vector<RefPointer<NodeCore> > refs;
+	{
+		StLock<Mutex> _(*this);
+		refs.reserve(referenceCount());
+		for (BucketVector::const_iterator b = mBuckets.begin(); b != mBuckets.end(); b++)
+			for (NodeCore *node = (*b)->first; node; node = node->mNextRef)
+				refs.push_back(node);
+	}
+	for (std::vector<RefPointer<NodeCore> >::const_iterator it = refs.begin(); it != refs.end(); it++)
+		action(**it);
 }
 
 
@@ -150,10 +256,13 @@ template <class Sub, class Value>
 RefPointer<Sub> NodeCore::findFirst(Value (Sub::*func)() const, Value compare)
 {
 	StLock<Mutex> _(*this);
-	for (ReferenceSet::const_iterator it = mReferences.begin(); it != mReferences.end(); it++)
-		if (Sub *sub = dynamic_cast<Sub *>(it->get()))
-			if ((sub->*func)() == compare)
-				return sub;
+	for (BucketVector::const_iterator b = mBuckets.begin(); b != mBuckets.end(); b++) {
+		BucketScan<Sub> scan(**b);
+		for (NodeCore *node = (*b)->first; node; node = node->mNextRef)
+			if (Sub *sub = scan(node))
+				if ((sub->*func)() == compare)
+					return sub;
+	}
 	return NULL;
 }
 
@@ -195,7 +304,7 @@ public:
 //
 // Process (client process) layer nodes
 //
-class PerProcess : public U32HandleObject, public Node<PerProcess, PerSession> {
+class PerProcess : public ClientHandleObject, public Node<PerProcess, PerSession> {
 public:	
 };
 
@@ -217,42 +326,132 @@ public:
 
 
 //
-// A map from mach port names to (refcounted) pointers-to-somethings
+// A lock-striped map.
+// Entries are spread over a fixed set of independently locked stripes (by a
+// cheap hash of the key), so lookups of unrelated keys neither contend with
+// each other nor with whatever lock their owner may be holding. Each operation
+// is atomic with respect to its key; there is no atomicity across keys.
+// Value must be cheaply copyable; lookups return a copy made under the stripe
+// lock (so a RefPointer Value keeps its object alive after a concurrent remove).
 //
-template <class Node>
-class PortMap : public Mutex, public std::map<Port, RefPointer<Node> > {
-	typedef std::map<Port, RefPointer<Node> > _Map;
+template <class Key, class Value, unsigned stripeCount = 16>
+class StripedMap {
+	typedef std::map<Key, Value> Map;
+	struct Stripe : public Mutex {
+		Map map;
+	};
+	
 public:
-	bool contains(mach_port_t port) const   { return this->find(port) != this->end(); }
-	Node *getOpt(mach_port_t port) const
+	bool contains(Key key) const
+	{
+		const Stripe &s = stripe(key);
+		StLock<Mutex> _(const_cast<Stripe &>(s));
+		return s.map.find(key) != s.map.end();
+	}
+	
+	Value getOpt(Key key) const
 	{
-		typename _Map::const_iterator it = this->find(port);
-		return (it == this->end()) ? NULL : it->second;
+		const Stripe &s = stripe(key);
+		StLock<Mutex> _(const_cast<Stripe &>(s));
+		typename Map::const_iterator it = s.map.find(key);
+		return (it == s.map.end()) ? Value() : it->second;
 	}
 	
-	Node *get(mach_port_t port) const
+	// add a new entry; returns false (and changes nothing) if key is already present
+	bool insert(Key key, const Value &value)
 	{
-		typename _Map::const_iterator it = this->find(port);
-		assert(it != this->end());
-		return it->second;
+		Stripe &s = stripe(key);
+		StLock<Mutex> _(s);
+		return s.map.insert(typename Map::value_type(key, value)).second;
 	}
 	
-	Node *get(mach_port_t port, OSStatus error) const
+	// remove an entry and return its (former) value, or Value() if not present
+	Value remove(Key key)
 	{
-		typename _Map::const_iterator it = this->find(port);
-		if (it == this->end())
+		Stripe &s = stripe(key);
+		StLock<Mutex> _(s);
+		typename Map::iterator it = s.map.find(key);
+		if (it == s.map.end())
+			return Value();
+		Value value = it->second;
+		s.map.erase(it);
+		return value;
+	}
+	
+	// approximate (not a snapshot) if there are concurrent modifications
+	size_t size() const
+	{
+		size_t count = 0;
+		for (unsigned n = 0; n < stripeCount; n++) {
+			StLock<Mutex> _(const_cast<Stripe &>(mStripes[n]));
+			count += mStripes[n].map.size();
+		}
+		return count;
+	}
+	
+	// call action(key, value) for each entry, one stripe lock at a time
+	template <class Action>
+	void forEach(Action &action) const
+	{
+		for (unsigned n = 0; n < stripeCount; n++) {
+			StLock<Mutex> _(const_cast<Stripe &>(mStripes[n]));
+			for (typename Map::const_iterator it = mStripes[n].map.begin(); it != mStripes[n].map.end(); it++)
+				action(it->first, it->second);
+		}
+	}
+
+private:
+	// Mach port names carry their (highly regular) index in the upper 24 bits;
+	// fold and scramble so consecutive names land in different stripes.
+	static unsigned stripeIndex(Key key)
+	{
+		uint32_t k = uint32_t(key);
+		k ^= k >> 8;
+		return ((k * 2654435761U) >> 16) % stripeCount;
+	}
+	Stripe &stripe(Key key)				{ return mStripes[stripeIndex(key)]; }
+	const Stripe &stripe(Key key) const	{ return mStripes[stripeIndex(key)]; }
+
+	Stripe mStripes[stripeCount];
+};
+
+
+//
+// A map from mach port names to (refcounted) pointers-to-somethings.
+// This is lock-striped (see above); callers do not need to hold any lock.
+//
+template <class Node>
+class PortMap : public StripedMap<Port, RefPointer<Node> > {
+	typedef StripedMap<Port, RefPointer<Node> > _Map;
+public:
+	RefPointer<Node> get(mach_port_t port) const
+	{
+		RefPointer<Node> node = this->getOpt(port);
+		assert(node);
+		return node;
+	}
+	
+	RefPointer<Node> get(mach_port_t port, OSStatus error) const
+	{
+		RefPointer<Node> node = this->getOpt(port);
+		if (!node)
 			MacOSError::throwMe(error);
-		return it->second;
+		return node;
 	}
 	
 	void dump();
+
+private:
+	struct Dumper {
+		void operator () (Port, const RefPointer<Node> &node) { node->dump(); }
+	};
 };
 
 template <class Node>
 void PortMap<Node>::dump()
 {
-	for (typename _Map::const_iterator it = this->begin(); it != this->end(); it++)
-		it->second->dump();
+	Dumper dumper;
+	this->forEach(dumper);
 }
 
 
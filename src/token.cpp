@@ -204,7 +204,7 @@ void Token::insert(::Reader &slot, RefPointer<TokenDaemon> tokend)
 {
 	try {
 		// this might take a while...
-		Server::active().longTermActivity();
+		Server::active().longTermWait();
 		referent(slot);
 		mState = slot.pcscState();
 		
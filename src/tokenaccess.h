@@ -48,10 +48,10 @@ inline TokenKey &myKey(Key &key)
 class Access : public Token::Access {
 public:
 	Access(Token &token) : Token::Access(token), mIteration(0)
-	{ Server::active().longTermActivity(); }
+	{ Server::active().longTermWait(); }
 	template <class Whatever>
 	Access(Token &token, Whatever &it) : Token::Access(token)
-	{ add(it); Server::active().longTermActivity(); }
+	{ add(it); Server::active().longTermWait(); }
 	
 	void operator () (const CssmError &err);
 	using Token::Access::operator ();
@@ -815,7 +815,8 @@ void TokenDatabase::InputKey::setup(Key *key)
 	} else if (LocalKey *hisKey = dynamic_cast<LocalKey *>(key)) {
 		// a local key - turn into raw form
 		CssmClient::WrapKey wrap(Server::csp(), CSSM_ALGID_NONE);
-		wrap(hisKey->cssmKey(), mKey);
+		CssmClient::Key cspKey = hisKey->key();
+		wrap(static_cast<const CssmKey &>(*cspKey), mKey);
 		mKeyHandle = noKey;
 		mKeyPtr = &mKey;
 	} else {
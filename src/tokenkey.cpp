@@ -27,6 +27,7 @@
 //
 #include "tokenkey.h"
 #include "tokendatabase.h"
+#include "reqtrace.h"
 
 
 //
@@ -87,6 +88,7 @@ CSSM_KEYATTR_FLAGS TokenKey::attributes()
 void TokenKey::returnKey(Handle &h, CssmKey::Header &hdr)
 {
 	h = this->handle();
+	RequestTrace::handleOut(h);
 	hdr = mHeader;
 }
 
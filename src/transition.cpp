@@ -39,6 +39,8 @@
 #include "tokendatabase.h"
 #include "kckey.h"
 #include "child.h"
+#include "reqstats.h"
+#include "reqtrace.h"
 #include <syslog.h>
 #include <mach/mach_error.h>
 #include <securityd_client/xdr_cssm.h>
@@ -56,7 +58,8 @@
 	audit_token_t auditToken, CSSM_RETURN *rcode
 
 #define BEGIN_IPCN	*rcode = CSSM_OK; try {
-#define BEGIN_IPC(name)	BEGIN_IPCN RefPointer<Connection> connRef(&Server::connection(replyPort, auditToken)); \
+#define BEGIN_IPC(name)	RequestStatistics::Timer requestTimer(#name, replyPort, rcode); \
+		BEGIN_IPCN RefPointer<Connection> connRef(&Server::connection(replyPort, auditToken)); \
 		Connection &connection __attribute__((unused)) = *connRef; \
 		if (SECURITYD_REQUEST_ENTRY_ENABLED()) { \
 			const char * volatile s = #name; volatile char __attribute__((unused)) pagein = s[0]; \
@@ -70,6 +73,19 @@
 	catch (Connection *conn) { *rcode = 0; } \
 	catch (...) { *rcode = CssmError::merge(CSSM_ERRCODE_INTERNAL_ERROR, CSSM_ ## base ## _BASE_ERROR); }
 
+//
+// Requests that are CPU-heavy, or likely to wait on something outside securityd
+// (SecurityAgent, authorizationhost, tokend) start with DEFER_TO_LANE, which moves
+// them onto a separate request lane and frees the receiving pool thread for
+// quick requests (see requestlane.h). Everything else runs on the main pool.
+// Requests that are apt to prompt the user belong on the external lane. Those on
+// the crypto lane only prompt to unlock a locked keychain; while they do, they
+// don't hold up the crypto lane (see RequestLane).
+//
+#define DEFER_TO_LANE_IF(lane, cond) \
+	if ((cond) && Server::deferTo(Server::lane)) return MIG_NO_REPLY;
+#define DEFER_TO_LANE(lane)	DEFER_TO_LANE_IF(lane, true)
+
 #define BEGIN_IPCS		try {
 #define	END_IPCS(more)	} catch (...) { } \
 						mach_port_deallocate(mach_task_self(), serverPort); more; return KERN_SUCCESS;
@@ -216,6 +232,21 @@ Database *pickDb(Database *db1, Database *db2)
 	return Server::optionalDatabase(noDb);
 }
 
+
+//
+// Note the handles a search request hands out for the request trace.
+// Searches don't always produce all three; missing ones are zero.
+//
+static void traceHandlesOut(uint32 record, uint32 search, uint32 key)
+{
+	if (record)
+		RequestTrace::handleOut(record);
+	if (search)
+		RequestTrace::handleOut(search);
+	if (key)
+		RequestTrace::handleOut(key);
+}
+
 //
 // Setup/Teardown functions.
 //
@@ -317,9 +348,11 @@ kern_return_t ucsp_server_setDbName(UCSP_ARGS, DbHandle db, const char *name)
 kern_return_t ucsp_server_openToken(UCSP_ARGS, uint32 ssid, FilePath name,
 	DATA_IN(accessCredentials), DbHandle *db)
 {
+	DEFER_TO_LANE(externalLane)
 	BEGIN_IPC(openToken)
 	CopyOutAccessCredentials creds(accessCredentials, accessCredentialsLength);
 	*db = (new TokenDatabase(ssid, connection.process(), name, creds))->handle();
+	RequestTrace::handleOut(*db);
 	END_IPC(DL)
 }
 
@@ -351,6 +384,7 @@ kern_return_t ucsp_server_findFirst(UCSP_ARGS, DbHandle db,
 		*hRecord = record->handle();
 		*hSearch = search->handle();
 		*hKey = key ? key->handle() : noKey;
+		traceHandlesOut(*hRecord, *hSearch, *hKey);
 
         if (outAttrsLength && outAttrs) {
             Server::releaseWhenDone(outAttrs); // exception proof it against next line
@@ -399,6 +433,7 @@ kern_return_t ucsp_server_findNext(UCSP_ARGS, SearchHandle hSearch,
 		// return handles
 		*hRecord = record->handle();
 		*hKey = key ? key->handle() : noKey;
+		traceHandlesOut(*hRecord, noKey, *hKey);
 
         if (outAttrsLength && outAttrs) {
 			secdebug("attrmem", "Found attrs: %p of length: %d", outAttrs, outAttrsLength);
@@ -439,6 +474,7 @@ kern_return_t ucsp_server_findRecordHandle(UCSP_ARGS, IPCRecordHandle hRecord,
 	
 	// return handles
 	*hKey = key ? key->handle() : noKey;
+	traceHandlesOut(noKey, noKey, *hKey);
 
     if (outAttrsLength && outAttrs) {
         Server::releaseWhenDone(outAttrs); // exception proof it against next line
@@ -521,16 +557,20 @@ kern_return_t ucsp_server_releaseRecord(UCSP_ARGS, IPCRecordHandle hRecord)
 
 //
 // Internal database management
+// (Creating a keychain may ask the user for its passphrase, so it goes to the
+// external lane, not the crypto lane.)
 //
 kern_return_t ucsp_server_createDb(UCSP_ARGS, DbHandle *db,
 	DATA_IN(ident), DATA_IN(cred), DATA_IN(owner),
     DBParameters params)
 {
+	DEFER_TO_LANE(externalLane)
 	BEGIN_IPC(createDb)
 	CopyOutAccessCredentials creds(cred, credLength);
 	CopyOutEntryAcl owneracl(owner, ownerLength);
 	CopyOut flatident(ident, identLength, reinterpret_cast<xdrproc_t>(xdr_DLDbFlatIdentifierRef));
 	*db = (new KeychainDatabase(*reinterpret_cast<DLDbFlatIdentifier*>(flatident.data()), params, connection.process(), creds, owneracl))->handle();
+	RequestTrace::handleOut(*db);
 	END_IPC(DL)
 }
 
@@ -540,6 +580,7 @@ kern_return_t ucsp_server_recodeDbForSync(UCSP_ARGS, DbHandle dbToClone,
 	BEGIN_IPC(recodeDbForSync)
 	RefPointer<KeychainDatabase> srcKC = Server::keychain(srcDb);
 	*newDb = (new KeychainDatabase(*srcKC, connection.process(), dbToClone))->handle();
+	RequestTrace::handleOut(*newDb);
 	END_IPC(DL)
 }
 
@@ -601,6 +642,7 @@ kern_return_t ucsp_server_decodeDb(UCSP_ARGS, DbHandle *db,
 	
 	*db = (new KeychainDatabase(id, SSBLOB(DbBlob, blob),
         connection.process(), creds))->handle();
+	RequestTrace::handleOut(*db);
 	END_IPC(DL)
 }
 
@@ -627,9 +669,47 @@ kern_return_t ucsp_server_getDbParameters(UCSP_ARGS, DbHandle db, DBParameters *
 	END_IPC(DL)
 }
 
+//
+// Unlocking or changing the passphrase of a keychain only goes to SecurityAgent
+// if the keychain is locked, or if the credentials ask for (or leave it to) a
+// prompt. Otherwise it's quick, and stays on the main pool.
+// These are just peeks for picking a lane: the request itself looks up the
+// keychain (with the usual checks) and reports any errors.
+//
+static bool unlockMayPrompt(DbHandle db)
+{
+	try {
+		return ClientHandleObject::findRef<KeychainDatabase>(db,
+			CSSMERR_DL_INVALID_DB_HANDLE)->isLocked();
+	} catch (...) {
+		return false;
+	}
+}
+
+static bool changePassphraseMayPrompt(DbHandle db, void *cred, mach_msg_type_number_t credLength)
+{
+	try {
+		CopyOutAccessCredentials creds(cred, credLength);
+		const AccessCredentials *cr = creds;
+		list<CssmSample> samples;
+		if (!cr || !cr->samples().collect(CSSM_SAMPLE_TYPE_KEYCHAIN_CHANGE_LOCK, samples))
+			return true;		// the default is to ask for the new passphrase
+		for (list<CssmSample>::iterator it = samples.begin(); it != samples.end(); it++) {
+			TypedList &sample = *it;
+			sample.checkProper();
+			if (sample.type() == CSSM_SAMPLE_TYPE_KEYCHAIN_PROMPT)
+				return true;
+		}
+		return unlockMayPrompt(db);
+	} catch (...) {
+		return false;
+	}
+}
+
 kern_return_t ucsp_server_changePassphrase(UCSP_ARGS, DbHandle db,
     DATA_IN(cred))
 {
+	DEFER_TO_LANE_IF(externalLane, changePassphraseMayPrompt(db, cred, credLength))
 	BEGIN_IPC(changePassphrase)
 	CopyOutAccessCredentials creds(cred, credLength);
 	Server::keychain(db)->changePassphrase(creds);
@@ -645,6 +725,7 @@ kern_return_t ucsp_server_lockAll (UCSP_ARGS, boolean_t)
 
 kern_return_t ucsp_server_unlockDb(UCSP_ARGS, DbHandle db)
 {
+	DEFER_TO_LANE_IF(externalLane, unlockMayPrompt(db))
 	BEGIN_IPC(unlockDb)
 	Server::keychain(db)->unlockDb();
 	END_IPC(DL)
@@ -652,6 +733,7 @@ kern_return_t ucsp_server_unlockDb(UCSP_ARGS, DbHandle db)
 
 kern_return_t ucsp_server_unlockDbWithPassphrase(UCSP_ARGS, DbHandle db, DATA_IN(passphrase))
 {
+	DEFER_TO_LANE(cryptoLane)
 	BEGIN_IPC(unlockDbWithPassphrase)
 	Server::keychain(db)->unlockDb(DATA(passphrase));
 	END_IPC(DL)
@@ -862,6 +944,7 @@ kern_return_t ucsp_server_generateKeyPair(UCSP_ARGS, DbHandle db, DATA_IN(contex
 	uint32 pubUsage, uint32 pubAttrs, uint32 privUsage, uint32 privAttrs,
 	KeyHandle *pubKey, DATA_OUT(pubHeader), KeyHandle *privKey, DATA_OUT(privHeader))
 {
+	DEFER_TO_LANE(cryptoLane)
 	BEGIN_IPC(generateKeyPair)
 	CopyOutContext ctx(context, contextLength);
 	CopyOutAccessCredentials creds(cred, credLength);
@@ -953,6 +1036,7 @@ kern_return_t ucsp_server_deriveKey(UCSP_ARGS, DbHandle db, DATA_IN(context), Ke
     DATA_IN(paramInput), DATA_OUT(paramOutput),
 	uint32 usage, uint32 attrs, KeyHandle *newKey, DATA_OUT(keyHeader))
 {
+	DEFER_TO_LANE(cryptoLane)
 	BEGIN_IPC(deriveKey)
 	CopyOutContext ctx(context, contextLength);
 	CopyOutAccessCredentials creds(cred, credLength);
@@ -1189,6 +1273,7 @@ kern_return_t ucsp_server_authorizationCreate(UCSP_ARGS,
 	void *inEnvironment, mach_msg_type_number_t inEnvironmentLength,
 	AuthorizationBlob *authorization)
 {
+	DEFER_TO_LANE_IF(externalLane, flags & kAuthorizationFlagInteractionAllowed)
 	BEGIN_IPC(authorizationCreate)
 	AuthorizationItemSet *authrights = NULL, *authenvironment = NULL;
 
@@ -1236,6 +1321,7 @@ kern_return_t ucsp_server_authorizationCopyRights(UCSP_ARGS,
 	void *inEnvironment, mach_msg_type_number_t inEnvironmentLength,
 	void **result, mach_msg_type_number_t *resultLength)
 {
+	DEFER_TO_LANE_IF(externalLane, flags & kAuthorizationFlagInteractionAllowed)
 	BEGIN_IPC(authorizationCopyRights)
 	AuthorizationItemSet *authrights = NULL, *authenvironment = NULL;
 
@@ -1388,6 +1474,7 @@ kern_return_t ucsp_server_authorizationdbGet(UCSP_ARGS, const char *rightname, D
 
 kern_return_t ucsp_server_authorizationdbSet(UCSP_ARGS, AuthorizationBlob authorization, const char *rightname, DATA_IN(rightDefinition))
 {
+	DEFER_TO_LANE(externalLane)
 	BEGIN_IPC(authorizationdbSet)
 	CFRef<CFDataRef> data(CFDataCreate(NULL, (UInt8 *)rightDefinition, rightDefinitionLength));
 
@@ -1448,6 +1535,38 @@ kern_return_t ucsp_server_setAlternateSystemRoot(UCSP_ARGS, const char *root)
 	END_IPC(CSSM)
 }
 
+//
+// Return a property list to the client as XML data (released after the reply)
+//
+static void copyOutPropertyList(CFPropertyListRef plist, void **xml, mach_msg_type_number_t *xmlLength)
+{
+	CFRef<CFDataRef> data(CFPropertyListCreateXMLData(NULL, plist));
+	if (!data)
+		CssmError::throwMe(CSSM_ERRCODE_INTERNAL_ERROR);
+	mach_msg_type_number_t length = CFDataGetLength(data);
+	void *xmlData = Allocator::standard().malloc(length);
+	memcpy(xmlData, CFDataGetBytePtr(data), length);
+	Server::releaseWhenDone(xmlData);
+	*xml = xmlData;
+	*xmlLength = length;
+}
+
+kern_return_t ucsp_server_getRequestStatistics(UCSP_ARGS, DATA_OUT(statistics))
+{
+	BEGIN_IPC(getRequestStatistics)
+	CFRef<CFDictionaryRef> stats(RequestStatistics::copyStatistics());
+	copyOutPropertyList(stats, statistics, statisticsLength);
+	END_IPC(CSSM)
+}
+
+kern_return_t ucsp_server_getStateSnapshot(UCSP_ARGS, DATA_OUT(snapshot))
+{
+	BEGIN_IPC(getStateSnapshot)
+	CFRef<CFDictionaryRef> census(MeshSnapshot().copyDictionary());
+	copyOutPropertyList(census, snapshot, snapshotLength);
+	END_IPC(CSSM)
+}
+
 
 //
 // Child check-in service.
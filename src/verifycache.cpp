@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// verifycache - remembered signature verification successes
+//
+#include "verifycache.h"
+#include <security_utilities/globalizer.h>
+#include <security_utilities/logging.h>
+#include <CommonCrypto/CommonDigest.h>
+
+
+VerifyCache::VerifyCache()
+	: mCapacity(0), mHits(0), mMisses(0), mEvictions(0), mInvalidations(0)
+{
+}
+
+static ModuleNexus<VerifyCache> sharedCache;
+
+VerifyCache &VerifyCache::shared()
+{
+	return sharedCache();
+}
+
+
+void VerifyCache::capacity(size_t entries)
+{
+	StLock<Mutex> _(*this);
+	mCapacity = entries;
+	while (mEntries.size() > mCapacity) {
+		remove(--mEntries.end());
+		mEvictions++;
+	}
+}
+
+
+//
+// A context qualifies if the key is all it carries
+//
+bool VerifyCache::cacheable(const Context &context)
+{
+	for (uint32 n = 0; n < context.NumberOfAttributes; n++)
+		if (context.ContextAttributes[n].AttributeType != CSSM_ATTRIBUTE_KEY)
+			return false;
+	return true;
+}
+
+
+//
+// Compute the tag of a verification. Fields are length-prefixed so
+// they can't run into each other.
+//
+static void hashField(CC_SHA256_CTX &ctx, const void *data, size_t length)
+{
+	uint32_t prefix = length;
+	CC_SHA256_Update(&ctx, &prefix, sizeof(prefix));
+	CC_SHA256_Update(&ctx, data, length);
+}
+
+void VerifyCache::tag(const CssmData &keyDigest, CSSM_ALGORITHMS algorithm,
+	CSSM_ALGORITHMS verifyOnlyAlgorithm, const CssmData &data, const CssmData &signature,
+	Tag &tag)
+{
+	uint8_t dataDigest[CC_SHA256_DIGEST_LENGTH], signatureDigest[CC_SHA256_DIGEST_LENGTH];
+	CC_SHA256(data.data(), data.length(), dataDigest);
+	CC_SHA256(signature.data(), signature.length(), signatureDigest);
+	
+	CC_SHA256_CTX ctx;
+	CC_SHA256_Init(&ctx);
+	hashField(ctx, keyDigest.data(), keyDigest.length());
+	hashField(ctx, &algorithm, sizeof(algorithm));
+	hashField(ctx, &verifyOnlyAlgorithm, sizeof(verifyOnlyAlgorithm));
+	hashField(ctx, dataDigest, sizeof(dataDigest));
+	hashField(ctx, signatureDigest, sizeof(signatureDigest));
+	CC_SHA256_Final(tag.hash, &ctx);
+}
+
+
+bool VerifyCache::verified(const Tag &tag)
+{
+	StLock<Mutex> _(*this);
+	std::map<Tag, Entries::iterator>::iterator it = mByTag.find(tag);
+	if (it == mByTag.end()) {
+		mMisses++;
+		return false;
+	}
+	mEntries.splice(mEntries.begin(), mEntries, it->second);	// now most recently used
+	mHits++;
+	return true;
+}
+
+void VerifyCache::remember(const Tag &tag, const CssmData &keyDigest)
+{
+	StLock<Mutex> _(*this);
+	if (mCapacity == 0 || mByTag.find(tag) != mByTag.end())
+		return;
+	if (mEntries.size() >= mCapacity) {
+		remove(--mEntries.end());
+		mEvictions++;
+	}
+	Entry entry;
+	entry.tag = tag;
+	entry.key = KeyId((const char *)keyDigest.data(), keyDigest.length());
+	mEntries.push_front(entry);
+	mByTag[tag] = mEntries.begin();
+	mByKey.insert(std::make_pair(entry.key, mEntries.begin()));
+}
+
+void VerifyCache::forget(const CssmData &keyDigest)
+{
+	StLock<Mutex> _(*this);
+	if (mByKey.empty())
+		return;
+	KeyId key((const char *)keyDigest.data(), keyDigest.length());
+	std::multimap<KeyId, Entries::iterator>::iterator it;
+	while ((it = mByKey.find(key)) != mByKey.end()) {
+		remove(it->second);
+		mInvalidations++;
+	}
+}
+
+
+//
+// Remove an entry from the list and both indices
+//
+void VerifyCache::remove(Entries::iterator entry)
+{
+	mByTag.erase(entry->tag);
+	typedef std::multimap<KeyId, Entries::iterator>::iterator KeyIterator;
+	std::pair<KeyIterator, KeyIterator> range = mByKey.equal_range(entry->key);
+	for (KeyIterator it = range.first; it != range.second; it++)
+		if (it->second == entry) {
+			mByKey.erase(it);
+			break;
+		}
+	mEntries.erase(entry);
+}
+
+
+VerifyCache::Statistics VerifyCache::statistics()
+{
+	StLock<Mutex> _(*this);
+	Statistics stats;
+	stats.hits = mHits;
+	stats.misses = mMisses;
+	stats.evictions = mEvictions;
+	stats.invalidations = mInvalidations;
+	stats.entries = mEntries.size();
+	stats.capacity = mCapacity;
+	return stats;
+}
+
+void VerifyCache::dump()
+{
+	if (!enabled())
+		return;
+	Statistics stats = statistics();
+	uint64_t lookups = stats.hits + stats.misses;
+	Syslog::notice("verify cache: %lu/%lu entries, %llu hits, %llu misses (%.1f%% hit rate), %llu evicted, %llu invalidated",
+		(unsigned long)stats.entries, (unsigned long)stats.capacity, stats.hits, stats.misses,
+		lookups ? 100.0 * stats.hits / lookups : 0.0, stats.evictions, stats.invalidations);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// verifycache - remembered signature verification successes
+//
+#ifndef _H_VERIFYCACHE
+#define _H_VERIFYCACHE
+
+#include <security_utilities/threading.h>
+#include <security_cdsa_utilities/context.h>
+#include <list>
+#include <map>
+#include <string>
+#include <string.h>
+
+using namespace Security;
+
+
+//
+// A VerifyCache remembers successful signature verifications, so a client that
+// verifies the same (key, data, signature) again - a pinned certificate chain,
+// say - gets its answer without another public key operation. An entry is a
+// SHA-256 over the key's canonical digest, the algorithms, and SHA-256 digests
+// of data and signature; failures are never cached. Only plain contexts (no
+// attributes besides the key) qualify, so padding or salt choices can't alias.
+//
+// The cache is bounded (least recently used entries go first) and off unless
+// given a capacity (securityd -V). Entries of a key are dropped when any Key
+// object with that key digest is destroyed.
+//
+class VerifyCache : public Mutex {
+public:
+	VerifyCache();
+	
+	void capacity(size_t entries);		// 0 to disable (and empty)
+	bool enabled() const				{ return mCapacity > 0; }
+	
+	static VerifyCache &shared();		// the one securityd uses
+	static bool cacheable(const Context &context);
+	
+	// identifies one verification
+	struct Tag {
+		uint8_t hash[32];
+		bool operator < (const Tag &other) const { return memcmp(hash, other.hash, sizeof(hash)) < 0; }
+	};
+	static void tag(const CssmData &keyDigest, CSSM_ALGORITHMS algorithm,
+		CSSM_ALGORITHMS verifyOnlyAlgorithm, const CssmData &data, const CssmData &signature,
+		Tag &tag);
+	
+	bool verified(const Tag &tag);		// seen (and succeeded) before?
+	void remember(const Tag &tag, const CssmData &keyDigest); // it just succeeded
+	void forget(const CssmData &keyDigest);	// key released; drop its entries
+	
+	struct Statistics {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;				// dropped for space
+		uint64_t invalidations;			// dropped because their key went away
+		size_t entries;
+		size_t capacity;
+	};
+	Statistics statistics();
+	void dump();						// to the system log (on SIGINFO)
+	
+private:
+	typedef std::string KeyId;			// canonical key digest
+	struct Entry {
+		Tag tag;
+		KeyId key;
+	};
+	typedef std::list<Entry> Entries;	// most recently used first
+	
+	void remove(Entries::iterator entry);	// (caller holds lock)
+	
+	size_t mCapacity;
+	Entries mEntries;
+	std::map<Tag, Entries::iterator> mByTag;
+	std::multimap<KeyId, Entries::iterator> mByKey;
+	
+	uint64_t mHits, mMisses, mEvictions, mInvalidations;
+};
+
+
+#endif //_H_VERIFYCACHE
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// workpool - run batches of independent jobs on a bounded set of threads
+//
+#include "workpool.h"
+#include "server.h"
+#include <security_utilities/logging.h>
+#include <security_utilities/debugging.h>
+
+
+WorkPool::WorkPool(Server &server, unsigned maxThreads)
+	: mServer(server), mWork(*this), mDone(*this), mMaxThreads(maxThreads),
+	  mThreads(0), mIdle(0), mBatchCount(0), mJobCount(0), mPooled(0)
+{
+}
+
+
+//
+// Run a batch. We wake (or start) as many pool threads as there are jobs
+// beyond the one we take on ourselves, then work through the batch alongside
+// them, and finally wait for the jobs they are still running.
+//
+void WorkPool::run(Job **jobs, size_t count)
+{
+	if (count == 0)
+		return;
+	Batch batch = { jobs, count, 0, 0 };
+	StLock<Mutex> _(*this);
+	mBatchCount++;
+	mJobCount += count;
+	if (count > 1) {
+		mBatches.push_back(&batch);
+		size_t helpers = count - 1;
+		for (unsigned woken = 0; helpers > 0 && woken < mIdle; woken++, helpers--)
+			mWork.signal();
+		while (helpers > 0 && mThreads < mMaxThreads) {
+			mThreads++;
+			helpers--;
+			(new Worker(*this))->run();
+		}
+	}
+	while (Job *job = take(&batch)) {
+		_.unlock();
+		perform(job);
+		_.lock();
+		batch.done++;
+	}
+	while (batch.done < batch.count)
+		mDone.wait();
+}
+
+WorkPool::Job *WorkPool::take(Batch *batch)
+{
+	if (batch->next == batch->count)
+		return NULL;
+	Job *job = batch->jobs[batch->next++];
+	if (batch->next == batch->count && batch->count > 1)
+		mBatches.remove(batch);		// (nothing left to hand out)
+	return job;
+}
+
+void WorkPool::perform(Job *job)
+{
+	try {
+		(*job)();
+	} catch (...) {
+		Syslog::error("work pool job %p threw an exception (ignored)", job);
+	}
+}
+
+
+//
+// Pool threads live forever, taking jobs from the oldest batch first
+//
+void WorkPool::Worker::action()
+{
+	mPool.mServer.attachThread();
+	StLock<Mutex> _(mPool);
+	for (;;) {
+		mPool.mIdle++;
+		while (mPool.mBatches.empty())
+			mPool.mWork.wait();
+		mPool.mIdle--;
+		Batch *batch = mPool.mBatches.front();
+		Job *job = mPool.take(batch);
+		_.unlock();
+		mPool.perform(job);
+		_.lock();
+		mPool.mPooled++;
+		if (++batch->done == batch->count)
+			mPool.mDone.broadcast();
+	}
+}
+
+
+WorkPool::Statistics WorkPool::statistics() const
+{
+	StLock<Mutex> _(const_cast<WorkPool &>(*this));
+	Statistics stats = { mBatchCount, mJobCount, mPooled, mThreads, mMaxThreads };
+	return stats;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// workpool - run batches of independent jobs on a bounded set of threads
+//
+#ifndef _H_WORKPOOL
+#define _H_WORKPOOL
+
+#include <security_utilities/threading.h>
+#include <list>
+
+using namespace Security;
+
+class Server;
+
+
+//
+// A WorkPool runs a batch of independent jobs in parallel and returns when all
+// of them are done. The thread that hands in the batch works on it as well, so
+// a batch makes progress even when every pool thread is busy with someone
+// else's; pool threads are started on demand, up to the limit, and then stay.
+// Jobs report their own results, and must not throw; anything that escapes a
+// job is logged and otherwise ignored. Pool threads attach to the Server, so
+// jobs can use its static accessors (Server::csp() and the like).
+//
+class WorkPool : public Mutex {
+public:
+	WorkPool(Server &server, unsigned maxThreads);
+	
+	class Job {
+	public:
+		virtual ~Job() { }
+		virtual void operator () () = 0;
+	};
+	
+	void run(Job **jobs, size_t count);		// run them all; return when done
+	
+	struct Statistics {
+		uint64_t batches;					// batches run
+		uint64_t jobs;						// jobs run
+		uint64_t pooled;					// ... of those, by pool threads
+		unsigned threads;					// pool threads started
+		unsigned maxThreads;				// pool thread limit
+	};
+	Statistics statistics() const;
+	
+private:
+	struct Batch {
+		Job **jobs;
+		size_t count;
+		size_t next;						// next job to hand out
+		size_t done;						// jobs finished
+	};
+	
+	class Worker : public Thread {
+	public:
+		Worker(WorkPool &pool) : mPool(pool) { }
+		void action();
+		
+	private:
+		WorkPool &mPool;
+	};
+	
+	Job *take(Batch *batch);				// hand out a job (caller holds lock)
+	void perform(Job *job);				// run a job, outside the lock
+	
+	Server &mServer;
+	Condition mWork;						// signalled when a batch comes in
+	Condition mDone;						// broadcast when a batch is done
+	std::list<Batch *> mBatches;			// batches with jobs to hand out
+	const unsigned mMaxThreads;				// pool thread limit
+	unsigned mThreads;						// pool threads started
+	unsigned mIdle;							// pool threads waiting for work
+	uint64_t mBatchCount, mJobCount, mPooled;
+};
+
+
+#endif //_H_WORKPOOL
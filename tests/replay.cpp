@@ -0,0 +1,689 @@
+/*
+ * Copyright (c) 2009 Apple Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// replay - play a securityd request trace (securityd -R) back as load
+//
+// Usage: replay [-c threads] [-s timescale] tracefile
+// (Build with testutils.cpp.)
+//
+// Each symbolic connection in the trace is assigned to one of the replay
+// threads, which issues its requests in order at their recorded times
+// (multiplied by timescale; 0 means as fast as possible).
+// Each request is replayed by a stand-in for its request name that makes the
+// same kind of call (and so goes down the same server path) with made-up
+// arguments of about the recorded size. Traces carry handles as symbols, so a
+// key or database a traced request made is made again, and later requests that
+// used it use its replacement. Handles that were made before the trace began
+// (or by a request that failed on replay) are stood in for by keys and databases
+// made up when first needed, outside the timed calls.
+// Requests we have no stand-in for are replayed as random number requests of
+// the recorded size, and reported as such.
+// At the end, we report throughput and latency percentiles, overall and per
+// request name, and how many requests failed that had succeeded when traced.
+//
+#include "testclient.h"
+#include "testutils.h"
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+
+CSSM_GUID ssguid = { 1,2,3 };
+CssmSubserviceUid ssuid(ssguid);
+
+
+struct Record {
+	double start;			// seconds since trace start
+	std::string name;		// request name
+	unsigned size;			// request size in bytes
+	int rcode;				// result when traced
+	std::vector<unsigned> in;	// symbolic handles used, in order
+	std::vector<unsigned> out;	// symbolic handles made, in order
+	double latency;			// seconds, as measured on replay
+};
+
+struct Replayer;
+typedef void StandIn(Replayer &me, const Record &record);
+
+static double timeScale = 1.0;
+static double replayStart;
+
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1E6;
+}
+
+
+//
+// Symbolic handles from the trace, and what they stand for now.
+// Connections may share handles, so this is shared by all replay threads.
+//
+static std::map<unsigned, uint32> symbols;
+static pthread_mutex_t symbolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool lookupSymbol(unsigned symbol, uint32 &handle)
+{
+	pthread_mutex_lock(&symbolLock);
+	std::map<unsigned, uint32>::const_iterator it = symbols.find(symbol);
+	bool found = it != symbols.end();
+	if (found)
+		handle = it->second;
+	pthread_mutex_unlock(&symbolLock);
+	return found;
+}
+
+static void defineSymbol(unsigned symbol, uint32 handle)
+{
+	pthread_mutex_lock(&symbolLock);
+	symbols[symbol] = handle;
+	pthread_mutex_unlock(&symbolLock);
+}
+
+static void forgetSymbol(unsigned symbol)
+{
+	pthread_mutex_lock(&symbolLock);
+	symbols.erase(symbol);
+	pthread_mutex_unlock(&symbolLock);
+}
+
+
+//
+// One replay thread, with its own session (and thus its own reply port).
+// Keys and databases made up to stand in for unknown handles come from here.
+//
+struct Replayer {
+	Replayer();
+	
+	std::vector<Record> records;	// in trace order
+	unsigned failures;				// requests failing that didn't when traced
+	std::map<std::string, unsigned> substituted; // requests without a stand-in
+	
+	ClientSession &session();
+	void go()					{ mStarted = now(); }	// about to make the timed call
+	double started() const		{ return mStarted; }
+	
+	// handles named by a record, made up if unknown
+	enum KeyKind { symmetricKey, signingKey, verifyingKey };
+	KeyHandle key(const Record &record, unsigned n, KeyKind kind);
+	DbHandle database(const Record &record, unsigned n);
+	void made(const Record &record, unsigned n, uint32 handle);
+	void released(const Record &record, unsigned n, KeyKind kind);
+	
+	// material for decoding requests
+	const CssmData &keyBlob(CssmKey::Header &header);
+	const CssmData &dbBlob(std::string &path);
+	
+	static const AccessCredentials &passphrase();
+	DbHandle newDatabase(std::string *path = NULL);
+
+private:
+	ClientSession *mSession;	// made on the replay thread
+	double mStarted;
+	DbHandle mHome;				// for made-up keys
+	KeyHandle mMadeUp[3];		// made-up keys without symbols (by kind)
+	std::string mHomePath;
+	CssmData mKeyBlob;
+	CssmKey::Header mKeyHeader;
+	CssmData mDbBlob;
+};
+
+Replayer::Replayer()
+	: failures(0), mSession(NULL), mStarted(0), mHome(noDb)
+{
+	memset(mMadeUp, 0, sizeof(mMadeUp));
+}
+
+ClientSession &Replayer::session()
+{
+	if (!mSession)
+		mSession = new ClientSession(CssmAllocator::standard(), CssmAllocator::standard());
+	return *mSession;
+}
+
+const AccessCredentials &Replayer::passphrase()
+{
+	static AutoCredentials *cred;
+	if (!cred) {
+		CssmAllocator &alloc = CssmAllocator::standard();
+		StringData pass("replay");
+		cred = new AutoCredentials(alloc);
+		*cred += TypedList(alloc, CSSM_SAMPLE_TYPE_KEYCHAIN_CHANGE_LOCK,
+			new(alloc) ListElement(CSSM_SAMPLE_TYPE_PASSWORD),
+			new(alloc) ListElement(pass));
+		*cred += TypedList(alloc, CSSM_SAMPLE_TYPE_KEYCHAIN_LOCK,
+			new(alloc) ListElement(CSSM_SAMPLE_TYPE_PASSWORD),
+			new(alloc) ListElement(pass));
+	}
+	return *cred;
+}
+
+DbHandle Replayer::newDatabase(std::string *path)
+{
+	static unsigned count;
+	char name[64];
+	snprintf(name, sizeof(name), "/tmp/replay-%d-%d", getpid(), __sync_fetch_and_add(&count, 1));
+	if (path)
+		*path = name;
+	DBParameters params = { 3600, false };
+	return session().createDb(DLDbIdentifier(ssuid, name, NULL), &passphrase(), NULL, params);
+}
+
+KeyHandle Replayer::key(const Record &record, unsigned n, KeyKind kind)
+{
+	KeyHandle handle;
+	if (n < record.in.size() && lookupSymbol(record.in[n], handle))
+		return handle;
+	if (n >= record.in.size() && mMadeUp[kind])
+		return mMadeUp[kind];
+	
+	// make one up
+	if (mHome == noDb)
+		mHome = newDatabase(&mHomePath);
+	CssmKey::Header header;
+	if (kind == symmetricKey) {
+		FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_DES,
+			&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 64),
+			NULL);
+		session().generateKey(mHome, genContext, CSSM_KEYUSE_ENCRYPT | CSSM_KEYUSE_DECRYPT,
+			CSSM_KEYATTR_RETURN_REF, NULL, NULL, handle, header);
+	} else {
+		FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_RSA,
+			&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 512),
+			NULL);
+		KeyHandle publicKey, privateKey;
+		CssmKey::Header privHeader;
+		session().generateKey(mHome, genContext,
+			CSSM_KEYUSE_VERIFY, CSSM_KEYATTR_RETURN_REF,
+			CSSM_KEYUSE_SIGN, CSSM_KEYATTR_RETURN_REF,
+			NULL, NULL, publicKey, header, privateKey, privHeader);
+		handle = (kind == signingKey) ? privateKey : publicKey;
+	}
+	if (n < record.in.size())
+		defineSymbol(record.in[n], handle);
+	else
+		mMadeUp[kind] = handle;
+	return handle;
+}
+
+DbHandle Replayer::database(const Record &record, unsigned n)
+{
+	DbHandle handle;
+	if (n < record.in.size() && lookupSymbol(record.in[n], handle))
+		return handle;
+	handle = newDatabase();
+	if (n < record.in.size())
+		defineSymbol(record.in[n], handle);
+	return handle;
+}
+
+void Replayer::made(const Record &record, unsigned n, uint32 handle)
+{
+	if (n < record.out.size())
+		defineSymbol(record.out[n], handle);
+}
+
+void Replayer::released(const Record &record, unsigned n, KeyKind kind)
+{
+	if (n < record.in.size())
+		forgetSymbol(record.in[n]);
+	else
+		mMadeUp[kind] = noKey;
+}
+
+const CssmData &Replayer::keyBlob(CssmKey::Header &header)
+{
+	if (!mKeyBlob) {
+		if (mHome == noDb)
+			mHome = newDatabase(&mHomePath);
+		FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_DES,
+			&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 64),
+			NULL);
+		KeyHandle key;
+		session().generateKey(mHome, genContext, CSSM_KEYUSE_ENCRYPT | CSSM_KEYUSE_DECRYPT,
+			CSSM_KEYATTR_RETURN_REF, NULL, NULL, key, mKeyHeader);
+		session().encodeKey(key, mKeyBlob);
+		session().releaseKey(key);
+	}
+	header = mKeyHeader;
+	return mKeyBlob;
+}
+
+const CssmData &Replayer::dbBlob(std::string &path)
+{
+	if (!mDbBlob) {
+		if (mHome == noDb)
+			mHome = newDatabase(&mHomePath);
+		session().encodeDb(mHome, mDbBlob);
+	}
+	path = mHomePath;
+	return mDbBlob;
+}
+
+
+//
+// Stand-ins by request name.
+// Each does its setup first and calls go() right before the call that is timed.
+//
+static CssmData payload(std::vector<uint8> &buffer, unsigned size, unsigned blockSize = 1)
+{
+	size = std::max(blockSize, std::min(size, 0x8000U) / blockSize * blockSize);
+	buffer.resize(size);
+	return CssmData(&buffer[0], size);
+}
+
+static void freeOutput(CssmData &data)
+{
+	CssmAllocator::standard().free(data.data());
+}
+
+static CssmKey nullKey;		// (securityd puts in the real key)
+
+static void replayGenerateRandom(Replayer &me, const Record &record)
+{
+	std::vector<uint8> buffer;
+	CssmData data = payload(buffer, record.size);
+	me.go();
+	me.session().generateRandom(data);
+}
+
+// symmetric crypto uses ECB mode without padding, so any data will decrypt
+static void replayCrypt(Replayer &me, const Record &record, bool encrypt)
+{
+	KeyHandle key = me.key(record, 0, Replayer::symmetricKey);
+	FakeContext cryptoContext(CSSM_ALGCLASS_SYMMETRIC, CSSM_ALGID_DES,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY, nullKey),
+		&::Context::Attr(CSSM_ATTRIBUTE_MODE, CSSM_ALGMODE_ECB),
+		&::Context::Attr(CSSM_ATTRIBUTE_PADDING, CSSM_PADDING_NONE),
+		NULL);
+	std::vector<uint8> buffer;
+	CssmData input = payload(buffer, record.size, 8);
+	CssmData output;
+	me.go();
+	if (encrypt)
+		me.session().encrypt(cryptoContext, key, input, output);
+	else
+		me.session().decrypt(cryptoContext, key, input, output);
+	freeOutput(output);
+}
+
+static void replayEncrypt(Replayer &me, const Record &record)	{ replayCrypt(me, record, true); }
+static void replayDecrypt(Replayer &me, const Record &record)	{ replayCrypt(me, record, false); }
+
+static void replayGenerateSignature(Replayer &me, const Record &record)
+{
+	KeyHandle key = me.key(record, 0, Replayer::signingKey);
+	FakeContext signContext(CSSM_ALGCLASS_SIGNATURE, CSSM_ALGID_SHA1WithRSA,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY, nullKey),
+		NULL);
+	std::vector<uint8> buffer;
+	CssmData data = payload(buffer, record.size);
+	CssmData signature;
+	me.go();
+	me.session().generateSignature(signContext, key, data, signature);
+	freeOutput(signature);
+}
+
+// we have no signature to hand, so a full verification fails at the very end
+static void replayVerifySignature(Replayer &me, const Record &record)
+{
+	KeyHandle key = me.key(record, 0, Replayer::verifyingKey);
+	FakeContext signContext(CSSM_ALGCLASS_SIGNATURE, CSSM_ALGID_SHA1WithRSA,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY, nullKey),
+		NULL);
+	std::vector<uint8> buffer, sigBuffer(512 / 8);
+	CssmData data = payload(buffer, record.size);
+	me.go();
+	try {
+		me.session().verifySignature(signContext, key, data, CssmData(&sigBuffer[0], sigBuffer.size()));
+	} catch (const CssmError &err) {
+		if (err.cssmError() != CSSMERR_CSP_VERIFY_FAILED)
+			throw;
+	}
+}
+
+static void replayGenerateKey(Replayer &me, const Record &record)
+{
+	DbHandle db = record.in.empty() ? noDb : me.database(record, 0);
+	FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_DES,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 64),
+		NULL);
+	KeyHandle key;
+	CssmKey::Header header;
+	me.go();
+	me.session().generateKey(db, genContext, CSSM_KEYUSE_ENCRYPT | CSSM_KEYUSE_DECRYPT,
+		CSSM_KEYATTR_RETURN_REF, NULL, NULL, key, header);
+	me.made(record, 0, key);
+}
+
+static void replayGenerateKeyPair(Replayer &me, const Record &record)
+{
+	DbHandle db = record.in.empty() ? noDb : me.database(record, 0);
+	FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_RSA,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 512),
+		NULL);
+	KeyHandle publicKey, privateKey;
+	CssmKey::Header pubHeader, privHeader;
+	me.go();
+	me.session().generateKey(db, genContext,
+		CSSM_KEYUSE_VERIFY, CSSM_KEYATTR_RETURN_REF,
+		CSSM_KEYUSE_SIGN, CSSM_KEYATTR_RETURN_REF,
+		NULL, NULL, publicKey, pubHeader, privateKey, privHeader);
+	me.made(record, 0, publicKey);
+	me.made(record, 1, privateKey);
+}
+
+static void replayReleaseKey(Replayer &me, const Record &record)
+{
+	KeyHandle key = me.key(record, 0, Replayer::symmetricKey);
+	me.released(record, 0, Replayer::symmetricKey);
+	me.go();
+	me.session().releaseKey(key);
+}
+
+static void replayQueryKeySizeInBits(Replayer &me, const Record &record)
+{
+	KeyHandle key = me.key(record, 0, Replayer::symmetricKey);
+	CssmKeySize size;
+	me.go();
+	me.session().queryKeySizeInBits(key, size);
+}
+
+static void replayEncodeKey(Replayer &me, const Record &record)
+{
+	KeyHandle key = me.key(record, 0, Replayer::symmetricKey);
+	CssmData blob;
+	me.go();
+	me.session().encodeKey(key, blob);
+	freeOutput(blob);
+}
+
+static void replayDecodeKey(Replayer &me, const Record &record)
+{
+	CssmKey::Header header;
+	const CssmData &blob = me.keyBlob(header);
+	DbHandle db = me.database(record, 0);
+	me.go();
+	me.made(record, 0, me.session().decodeKey(db, blob, header));
+}
+
+static void replayCreateDb(Replayer &me, const Record &record)
+{
+	me.go();
+	me.made(record, 0, me.newDatabase());
+}
+
+static void replayDecodeDb(Replayer &me, const Record &record)
+{
+	std::string path;
+	const CssmData &blob = me.dbBlob(path);
+	DLDbIdentifier ident(ssuid, path.c_str(), NULL);
+	me.go();
+	me.made(record, 0, me.session().decodeDb(ident, &Replayer::passphrase(), blob));
+}
+
+static void replayEncodeDb(Replayer &me, const Record &record)
+{
+	DbHandle db = me.database(record, 0);
+	CssmData blob;
+	me.go();
+	me.session().encodeDb(db, blob);
+	freeOutput(blob);
+}
+
+static void replayReleaseDb(Replayer &me, const Record &record)
+{
+	DbHandle db = me.database(record, 0);
+	if (!record.in.empty())
+		forgetSymbol(record.in[0]);		// (a made-up database isn't kept)
+	me.go();
+	me.session().releaseDb(db);
+}
+
+static void replayGetDbParameters(Replayer &me, const Record &record)
+{
+	DbHandle db = me.database(record, 0);
+	DBParameters params;
+	me.go();
+	me.session().getDbParameters(db, params);
+}
+
+static void replaySetDbParameters(Replayer &me, const Record &record)
+{
+	DbHandle db = me.database(record, 0);
+	DBParameters params = { 3600, false };
+	me.go();
+	me.session().setDbParameters(db, params);
+}
+
+static void replayGetDbName(Replayer &me, const Record &record)
+{
+	DbHandle db = me.database(record, 0);
+	me.go();
+	me.session().getDbName(db);
+}
+
+static void replayIsLocked(Replayer &me, const Record &record)
+{
+	DbHandle db = me.database(record, 0);
+	me.go();
+	me.session().isLocked(db);
+}
+
+// unlockDb would prompt; we unlock with the passphrase instead
+static void replayUnlockDb(Replayer &me, const Record &record)
+{
+	DbHandle db = me.database(record, 0);
+	me.go();
+	me.session().unlock(db, StringData("replay"));
+}
+
+static const struct {
+	const char *name;
+	StandIn *standIn;
+} standIns[] = {
+	{ "generateRandom", replayGenerateRandom },
+	{ "encrypt", replayEncrypt },
+	{ "decrypt", replayDecrypt },
+	{ "generateSignature", replayGenerateSignature },
+	{ "verifySignature", replayVerifySignature },
+	{ "generateKey", replayGenerateKey },
+	{ "generateKeyPair", replayGenerateKeyPair },
+	{ "releaseKey", replayReleaseKey },
+	{ "queryKeySizeInBits", replayQueryKeySizeInBits },
+	{ "encodeKey", replayEncodeKey },
+	{ "decodeKey", replayDecodeKey },
+	{ "createDb", replayCreateDb },
+	{ "decodeDb", replayDecodeDb },
+	{ "encodeDb", replayEncodeDb },
+	{ "releaseDb", replayReleaseDb },
+	{ "getDbParameters", replayGetDbParameters },
+	{ "setDbParameters", replaySetDbParameters },
+	{ "getDbName", replayGetDbName },
+	{ "isLocked", replayIsLocked },
+	{ "unlockDb", replayUnlockDb },
+	{ "unlockDbWithPassphrase", replayUnlockDb },
+};
+
+static StandIn *standInFor(const std::string &name)
+{
+	for (unsigned n = 0; n < sizeof(standIns) / sizeof(standIns[0]); n++)
+		if (name == standIns[n].name)
+			return standIns[n].standIn;
+	return NULL;
+}
+
+
+static void *replayThread(void *arg)
+{
+	Replayer &me = *static_cast<Replayer *>(arg);
+	for (std::vector<Record>::iterator it = me.records.begin(); it != me.records.end(); it++) {
+		if (timeScale > 0) {
+			double delay = replayStart + it->start * timeScale - now();
+			if (delay > 0)
+				usleep(useconds_t(delay * 1E6));
+		}
+		StandIn *standIn = standInFor(it->name);
+		if (!standIn) {
+			me.substituted[it->name]++;
+			standIn = replayGenerateRandom;
+		}
+		bool failed = false;
+		me.go();
+		try {
+			standIn(me, *it);
+		} catch (...) {
+			failed = true;
+		}
+		it->latency = now() - me.started();
+		if (failed && it->rcode == CSSM_OK)
+			me.failures++;
+	}
+	return NULL;
+}
+
+
+static double percentile(const std::vector<double> &sorted, double fraction)
+{
+	return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, size_t(sorted.size() * fraction))];
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned threadCount = 8;
+	
+	int arg;
+	extern char *optarg;
+	extern int optind;
+	while ((arg = getopt(argc, argv, "c:s:")) != -1) {
+		switch (arg) {
+		case 'c':
+			threadCount = std::max(1, atoi(optarg));
+			break;
+		case 's':
+			timeScale = atof(optarg);
+			break;
+		case '?':
+			exit(2);
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-c threads] [-s timescale] tracefile\n", argv[0]);
+		exit(2);
+	}
+	
+	// read the trace, distributing connections over the replay threads
+	FILE *trace = fopen(argv[optind], "r");
+	if (!trace) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	std::vector<Replayer> replayers(threadCount);
+	char line[1024];
+	unsigned count = 0;
+	while (fgets(line, sizeof(line), trace)) {
+		unsigned long long start, latency;
+		unsigned connection, size;
+		int rcode;
+		char name[256];
+		int used;
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%llu %u %255s %u %d %llu%n",
+				&start, &connection, name, &size, &rcode, &latency, &used) != 6) {
+			fprintf(stderr, "bad trace line: %s", line);
+			continue;
+		}
+		Record record;
+		record.start = start / 1E6;
+		record.name = name;
+		record.size = size;
+		record.rcode = rcode;
+		record.latency = 0;
+		char direction;
+		unsigned symbol;
+		for (const char *p = line + used; ; p += used) {
+			if (sscanf(p, " %c%u%n", &direction, &symbol, &used) != 2)
+				break;
+			(direction == '>' ? record.out : record.in).push_back(symbol);
+		}
+		replayers[connection % threadCount].records.push_back(record);
+		count++;
+	}
+	fclose(trace);
+	printf("* Replaying %d requests on %d threads (time scale %g)\n", count, threadCount, timeScale);
+	
+	// go
+	std::vector<pthread_t> threads(threadCount);
+	replayStart = now();
+	for (unsigned n = 0; n < threadCount; n++)
+		if (pthread_create(&threads[n], NULL, replayThread, &replayers[n])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	for (unsigned n = 0; n < threadCount; n++)
+		pthread_join(threads[n], NULL);
+	double elapsed = now() - replayStart;
+	
+	// gather results
+	std::vector<double> latencies;
+	std::map<std::string, std::vector<double> > byName;
+	std::map<std::string, unsigned> substituted;
+	unsigned failures = 0;
+	for (unsigned n = 0; n < threadCount; n++) {
+		const Replayer &replayer = replayers[n];
+		for (std::vector<Record>::const_iterator it = replayer.records.begin(); it != replayer.records.end(); it++) {
+			latencies.push_back(it->latency);
+			byName[it->name].push_back(it->latency);
+		}
+		for (std::map<std::string, unsigned>::const_iterator it = replayer.substituted.begin();
+				it != replayer.substituted.end(); it++)
+			substituted[it->first] += it->second;
+		failures += replayer.failures;
+	}
+	
+	// report
+	std::sort(latencies.begin(), latencies.end());
+	printf("  %.0f requests/second over %.1f seconds (%d failed that had succeeded when traced)\n",
+		latencies.size() / elapsed, elapsed, failures);
+	printf("  latency (us): p50=%.0f p90=%.0f p99=%.0f max=%.0f\n",
+		percentile(latencies, 0.50) * 1E6, percentile(latencies, 0.90) * 1E6,
+		percentile(latencies, 0.99) * 1E6, latencies.empty() ? 0 : latencies.back() * 1E6);
+	for (std::map<std::string, std::vector<double> >::iterator it = byName.begin(); it != byName.end(); it++) {
+		std::vector<double> &sorted = it->second;
+		std::sort(sorted.begin(), sorted.end());
+		printf("    %-28s %8ld  p50=%.0f p99=%.0f%s\n", it->first.c_str(), long(sorted.size()),
+			percentile(sorted, 0.50) * 1E6, percentile(sorted, 0.99) * 1E6,
+			substituted.count(it->first) ? "  (no stand-in; replayed as generateRandom)" : "");
+	}
+	return failures ? 1 : 0;
+}
@@ -155,6 +155,9 @@ void runtest(char type)
 		case 'k':
 			keychainAcls();
 			break;
+		case 'p':
+			performance();
+			break;
 		case 'K':
 			keyBlobs();
 			break;
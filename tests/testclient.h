@@ -60,6 +60,7 @@ void codeSigning();
 void keychainAcls();
 void authorizations();
 void adhoc();
+void performance();
 
 
 //
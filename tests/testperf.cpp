@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2000-2001,2004 Apple Computer, Inc. All Rights Reserved.
+ * 
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// testperf - throughput drivers for securityserver client side.
+//
+// These are not regression tests; they print numbers. Run them explicitly
+// (test code 'p') against a quiet securityd and compare across builds.
+//
+#include "testclient.h"
+#include "testutils.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <vector>
+
+
+static const unsigned perfIterations = 2000;	// IPCs per thread per run
+
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1E6;
+}
+
+
+//
+// IPC scaling.
+// Each thread opens its own session (and thus its own reply port) and asks
+// whether one shared keychain is locked. That does next to no work beyond
+// finding the connection and the database handle on the server side, so
+// aggregate throughput shows how the registries scale; with them lock-striped,
+// it should keep climbing until the worker pool saturates. Run this against
+// a securityd built before the striping to compare (securityd -B times the
+// connection lookup itself, global lock against stripes, in process).
+//
+static DbHandle scalingDb;
+
+static void *scalingThread(void *)
+{
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	for (unsigned n = 0; n < perfIterations; n++)
+		ss.isLocked(scalingDb);
+	return NULL;
+}
+
+static void ipcScaling()
+{
+	printf("* IPC scaling test\n");
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	DbTester db(ss, "/tmp/perf-scaling", NULL, 3600, false);
+	scalingDb = db;
+	static const unsigned threadCounts[] = { 1, 2, 4, 8, 16, 32 };
+	for (unsigned t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+		unsigned count = threadCounts[t];
+		pthread_t threads[32];
+		double start = now();
+		for (unsigned n = 0; n < count; n++)
+			if (pthread_create(&threads[n], NULL, scalingThread, NULL))
+				error("cannot create thread %d", n);
+		for (unsigned n = 0; n < count; n++)
+			pthread_join(threads[n], NULL);
+		double elapsed = now() - start;
+		printf("  %2d thread(s): %.0f requests/second\n",
+			count, count * perfIterations / elapsed);
+	}
+}
+
+
+//
+// Make up a DES key and put it into securityd
+//
+static KeyHandle installDesKey(ClientSession &ss, CssmKey &keyForm)
+{
+	CSP csp(gGuidAppleCSP);
+	StringData keyBits(strdup("Wallaby!"));
+	keyForm = CssmKey(keyBits);
+	keyForm.header().KeyClass = CSSM_KEYCLASS_SESSION_KEY;
+	keyForm.header().BlobType = CSSM_KEYBLOB_RAW;
+	keyForm.header().AlgorithmId = CSSM_ALGID_DES;
+	keyForm.header().Format = CSSM_KEYBLOB_RAW_FORMAT_OCTET_STRING;
+	Key key(csp, keyForm);
+	CssmData unwrappedData;
+	FakeContext unwrapContext(CSSM_ALGCLASS_SYMMETRIC, CSSM_ALGID_NONE, 0);
+	KeyHandle keyRef;
+	CssmKey::Header keyHeader;
+	ss.unwrapKey(noDb, unwrapContext, noKey, noKey, key,
+		CSSM_KEYUSE_ENCRYPT | CSSM_KEYUSE_DECRYPT, CSSM_KEYATTR_RETURN_DEFAULT,
+		NULL/*cred*/, NULL/*owner*/, unwrappedData, keyRef, keyHeader);
+	return keyRef;
+}
+
+
+
+//
+// Lane isolation.
+// Measures the latency of a cheap request on its own, and again while other
+// threads keep securityd busy generating RSA key pairs. With request lanes,
+// the second number should stay close to the first.
+//
+static volatile bool keepGenerating;
+
+static void *keyPairThread(void *)
+{
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_RSA,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 2048),
+		NULL);
+	while (keepGenerating) {
+		KeyHandle publicKey, privateKey;
+		CssmKey::Header pubHeader, privHeader;
+		ss.generateKey(noDb, genContext,
+			CSSM_KEYUSE_VERIFY, CSSM_KEYATTR_RETURN_REF,
+			CSSM_KEYUSE_SIGN, CSSM_KEYATTR_SENSITIVE,
+			NULL/*cred*/, NULL/*owner*/, publicKey, pubHeader, privateKey, privHeader);
+		ss.releaseKey(publicKey);
+		ss.releaseKey(privateKey);
+	}
+	return NULL;
+}
+
+static double quickLatency(ClientSession &ss)
+{
+	DataBuffer<16> sample;
+	double start = now();
+	for (unsigned n = 0; n < perfIterations; n++)
+		ss.generateRandom(sample);
+	return (now() - start) / perfIterations;
+}
+
+static void laneIsolation()
+{
+	printf("* Lane isolation test\n");
+	static const unsigned generators = 16;
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	double idle = quickLatency(ss);
+	
+	keepGenerating = true;
+	pthread_t threads[generators];
+	for (unsigned n = 0; n < generators; n++)
+		if (pthread_create(&threads[n], NULL, keyPairThread, NULL))
+			error("cannot create thread %d", n);
+	sleep(1);	// let the burst build up
+	double loaded = quickLatency(ss);
+	keepGenerating = false;
+	for (unsigned n = 0; n < generators; n++)
+		pthread_join(threads[n], NULL);
+	
+	printf("  quick request: %.1fus idle, %.1fus during key pair burst\n",
+		idle * 1E6, loaded * 1E6);
+}
+
+
+//
+// Enrollment burst.
+// Time a short run of RSA key pair generations, as an enrollment would make
+// them. With a key pair pool configured (securityd -P rsa:2048:4), the first
+// pairs come off the shelf and should be much faster than the rest.
+//
+static void enrollmentBurst()
+{
+	printf("* Enrollment burst test\n");
+	static const unsigned pairs = 8;
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_RSA,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 2048),
+		NULL);
+	printf("  ");
+	for (unsigned n = 0; n < pairs; n++) {
+		KeyHandle publicKey, privateKey;
+		CssmKey::Header pubHeader, privHeader;
+		double start = now();
+		ss.generateKey(noDb, genContext,
+			CSSM_KEYUSE_VERIFY, CSSM_KEYATTR_RETURN_REF,
+			CSSM_KEYUSE_SIGN, CSSM_KEYATTR_SENSITIVE,
+			NULL/*cred*/, NULL/*owner*/, publicKey, pubHeader, privateKey, privHeader);
+		printf("%.1fms ", (now() - start) * 1E3);
+		ss.releaseKey(publicKey);
+		ss.releaseKey(privateKey);
+	}
+	printf("\n");
+}
+
+
+//
+// Handle lookup.
+// Each thread asks for the size of a key by handle, which is about the
+// cheapest request that has to resolve a key handle on the server side.
+//
+static KeyHandle lookupKey;
+
+static void *lookupThread(void *)
+{
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	CSSM_KEY_SIZE size;
+	for (unsigned n = 0; n < perfIterations; n++)
+		ss.queryKeySizeInBits(lookupKey, size);
+	return NULL;
+}
+
+static void handleLookup()
+{
+	printf("* Handle lookup test\n");
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	CssmKey keyForm;
+	lookupKey = installDesKey(ss, keyForm);
+	for (unsigned count = 1; count <= 64; count *= 2) {
+		pthread_t threads[64];
+		double start = now();
+		for (unsigned n = 0; n < count; n++)
+			if (pthread_create(&threads[n], NULL, lookupThread, NULL))
+				error("cannot create thread %d", n);
+		for (unsigned n = 0; n < count; n++)
+			pthread_join(threads[n], NULL);
+		double elapsed = now() - start;
+		printf("  %2d thread(s): %.0f lookups/second\n",
+			count, count * perfIterations / elapsed);
+	}
+	ss.releaseKey(lookupKey);
+}
+
+
+//
+// Node churn.
+// Creates a large number of keys in one process, then releases them all, and
+// reports the per-key cost of each phase. Every key is a node in securityd's
+// object mesh (referenced by the process), so this mostly measures the cost
+// of linking nodes in and killing them off again. Watch securityd's memory
+// footprint while the keys are held to see the per-node overhead.
+//
+static const unsigned churnKeys = 100000;
+
+static void nodeChurn()
+{
+	printf("* Node churn test (%d keys)\n", churnKeys);
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	CssmKey keyForm;
+	std::vector<KeyHandle> keys(churnKeys);
+	double start = now();
+	for (unsigned n = 0; n < churnKeys; n++)
+		keys[n] = installDesKey(ss, keyForm);
+	double created = now();
+	for (unsigned n = 0; n < churnKeys; n++)
+		ss.releaseKey(keys[n]);
+	double released = now();
+	printf("  create: %.1f usec/key, release: %.1f usec/key\n",
+		(created - start) * 1E6 / churnKeys, (released - created) * 1E6 / churnKeys);
+}
+
+
+//
+// Key blob coding.
+// Encodes a keychain key into a key blob, and decodes it back in, repeatedly.
+// Each of these is a handful of small CSP operations (wrap or unwrap plus a MAC)
+// keyed to the keychain's secrets, so this shows the per-operation overhead of
+// securityd's database crypto rather than the cost of the cryptography itself.
+// securityd writes legacy blobs unless started with -G (sealed, AES-GCM); run
+// this against both to compare the formats. The blob version is printed to tell.
+//
+static void blobCoding()
+{
+	printf("* Key blob coding test\n");
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	DbTester db(ss, "/tmp/perf-blobs", NULL, 3600, false);
+	FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_DES,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 64),
+		NULL);
+	KeyHandle key;
+	CssmKey::Header header;
+	ss.generateKey(db, genContext, CSSM_KEYUSE_ENCRYPT | CSSM_KEYUSE_DECRYPT,
+		CSSM_KEYATTR_RETURN_REF, NULL, NULL, key, header);
+	
+	CssmData blob;
+	double start = now();
+	for (unsigned n = 0; n < perfIterations; n++) {
+		if (blob)
+			CssmAllocator::standard().free(blob.data());
+		ss.encodeKey(key, blob);
+	}
+	double encoded = now();
+	for (unsigned n = 0; n < perfIterations; n++)
+		ss.releaseKey(ss.decodeKey(db, blob, header));
+	double decoded = now();
+	uint32 version = ntohl(((const uint32 *)blob.data())[1]);	// (magic, version, ...)
+	printf("  blob version %#x: encode: %.1f usec/op, decode: %.1f usec/op\n", version,
+		(encoded - start) * 1E6 / perfIterations, (decoded - encoded) * 1E6 / perfIterations);
+	CssmAllocator::standard().free(blob.data());
+	ss.releaseKey(key);
+}
+
+
+//
+// Database blob encoding.
+// Gives a keychain a large ACL, then changes its parameters and fetches its
+// blob, repeatedly. Neither the secrets nor the ACL change, so securityd only
+// has to redo the blob's header and signature (or, for sealed blobs, seal the
+// small encrypted section again); the ACL isn't exported anew.
+//
+static const unsigned dbAclEntries = 500;
+
+static void dbBlobEncoding()
+{
+	printf("* Database blob encoding test (%d ACL entries)\n", dbAclEntries);
+	CssmAllocator &alloc = CssmAllocator::standard();
+	ClientSession ss(alloc, alloc);
+	DbTester db(ss, "/tmp/perf-dbacl", NULL, 3600, false);
+	AutoCredentials cred(alloc);
+	for (unsigned n = 0; n < dbAclEntries; n++) {
+		char comment[64];
+		snprintf(comment, sizeof(comment), "ACL entry %d, padded out to look like an application", n);
+		AclEntryPrototype entry;
+		entry.TypedSubject = TypedList(alloc, CSSM_ACL_SUBJECT_TYPE_COMMENT,
+			new(alloc) ListElement(alloc, comment));
+		strcpy(entry.EntryTag, "perf");
+		AclEntryInput input(entry);
+		AclEdit edit(input);
+		ss.changeDbAcl(db, cred, edit);
+	}
+	
+	CssmData blob;
+	ss.encodeDb(db, blob);		// (the ACL export happens here)
+	size_t blobLength = blob.length();
+	alloc.free(blob.data());
+	
+	DBParameters params = db.params;
+	double start = now();
+	for (unsigned n = 0; n < perfIterations; n++) {
+		params.idleTimeout = 3600 + n % 2;
+		ss.setDbParameters(db, params);
+		ss.encodeDb(db, blob);
+		alloc.free(blob.data());
+	}
+	double elapsed = now() - start;
+	printf("  %ld byte blob: %.1f usec per setDbParameters+encodeDb\n",
+		(long)blobLength, elapsed * 1E6 / perfIterations);
+}
+
+
+//
+// Key residency.
+// Decodes many handles to one keychain key blob, and encrypts with each of them,
+// twice around. The first pass decodes every key; the second finds them decoded,
+// unless securityd runs with a resident key budget (-M) too small to hold them,
+// in which case keys get evicted and decoded again. SIGINFO to securityd
+// shows the resident bytes per session.
+//
+static const unsigned residentKeys = 1000;
+
+static void keyResidency()
+{
+	printf("* Key residency test (%d keys)\n", residentKeys);
+	ClientSession ss(CssmAllocator::standard(), CssmAllocator::standard());
+	DbTester db(ss, "/tmp/perf-resident", NULL, 3600, false);
+	FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_DES,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 64),
+		NULL);
+	KeyHandle key;
+	CssmKey keyForm;
+	ss.generateKey(db, genContext, CSSM_KEYUSE_ENCRYPT | CSSM_KEYUSE_DECRYPT,
+		CSSM_KEYATTR_RETURN_REF, NULL, NULL, key, keyForm.header());
+	CssmData blob;
+	ss.encodeKey(key, blob);
+	ss.releaseKey(key);
+	
+	std::vector<KeyHandle> keys(residentKeys);
+	for (unsigned n = 0; n < residentKeys; n++)
+		keys[n] = ss.decodeKey(db, blob, keyForm.header());
+	
+	StringData iv("abcdefgh");
+	FakeContext cryptoContext(CSSM_ALGCLASS_SYMMETRIC, CSSM_ALGID_DES,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY, keyForm),
+		&::Context::Attr(CSSM_ATTRIBUTE_INIT_VECTOR, iv),
+		&::Context::Attr(CSSM_ATTRIBUTE_MODE, CSSM_ALGMODE_CBC_IV8),
+		&::Context::Attr(CSSM_ATTRIBUTE_PADDING, CSSM_PADDING_PKCS1),
+		NULL);
+	StringData record("Thirty-two bytes of record data.");
+	double pass[2];
+	for (unsigned round = 0; round < 2; round++) {
+		double start = now();
+		for (unsigned n = 0; n < residentKeys; n++) {
+			CssmData cipher;
+			ss.encrypt(cryptoContext, keys[n], record, cipher);
+			CssmAllocator::standard().free(cipher.data());
+		}
+		pass[round] = (now() - start) * 1E6 / residentKeys;
+	}
+	printf("  first use: %.1f usec/key, reuse: %.1f usec/key\n", pass[0], pass[1]);
+	
+	for (unsigned n = 0; n < residentKeys; n++)
+		ss.releaseKey(keys[n]);
+	CssmAllocator::standard().free(blob.data());
+}
+
+
+//
+// Key recoding for keychain sync.
+// Recodes the keys of a 10000-item keychain for a clone (recodeDbForSync) one
+// item at a time, the way sync does it (decodeKey, recodeKey, releaseKey). All
+// items share one key blob, which doesn't matter to securityd.
+//
+static const unsigned recodeItems = 10000;
+
+static void keyRecoding()
+{
+	printf("* Key recoding test (%d items)\n", recodeItems);
+	CssmAllocator &alloc = CssmAllocator::standard();
+	ClientSession ss(alloc, alloc);
+	DbTester source(ss, "/tmp/perf-recode-source", NULL, 3600, false);
+	DbTester donor(ss, "/tmp/perf-recode-donor", NULL, 3600, false);
+	DbHandle clone = ss.recodeDbForSync(donor, source);
+	FakeContext genContext(CSSM_ALGCLASS_KEYGEN, CSSM_ALGID_DES,
+		&::Context::Attr(CSSM_ATTRIBUTE_KEY_LENGTH, 64),
+		NULL);
+	KeyHandle key;
+	CssmKey::Header header;
+	ss.generateKey(source, genContext, CSSM_KEYUSE_ENCRYPT | CSSM_KEYUSE_DECRYPT,
+		CSSM_KEYATTR_RETURN_REF, NULL, NULL, key, header);
+	CssmData blob;
+	ss.encodeKey(key, blob);
+	ss.releaseKey(key);
+	
+	double start = now();
+	for (unsigned n = 0; n < recodeItems; n++) {
+		KeyHandle item = ss.decodeKey(source, blob, header);
+		CssmData newBlob;
+		ss.recodeKey(source, item, clone, newBlob);
+		alloc.free(newBlob.data());
+		ss.releaseKey(item);
+	}
+	double single = now() - start;
+	
+	printf("  %d items: %.2fs, %.0f usec/item\n",
+		recodeItems, single, single * 1E6 / recodeItems);
+	alloc.free(blob.data());
+	ss.releaseDb(clone);
+}
+
+
+//
+// Passphrase derivation.
+// Locks and unlocks a keychain with a passphrase credential, repeatedly. Each
+// unlock derives the keychain's master key from the passphrase (PBKDF2, 1000
+// rounds of HMAC/SHA-1), which dwarfs everything else it does, so this comes out
+// as derivations per second.
+//
+static void passphraseDerivation()
+{
+	printf("* Passphrase derivation test\n");
+	CssmAllocator &alloc = CssmAllocator::standard();
+	ClientSession ss(alloc, alloc);
+	StringData passphrase("derivation");
+	AutoCredentials pwCred(alloc);
+	pwCred += TypedList(alloc, CSSM_SAMPLE_TYPE_KEYCHAIN_CHANGE_LOCK,
+		new(alloc) ListElement(CSSM_SAMPLE_TYPE_PASSWORD),
+		new(alloc) ListElement(passphrase));
+	pwCred += TypedList(alloc, CSSM_SAMPLE_TYPE_KEYCHAIN_LOCK,
+		new(alloc) ListElement(CSSM_SAMPLE_TYPE_PASSWORD),
+		new(alloc) ListElement(passphrase));
+	DbTester db(ss, "/tmp/perf-derive", &pwCred, 3600, false);
+	
+	static const unsigned unlocks = perfIterations / 10;
+	double start = now();
+	for (unsigned n = 0; n < unlocks; n++) {
+		ss.lock(db);
+		ss.unlock(db);
+	}
+	double elapsed = now() - start;
+	printf("  %d unlocks: %.0f derivations/second\n", unlocks, unlocks / elapsed);
+}
+
+
+//
+// Run all performance drivers
+//
+void performance()
+{
+	ipcScaling();
+	enrollmentBurst();		// (before laneIsolation drains the pool)
+	laneIsolation();
+	handleLookup();
+	nodeChurn();
+	blobCoding();
+	dbBlobEncoding();
+	keyResidency();
+	keyRecoding();
+	passphraseDerivation();
+}